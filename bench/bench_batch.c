@@ -0,0 +1,118 @@
+/*
+ * Compare add_xct_batch with one add_xct per transaction on an import:
+ * batches of transactions for a group of users, each batch spread over a
+ * given number of those users. Both sides start from the same group and
+ * post the same transactions; the batch side must end with the same users
+ * in the same order with the same balances.
+ *
+ * The spread is swept from a few users per batch, where add_xct_batch
+ * moves each user once, to every user, where it rebuilds the order.
+ *
+ * Usage: bench_batch [users] [batch size] [batches]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../lists.h"
+
+/* A standard template for error messages */
+void error(const char *msg) {
+    fprintf(stderr, "Error: %s\n", msg);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Group *make_group(GroupDir *dir, unsigned long users, char (*names)[24]) {
+    Group *group;
+    unsigned long i;
+
+    init_group_dir(dir);
+    dir_add_group(dir, "g");
+    group = dir_find_group(dir, "g");
+    for ( i = 0; i < users; i++ ) {
+        add_user(group, names[i]);
+    }
+    return group;
+}
+
+/*
+ * Returns 1 if a and b have the same users in the same order with the
+ * same balances.
+ */
+static int same_order(Group *a, Group *b) {
+    User *x, *y;
+
+    for ( x = a->users, y = b->users; x && y; x = x->next, y = y->next ) {
+        if ( strcmp(x->name, y->name) != 0 || x->balance != y->balance ) {
+            return 0;
+        }
+    }
+    return x == NULL && y == NULL;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long users = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    unsigned long size = argc > 2 ? strtoul(argv[2], NULL, 10) : 5000;
+    unsigned long batches = argc > 3 ? strtoul(argv[3], NULL, 10) : 20;
+    unsigned long spreads[] = {10, 100, 1000, 5000, 20000, 100000};
+    char (*names)[24];
+    struct batch_xct *items;
+    unsigned long s, i, b, missing;
+    int ok = 1;
+
+    if ( users == 0 || size == 0 || batches == 0 ) {
+        fprintf(stderr, "Usage: %s [users] [batch size] [batches]\n", argv[0]);
+        return 1;
+    }
+    names = malloc(users * sizeof(*names));
+    items = malloc(size * sizeof(struct batch_xct));
+    for ( i = 0; i < users; i++ ) {
+        snprintf(names[i], sizeof(names[i]), "u%lu", i);
+    }
+
+    printf("users %lu, batches of %lu\n", users, size);
+    printf("%-16s %14s %14s %9s\n", "users per batch", "add_xct ms", "batch ms", "speedup");
+    for ( s = 0; s < sizeof(spreads) / sizeof(spreads[0]); s++ ) {
+        unsigned long spread = spreads[s] < users ? spreads[s] : users;
+        unsigned int seed = 1;
+        double single = 0, batched = 0, t0;
+        GroupDir oneDir, batchDir;
+        Group *one = make_group(&oneDir, users, names);
+        Group *batch = make_group(&batchDir, users, names);
+
+        for ( b = 0; b < batches; b++ ) {
+            unsigned long first = rand_r(&seed) % users;
+            for ( i = 0; i < size; i++ ) {
+                items[i].user_name = names[(first + rand_r(&seed) % spread) % users];
+                items[i].amount = rand_r(&seed) % 20000;
+            }
+            t0 = now();
+            for ( i = 0; i < size; i++ ) {
+                add_xct(one, items[i].user_name, items[i].amount, b);
+            }
+            single += now() - t0;
+            t0 = now();
+            add_xct_batch(batch, items, size, b, &missing, NULL);
+            batched += now() - t0;
+        }
+        ok &= same_order(one, batch);
+        printf("%-16lu %14.2f %14.2f %8.1fx\n", spread, single * 1e3 / batches, batched * 1e3 / batches, single / batched);
+        free_group_dir(&oneDir);
+        free_group_dir(&batchDir);
+        if ( spread == users ) {
+            break;
+        }
+    }
+    if ( !ok ) {
+        printf("add_xct_batch left the users in a different order\n");
+    }
+    free(names);
+    free(items);
+    return !ok;
+}
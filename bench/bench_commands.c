@@ -0,0 +1,190 @@
+/*
+ * Run a batch file (such as one from gen_workload) and time every command
+ * on its own. Prints, for each command name, how many ran, their rate
+ * (commands per second of time spent in that command) and latency
+ * percentiles; the output the commands print is captured and dropped.
+ *
+ * With a results file, also appends one CSV line per command,
+ *
+ *   label,command,count,ops_per_s,p50_us,p90_us,p99_us,max_us
+ *
+ * (the header is written when the file is new), so that runs on different
+ * commits can be compared by label.
+ *
+ * Usage: bench_commands workload [results.csv] [label]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../commands.h"
+#include "../output.h"
+
+#define BENCH_MAX_COMMANDS 32
+
+struct timing {
+    char name[32];
+    double *latencies;  // microseconds
+    unsigned long count;
+    unsigned long cap;
+    double total;       // seconds
+};
+
+static struct timing timings[BENCH_MAX_COMMANDS];
+static int ntimings;
+
+/* A standard template for error messages */
+void error(const char *msg) {
+    err_printf("Error: %s\n", msg);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The timing for command name, added if it is new; NULL if there are too many */
+static struct timing *timing_for(const char *name) {
+    int i;
+
+    for ( i = 0; i < ntimings; i++ ) {
+        if ( strcmp(timings[i].name, name) == 0 ) {
+            return &timings[i];
+        }
+    }
+    if ( ntimings == BENCH_MAX_COMMANDS ) {
+        return NULL;
+    }
+    snprintf(timings[ntimings].name, sizeof(timings[ntimings].name), "%s", name);
+    return &timings[ntimings++];
+}
+
+static void record(struct timing *t, double seconds) {
+    if ( t->count == t->cap ) {
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        t->latencies = realloc(t->latencies, t->cap * sizeof(double));
+        if ( t->latencies == NULL ) {
+            printf("Error while allocating memory for latencies. Program will now exit. \n");
+            exit(0);
+        }
+    }
+    t->latencies[t->count++] = seconds * 1e6;
+    t->total += seconds;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Read all of path into a NUL-terminated buffer */
+static char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    char *buf;
+
+    if ( f == NULL || fseek(f, 0, SEEK_END) != 0 ) {
+        return NULL;
+    }
+    *len = ftell(f);
+    rewind(f);
+    buf = malloc(*len + 1);
+    if ( buf == NULL || fread(buf, 1, *len, f) != *len ) {
+        fclose(f);
+        free(buf);
+        return NULL;
+    }
+    buf[*len] = '\0';
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    const char *results = argc > 2 ? argv[2] : NULL;
+    const char *label = argc > 3 ? argv[3] : "unlabeled";
+    struct capture out = {NULL, 0, 0}, err = {NULL, 0, 0};
+    char *cmd_argv[INPUT_ARG_MAX_NUM], *buf, *p, *end;
+    unsigned long lines = 0, errors = 0;
+    double start, elapsed;
+    GroupDir groups;
+    size_t len;
+    int i;
+
+    if ( argc < 2 ) {
+        fprintf(stderr, "Usage: %s workload [results.csv] [label]\n", argv[0]);
+        return 1;
+    }
+    buf = read_file(argv[1], &len);
+    if ( buf == NULL ) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    init_group_dir(&groups);
+    capture_output(&out, &err);
+    start = now();
+    for ( p = buf, end = buf + len; p < end; p++ ) {
+        char *nl = memchr(p, '\n', end - p);
+        if ( nl == NULL ) {
+            nl = end;   // buf[len] is writable
+        }
+        int cmd_argc = tokenize_in_place(p, nl, cmd_argv);
+        p = nl;
+        if ( cmd_argc == 0 ) {
+            continue;
+        }
+        struct timing *t = timing_for(cmd_argv[0]);
+        double t0 = now();
+        process_args(cmd_argc, cmd_argv, &groups);
+        double t1 = now();
+        if ( t ) {
+            record(t, t1 - t0);
+        }
+        if ( err.len ) {
+            errors++;
+        }
+        out.len = err.len = 0;
+        lines++;
+    }
+    elapsed = now() - start;
+    capture_output(NULL, NULL);
+
+    printf("%lu commands in %.3f s (%.0f/s), %lu with errors\n", lines, elapsed, lines / elapsed, errors);
+    printf("%-20s %10s %12s %9s %9s %9s %9s\n", "command", "count", "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+
+    FILE *csv = NULL;
+    if ( results ) {
+        csv = fopen(results, "a");
+        if ( csv == NULL ) {
+            perror(results);
+            return 1;
+        }
+        if ( ftell(csv) == 0 ) {
+            fprintf(csv, "label,command,count,ops_per_s,p50_us,p90_us,p99_us,max_us\n");
+        }
+    }
+    for ( i = 0; i < ntimings; i++ ) {
+        struct timing *t = &timings[i];
+        double *l = t->latencies;
+        unsigned long n = t->count;
+
+        qsort(l, n, sizeof(double), compare_doubles);
+        printf("%-20s %10lu %12.0f %9.2f %9.2f %9.2f %9.2f\n", t->name, n, n / t->total,
+                l[n / 2], l[n * 9 / 10], l[n * 99 / 100], l[n - 1]);
+        if ( csv ) {
+            fprintf(csv, "%s,%s,%lu,%.0f,%.3f,%.3f,%.3f,%.3f\n", label, t->name, n, n / t->total,
+                    l[n / 2], l[n * 9 / 10], l[n * 99 / 100], l[n - 1]);
+        }
+        free(l);
+    }
+    if ( csv ) {
+        fclose(csv);
+    }
+
+    capture_release(&out);
+    capture_release(&err);
+    free_group_dir(&groups);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Time add_xct through process_args with no change feed and with a feed
+ * to a file, and report the latency percentiles of each. The two sides
+ * post the same transactions to groups of their own, in alternating
+ * rounds so both see the same machine. The feed must end up with one
+ * record per change, numbered without gaps, with the balances the group
+ * ends with. The spread of the rounds' medians on each side shows how
+ * much of the difference is noise.
+ *
+ * Usage: bench_feed [transactions] [users] [directory]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../commands.h"
+#include "../output.h"
+
+#define ROUNDS 8
+
+/* A standard template for error messages */
+void error(const char *msg) {
+    err_printf("Error: %s\n", msg);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sort the count latencies at l and return their median */
+static double median(double *l, unsigned long count) {
+    qsort(l, count, sizeof(double), compare_doubles);
+    return l[count / 2];
+}
+
+/*
+ * Run the command in line through process_args. Returns its latency in
+ * microseconds.
+ */
+static double run(GroupDir *dir, const char *line) {
+    char buf[96], *cmd_argv[INPUT_ARG_MAX_NUM];
+    int cmd_argc;
+    double t0;
+
+    strcpy(buf, line);
+    cmd_argc = tokenize_in_place(buf, buf + strlen(buf), cmd_argv);
+    t0 = now();
+    process_args(cmd_argc, cmd_argv, dir);
+    return (now() - t0) * 1e6;
+}
+
+/*
+ * Check the feed at path: records numbered 1 to count, and for every
+ * user of group, their last record carries their balance. Returns 1 if
+ * it does.
+ */
+static int check_feed(const char *path, unsigned long count, Group *group) {
+    FILE *file = fopen(path, "r");
+    Money *last = calloc(group->id_count, sizeof(Money));
+    char line[256], op[16], groupName[16], userName[16];
+    unsigned long seq, expected = 1;
+    User *user;
+    int ok = file != NULL && last != NULL;
+
+    while ( ok && fgets(line, sizeof(line), file) ) {
+        char *balance = strrchr(line, ' ');
+        line[strcspn(line, "\n")] = '\0';
+        if ( sscanf(line, "%lu %15s %15s %15s", &seq, op, groupName, userName) < 3 || seq != expected++ ) {
+            ok = 0;
+        } else if ( strcmp(op, "add_group") != 0 && (user = find_user(group, userName)) != NULL ) {
+            parse_money(balance + 1, &last[user->id]);
+        }
+    }
+    ok = ok && expected - 1 == count;
+    for ( user = group->users; ok && user; user = user->next ) {
+        ok = last[user->id] == user->balance;
+    }
+    if ( file ) {
+        fclose(file);
+    }
+    free(last);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    unsigned long users = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+    const char *dirName = argc > 3 ? argv[3] : "/tmp";
+    static const char *const sides[2] = {"no feed", "feed to file"};
+    double *latencies[2], total[2] = {0, 0}, p50[2][ROUNDS];
+    GroupDir dirs[2];
+    char path[4096], line[96];
+    unsigned long i, k;
+    unsigned int seed = 1;
+    int side, r, ok;
+
+    if ( n < ROUNDS || users == 0 ) {
+        fprintf(stderr, "Usage: %s [transactions] [users] [directory]\n", argv[0]);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/bench_feed.%d", dirName, (int) getpid());
+    unlink(path);
+    for ( side = 0; side < 2; side++ ) {
+        latencies[side] = malloc(n * sizeof(double));
+        if ( latencies[side] == NULL ) {
+            printf("Error while allocating memory for latencies. Program will now exit. \n");
+            exit(0);
+        }
+    }
+    if ( (command_feed = feed_open(path)) == NULL ) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 1;
+    }
+    for ( side = 0; side < 2; side++ ) {
+        Feed *feed = command_feed;
+        init_group_dir(&dirs[side]);
+        command_feed = side ? feed : NULL;
+        run(&dirs[side], "add_group g");
+        for ( i = 0; i < users; i++ ) {
+            snprintf(line, sizeof(line), "add_user g u%lu", i);
+            run(&dirs[side], line);
+        }
+        command_feed = feed;
+    }
+
+    for ( r = 0, i = 0; r < ROUNDS; r++ ) {
+        unsigned long end = n / ROUNDS * (r + 1) + (r == ROUNDS - 1 ? n % ROUNDS : 0);
+        unsigned int roundSeed = seed;
+        for ( side = 0; side < 2; side++ ) {
+            Feed *feed = command_feed;
+            double t0 = now();
+            seed = roundSeed;
+            command_feed = side ? feed : NULL;
+            for ( k = i; k < end; k++ ) {
+                unsigned long user = rand_r(&seed) % users;
+                int amount = rand_r(&seed) % 20000;
+                snprintf(line, sizeof(line), "add_xct g u%lu %d.%02d %lu", user, amount / 100, amount % 100, k);
+                latencies[side][k] = run(&dirs[side], line);
+            }
+            total[side] += now() - t0;
+            command_feed = feed;
+        }
+        i = end;
+    }
+    feed_close(command_feed);
+    command_feed = NULL;
+    ok = check_feed(path, 1 + users + n, dir_find_group(&dirs[1], "g"));
+    unlink(path);
+
+    for ( side = 0; side < 2; side++ ) {
+        for ( r = 0, i = 0; r < ROUNDS; r++ ) {
+            unsigned long end = n / ROUNDS * (r + 1) + (r == ROUNDS - 1 ? n % ROUNDS : 0);
+            p50[side][r] = median(latencies[side] + i, end - i);
+            i = end;
+        }
+    }
+
+    printf("%lu add_xct, %lu users\n", n, users);
+    printf("%-14s %10s %9s %9s %9s %9s %9s\n", "", "ops/s", "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+    for ( side = 0; side < 2; side++ ) {
+        double *l = latencies[side], sum = 0;
+        for ( i = 0; i < n; i++ ) {
+            sum += l[i];
+        }
+        qsort(l, n, sizeof(double), compare_doubles);
+        printf("%-14s %10.0f %9.3f %9.3f %9.3f %9.3f %9.1f\n", sides[side], n / total[side], sum / n,
+                l[n / 2], l[n * 99 / 100], l[n * 999 / 1000], l[n - 1]);
+        qsort(p50[side], ROUNDS, sizeof(double), compare_doubles);
+        printf("%-14s p50 of the %d rounds from %.3f to %.3f us\n", "", ROUNDS, p50[side][0], p50[side][ROUNDS - 1]);
+        free(l);
+        free_group_dir(&dirs[side]);
+    }
+    if ( !ok ) {
+        printf("the feed does not match the group\n");
+    }
+    return !ok;
+}
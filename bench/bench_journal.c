@@ -0,0 +1,82 @@
+/*
+ * Compare journal commit policies: append the same stream of add_xct
+ * records under each policy and report throughput and fdatasync calls.
+ *
+ * Usage: bench_journal [records] [directory]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../journal.h"
+
+#define BENCH_USERS 100
+
+struct policy {
+    const char *name;
+    unsigned long commit_every;
+    unsigned long commit_ms;
+};
+
+static const struct policy policies[] = {
+    {"every 1", 1, 0},
+    {"every 64", 64, 0},
+    {"every 1024", 1024, 0},
+    {"window 1 ms", 0, 1},
+    {"window 10 ms", 0, 10},
+    {"1024 or 10 ms", 1024, 10},
+    {"on close only", 0, 0},
+};
+
+/* A standard template for error messages */
+void error(const char *msg) {
+    fprintf(stderr, "Error: %s\n", msg);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long records = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    const char *dirName = argc > 2 ? argv[2] : "/tmp";
+    char path[4096], user[16];
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s/bench_journal.%d", dirName, (int) getpid());
+    printf("%-16s %10s %12s %10s\n", "policy", "seconds", "records/s", "syncs");
+
+    for ( i = 0; i < sizeof(policies) / sizeof(policies[0]); i++ ) {
+        GroupDir dir;
+        Journal *journal;
+        unsigned long n, commits;
+        double start, elapsed;
+
+        unlink(path);
+        init_group_dir(&dir);
+        journal = journal_open(path, &dir, policies[i].commit_every, policies[i].commit_ms);
+        if ( journal == NULL ) {
+            error("Could not open journal");
+            return 1;
+        }
+
+        start = now();
+        for ( n = 0; n < records; n++ ) {
+            snprintf(user, sizeof(user), "u%lu", n % BENCH_USERS);
+            journal_append(journal, JOURNAL_ADD_XCT, "bench", user, n % 1000 * 10, n);
+        }
+        journal_commit(journal);
+        elapsed = now() - start;
+        commits = journal->commits;
+        journal_close(journal);
+
+        printf("%-16s %10.3f %12.0f %10lu\n", policies[i].name, elapsed, records / elapsed, commits);
+        free_group_dir(&dir);
+    }
+    unlink(path);
+    return 0;
+}
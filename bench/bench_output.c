@@ -0,0 +1,130 @@
+/*
+ * Run a batch file through buxfer -m -E -P with its output going into a
+ * pipe, with and without -A (the async output writer), and time each run
+ * as the reader of the pipe takes the output at a given rate: it reads up
+ * to 64 KiB at a time and then spends as long on them as the rate allows,
+ * like a terminal or a socket to a slower machine. Both runs must print
+ * the same bytes.
+ *
+ * Without a rate, the runs are made with an unlimited reader and then
+ * with readers of 40, 20 and 10 MiB/s.
+ *
+ * Usage: bench_output [batch file] [MiB/s] [buxfer]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define READ_BYTES 65536
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run buxfer on file, with -A if async, reading its output at rate MiB/s
+ * (0 for as fast as it comes). Returns the seconds from start to exit and
+ * sets *bytes and *sum to the size and a checksum of the output, or
+ * returns -1 if buxfer could not be run or failed.
+ */
+static double run(const char *buxfer, const char *file, int async, double rate,
+        unsigned long *bytes, unsigned long *sum) {
+    static char buf[READ_BYTES];
+    int fds[2], status;
+    double start, due = 0;
+    ssize_t n;
+    pid_t pid;
+
+    if ( pipe(fds) == -1 ) {
+        return -1;
+    }
+    start = now();
+    pid = fork();
+    if ( pid == -1 ) {
+        return -1;
+    }
+    if ( pid == 0 ) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if ( async ) {
+            execl(buxfer, buxfer, "-m", "-E", "-P", "-A", file, (char *) NULL);
+        } else {
+            execl(buxfer, buxfer, "-m", "-E", "-P", file, (char *) NULL);
+        }
+        _exit(127);
+    }
+    close(fds[1]);
+
+    *bytes = 0;
+    *sum = 0;
+    while ( (n = read(fds[0], buf, sizeof(buf))) > 0 ) {
+        ssize_t i;
+        for ( i = 0; i < n; i++ ) {
+            *sum = *sum * 31 + (unsigned char) buf[i];
+        }
+        *bytes += n;
+        if ( rate > 0 ) {
+            double wait;
+            // the reader is busy with each read for its bytes at the rate
+            due = (due > now() ? due : now()) + n / (rate * 1048576.0);
+            wait = due - now();
+            if ( wait > 0 ) {
+                struct timespec ts = {(time_t) wait, (long) ((wait - (time_t) wait) * 1e9)};
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    close(fds[0]);
+    if ( waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+        return -1;
+    }
+    return now() - start;
+}
+
+int main(int argc, char *argv[]) {
+    const char *file = argc > 1 ? argv[1] : "bench/workload.txt";
+    const char *buxfer = argc > 3 ? argv[3] : "./buxfer";
+    double rates[] = {0, 40, 20, 10};
+    int nrates = sizeof(rates) / sizeof(rates[0]), r, ok = 1;
+
+    if ( argc > 2 ) {
+        rates[0] = atof(argv[2]);
+        nrates = 1;
+        if ( rates[0] <= 0 ) {
+            fprintf(stderr, "Usage: %s [batch file] [MiB/s] [buxfer]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%s\n", file);
+    printf("%-12s %12s %12s %12s\n", "reader", "MiB out", "sync s", "async s");
+    for ( r = 0; r < nrates; r++ ) {
+        unsigned long bytes[2], sums[2];
+        double sync = run(buxfer, file, 0, rates[r], &bytes[0], &sums[0]);
+        double async = run(buxfer, file, 1, rates[r], &bytes[1], &sums[1]);
+        char label[24];
+
+        if ( sync < 0 || async < 0 ) {
+            fprintf(stderr, "Could not run %s on %s\n", buxfer, file);
+            return 1;
+        }
+        if ( rates[r] > 0 ) {
+            snprintf(label, sizeof(label), "%.0f MiB/s", rates[r]);
+        } else {
+            snprintf(label, sizeof(label), "unlimited");
+        }
+        printf("%-12s %12.1f %12.3f %12.3f\n", label, bytes[0] / 1048576.0, sync, async);
+        if ( bytes[0] != bytes[1] || sums[0] != sums[1] ) {
+            printf("-A printed something else at %s\n", label);
+            ok = 0;
+        }
+    }
+    return !ok;
+}
@@ -0,0 +1,240 @@
+/*
+ * Compare settle with a naive settlement that starts from scratch every
+ * time: gather every balance, sort the debts and credits, then match them
+ * the same greedy way with two heaps. Each round posts one transaction and
+ * settles both ways; settle gets its order from the group's balance-ordered
+ * user list instead of sorting, and a settle with no change in between
+ * reprints the transfers it kept. The work out and the printing (into
+ * memory) are timed apart.
+ *
+ * Both results are checked: after the transfers everyone must have paid
+ * their share to the cent, in at most n - 1 transfers.
+ *
+ * Usage: bench_settle [users] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../settle.h"
+#include "../output.h"
+
+struct entry {
+    Money amount;
+    unsigned int id;
+};
+
+/* A standard template for error messages */
+void error(const char *msg) {
+    fprintf(stderr, "Error: %s\n", msg);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int larger_first(const void *a, const void *b) {
+    Money x = ((const struct entry *) a)->amount, y = ((const struct entry *) b)->amount;
+    return x > y ? -1 : x < y;
+}
+
+static void sift_down(struct entry *heap, unsigned long n, unsigned long i) {
+    struct entry e = heap[i];
+
+    for ( ;; ) {
+        unsigned long child = 2 * i + 1;
+        if ( child >= n ) {
+            break;
+        }
+        if ( child + 1 < n && heap[child + 1].amount > heap[child].amount ) {
+            child++;
+        }
+        if ( heap[child].amount <= e.amount ) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = e;
+}
+
+static void take_top(struct entry *heap, unsigned long *n, Money amount) {
+    heap[0].amount -= amount;
+    if ( heap[0].amount == 0 ) {
+        heap[0] = heap[--*n];
+    }
+    if ( *n > 0 ) {
+        sift_down(heap, *n, 0);
+    }
+}
+
+/*
+ * Settle group from scratch into transfers, sorting the shares. Returns
+ * the number of transfers.
+ */
+static unsigned long naive_settle(Group *group, struct transfer *transfers) {
+    unsigned long n = 0, debtors = 0, creditors = 0, count = 0, i;
+    struct entry *all = malloc(group->user_count * sizeof(struct entry));
+    struct entry *debts, *credits;
+    Money total = 0, share;
+    long extra;
+    User *user;
+
+    for ( user = group->users; user; user = user->next ) {
+        all[n].amount = user->balance;
+        all[n++].id = user->id;
+        total += user->balance;
+    }
+    share = total / (Money) n;
+    if ( share * (Money) n > total ) {
+        share--;
+    }
+    extra = total - share * (Money) n;
+
+    qsort(all, n, sizeof(struct entry), larger_first);
+    debts = malloc(n * sizeof(struct entry));
+    credits = malloc(n * sizeof(struct entry));
+    for ( i = 0; i < n; i++ ) {
+        // the lowest payers, at the end, owe the extra cents
+        Money net = all[i].amount - share - ((long) (n - 1 - i) < extra);
+        if ( net > 0 ) {
+            credits[creditors].amount = net;
+            credits[creditors++].id = all[i].id;
+        } else if ( net < 0 ) {
+            debts[debtors].amount = -net;
+            debts[debtors++].id = all[i].id;
+        }
+    }
+    qsort(debts, debtors, sizeof(struct entry), larger_first);
+
+    while ( debtors > 0 && creditors > 0 ) {
+        Money amount = debts[0].amount < credits[0].amount ? debts[0].amount : credits[0].amount;
+        transfers[count].from = debts[0].id;
+        transfers[count].to = credits[0].id;
+        transfers[count++].amount = amount;
+        take_top(debts, &debtors, amount);
+        take_top(credits, &creditors, amount);
+    }
+    free(all);
+    free(debts);
+    free(credits);
+    return count;
+}
+
+static void print_transfers(Group *group, const struct transfer *transfers, unsigned long count) {
+    unsigned long i;
+
+    for ( i = 0; i < count; i++ ) {
+        out_printf("%s pays %s $" MONEY_FMT "\n", group->user_ids[transfers[i].from]->name,
+                group->user_ids[transfers[i].to]->name, MONEY_ARGS(transfers[i].amount));
+    }
+}
+
+/*
+ * Check that count transfers even out group: afterwards every balance is
+ * the floor of the average, or one cent more. Returns 1 if they do.
+ */
+static int check(Group *group, const struct transfer *transfers, unsigned long count) {
+    Money *after = malloc(group->id_count * sizeof(Money));
+    Money total = 0, share, low, high;
+    unsigned long i, n = group->user_count;
+    int ok = count < n;
+    User *user;
+
+    for ( user = group->users; user; user = user->next ) {
+        after[user->id] = user->balance;
+        total += user->balance;
+    }
+    for ( i = 0; i < count; i++ ) {
+        after[transfers[i].from] += transfers[i].amount;
+        after[transfers[i].to] -= transfers[i].amount;
+    }
+    share = total / (Money) n;
+    if ( share * (Money) n > total ) {
+        share--;
+    }
+    low = share;
+    high = share + (total - share * (Money) n > 0);
+    for ( user = group->users; user; user = user->next ) {
+        if ( after[user->id] < low || after[user->id] > high ) {
+            ok = 0;
+        }
+    }
+    free(after);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long users = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    unsigned long rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 20;
+    struct capture out = {NULL, 0, 0}, err = {NULL, 0, 0};
+    double naive = 0, naivePrint = 0, fresh = 0, cached = 0, t0;
+    unsigned long i, naiveCount = 0;
+    unsigned int seed = 1;
+    struct transfer *transfers;
+    char name[32];
+    GroupDir dir;
+    Group *group;
+    int ok = 1;
+
+    if ( users == 0 || rounds == 0 ) {
+        fprintf(stderr, "Usage: %s [users] [rounds]\n", argv[0]);
+        return 1;
+    }
+    init_group_dir(&dir);
+    dir_add_group(&dir, "g");
+    group = dir_find_group(&dir, "g");
+    for ( i = 0; i < users; i++ ) {
+        snprintf(name, sizeof(name), "u%lu", i);
+        add_user(group, name);
+    }
+    for ( i = 0; i < users * 4; i++ ) {
+        snprintf(name, sizeof(name), "u%lu", (unsigned long) rand_r(&seed) % users);
+        add_xct(group, name, rand_r(&seed) % 100000, 0);
+    }
+    transfers = malloc(users * sizeof(struct transfer));
+
+    capture_output(&out, &err);
+    for ( i = 0; i < rounds; i++ ) {
+        snprintf(name, sizeof(name), "u%lu", (unsigned long) rand_r(&seed) % users);
+        add_xct(group, name, rand_r(&seed) % 100000, 0);
+
+        t0 = now();
+        naiveCount = naive_settle(group, transfers);
+        naive += now() - t0;
+        t0 = now();
+        print_transfers(group, transfers, naiveCount);
+        naivePrint += now() - t0;
+        out.len = 0;
+        ok &= check(group, transfers, naiveCount);
+
+        t0 = now();
+        settle_compute(group);      // what settle does first after a change
+        fresh += now() - t0;
+
+        t0 = now();
+        settle(group);
+        cached += now() - t0;
+        out.len = 0;
+        ok &= check(group, group->transfers, group->transfer_count);
+    }
+    capture_output(NULL, NULL);
+
+    printf("users %lu, rounds %lu, transfers %lu (naive %lu)\n", users, rounds, group->transfer_count, naiveCount);
+    printf("%-28s %12s %12s\n", "settlement", "work out ms", "total ms");
+    printf("%-28s %12.2f %12.2f\n", "naive (sort every time)", naive * 1e3 / rounds, (naive + naivePrint) * 1e3 / rounds);
+    printf("%-28s %12.2f %12.2f\n", "settle after add_xct", fresh * 1e3 / rounds, (fresh + cached) * 1e3 / rounds);
+    printf("%-28s %12.2f %12.2f\n", "settle, unchanged group", 0.0, cached * 1e3 / rounds);
+    if ( !ok ) {
+        printf("a settlement did not even out the group\n");
+    }
+
+    capture_release(&out);
+    capture_release(&err);
+    free(transfers);
+    free_group_dir(&dir);
+    return !ok;
+}
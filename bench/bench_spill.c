@@ -0,0 +1,153 @@
+/*
+ * Post transactions to a group with all of them in memory, then again with
+ * a hot window (xct_hot_records) that spills the rest to disk, and compare
+ * the memory each keeps and the time posting and reading take: recent_xct
+ * within the window and reaching past it, and user_spend over ranges in
+ * memory and on disk. The reads are printed into memory, and both sides
+ * must print the same.
+ *
+ * Usage: bench_spill [transactions] [hot records] [users]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../lists.h"
+#include "../xctlog.h"
+#include "../output.h"
+
+#define READS 6
+#define READ_ROUNDS 5
+
+/* A standard template for error messages */
+void error(const char *msg) {
+    fprintf(stderr, "Error: %s\n", msg);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Bytes of memory the group's transactions take: log chunks, index
+ * tables and the users' totals.
+ */
+static size_t xct_memory(Group *group) {
+    size_t bytes = group->xcts.chunks.reserved
+            + group->xcts.index_capacity * sizeof(struct xct_chunk *)
+            + group->xcts.table_capacity * (sizeof(struct xct_chunk *) + sizeof(unsigned int));
+    User *user;
+
+    for ( user = group->users; user; user = user->next ) {
+        if ( user->totals ) {
+            bytes += sizeof(struct user_totals) + user->totals->capacity * (sizeof(Money) + sizeof(XctRef));
+        }
+    }
+    return bytes;
+}
+
+/*
+ * Run read number i of reads on group.
+ */
+static void run_read(Group *group, int i, unsigned long n, unsigned long hot) {
+    uint32_t end = n / 16;
+
+    switch ( i ) {
+    case 0:
+        recent_xct(group, hot / 2 > 0 ? hot / 2 : 1);
+        break;
+    case 1:
+        recent_xct(group, hot * 4);
+        break;
+    case 2:
+        recent_xct(group, n);
+        break;
+    case 3:
+        user_spend(group, "u1", end - end / 8, end);
+        break;
+    case 4:
+        user_spend(group, "u1", end / 4, end / 2);
+        break;
+    default:
+        user_spend(group, "u1", 0, end / 8);
+        break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : 4000000;
+    unsigned long hot = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+    unsigned long users = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000;
+    static const char *const reads[READS] = {
+        "recent_xct hot/2", "recent_xct 4*hot", "recent_xct all",
+        "user_spend last 1/8", "user_spend middle", "user_spend first 1/8"
+    };
+    struct capture outputs[2][READS], err = {NULL, 0, 0};
+    double times[2][READS], post[2];
+    size_t memory[2];
+    unsigned long i;
+    char name[24];
+    int side, r, k, ok = 1;
+
+    if ( n == 0 || hot == 0 || users < 2 ) {
+        fprintf(stderr, "Usage: %s [transactions] [hot records] [users]\n", argv[0]);
+        return 1;
+    }
+    memset(outputs, 0, sizeof(outputs));
+
+    for ( side = 0; side < 2; side++ ) {
+        unsigned int seed = 1;
+        GroupDir dir;
+        Group *group;
+        double t0;
+
+        xct_hot_records = side ? hot : 0;
+        init_group_dir(&dir);
+        dir_add_group(&dir, "g");
+        group = dir_find_group(&dir, "g");
+        for ( i = 0; i < users; i++ ) {
+            snprintf(name, sizeof(name), "u%lu", i);
+            add_user(group, name);
+        }
+
+        t0 = now();
+        for ( i = 0; i < n; i++ ) {
+            User *user = group->user_ids[rand_r(&seed) % users];
+            post_xct(group, user, rand_r(&seed) % 20001 - 10000, i / 16);
+        }
+        post[side] = now() - t0;
+        memory[side] = xct_memory(group);
+
+        for ( r = 0; r < READS; r++ ) {
+            capture_output(&outputs[side][r], &err);
+            t0 = now();
+            for ( k = 0; k < READ_ROUNDS; k++ ) {
+                outputs[side][r].len = 0;
+                run_read(group, r, n, hot);
+            }
+            times[side][r] = (now() - t0) / READ_ROUNDS;
+            capture_output(NULL, NULL);
+        }
+        free_group_dir(&dir);
+    }
+
+    printf("%lu transactions, %lu users, hot window %lu\n", n, users, hot);
+    printf("%-22s %14s %14s\n", "", "in memory", "hot window");
+    printf("%-22s %14.1f %14.1f\n", "memory MiB", memory[0] / 1048576.0, memory[1] / 1048576.0);
+    printf("%-22s %14.0f %14.0f\n", "posts/s", n / post[0], n / post[1]);
+    for ( r = 0; r < READS; r++ ) {
+        printf("%-22s %11.3f ms %11.3f ms\n", reads[r], times[0][r] * 1e3, times[1][r] * 1e3);
+        if ( outputs[0][r].len != outputs[1][r].len
+                || memcmp(outputs[0][r].buf, outputs[1][r].buf, outputs[0][r].len) != 0 ) {
+            printf("%s printed something else with a hot window\n", reads[r]);
+            ok = 0;
+        }
+        capture_release(&outputs[0][r]);
+        capture_release(&outputs[1][r]);
+    }
+    capture_release(&err);
+    return !ok;
+}
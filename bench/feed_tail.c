@@ -0,0 +1,85 @@
+/*
+ * Print the records of a change feed file (see feed.h) from a sequence
+ * number on, found by binary search rather than by reading the file from
+ * the start. With -f, keep following the file as buxfer appends to it,
+ * like tail -f; only whole lines are printed.
+ *
+ * Usage: feed_tail [-f] <feed file> [from seq]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../feed.h"
+
+#define TAIL_READ_BYTES 65536
+#define TAIL_POLL_MS 10
+
+/* A standard template for error messages */
+void error(const char *msg) {
+    fprintf(stderr, "Error: %s\n", msg);
+}
+
+int main(int argc, char *argv[]) {
+    static char buf[TAIL_READ_BYTES];
+    struct timespec poll = {0, TAIL_POLL_MS * 1000000L};
+    unsigned long from = 1;
+    int fd, opt, follow = 0;
+    size_t held = 0;
+    off_t at;
+
+    while ( (opt = getopt(argc, argv, "f")) != -1 ) {
+        if ( opt != 'f' ) {
+            fprintf(stderr, "Usage: %s [-f] <feed file> [from seq]\n", argv[0]);
+            return 1;
+        }
+        follow = 1;
+    }
+    if ( optind >= argc || optind < argc - 2 ) {
+        fprintf(stderr, "Usage: %s [-f] <feed file> [from seq]\n", argv[0]);
+        return 1;
+    }
+    if ( optind == argc - 2 ) {
+        from = strtoul(argv[optind + 1], NULL, 10);
+    }
+    if ( (fd = open(argv[optind], O_RDONLY)) == -1 || (at = feed_find(fd, from)) == -1 ) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    for ( ;; ) {
+        ssize_t n = pread(fd, buf + held, sizeof(buf) - held, at);
+        char *nl;
+
+        if ( n == -1 ) {
+            perror(argv[optind]);
+            return 1;
+        }
+        if ( n == 0 ) {
+            if ( !follow ) {
+                break;
+            }
+            fflush(stdout);
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        at += n;
+        held += n;
+        // print the whole lines and keep the start of a line still being written
+        nl = memrchr(buf, '\n', held);
+        if ( nl != NULL ) {
+            size_t whole = nl + 1 - buf;
+            fwrite(buf, 1, whole, stdout);
+            memmove(buf, buf + whole, held - whole);
+            held -= whole;
+        } else if ( held == sizeof(buf) ) {
+            fwrite(buf, 1, held, stdout);   // a line longer than the buffer
+            held = 0;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Write a synthetic batch file to stdout: add the groups and users, then a
+ * stream of operations that are reads with probability -r percent and
+ * writes otherwise. Which user an operation touches follows a Zipf
+ * distribution with exponent -s, so a few users are much more active than
+ * the rest (-s 0 makes them all equally likely).
+ *
+ *   writes: add_xct, or with probability -d percent remove_user followed
+ *           by add_user of the same user
+ *   reads:  user_balance, under_paid and recent_xct, weighted by -b, -p
+ *           and -x; recent_xct asks for the last -n transactions
+ *
+ * Usage: gen_workload [-g groups] [-u users per group] [-o operations]
+ *                     [-s skew] [-r read percent] [-d remove percent]
+ *                     [-b balance weight] [-p under_paid weight]
+ *                     [-x recent_xct weight] [-n recent count] [-S seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+
+static unsigned long long state;
+
+/* xorshift64*, so workloads are the same on every platform for a seed */
+static unsigned long long next_random(void) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+/* A uniform double in [0, 1) */
+static double next_uniform(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* The index of the first entry of the n-entry cdf that is > u */
+static int pick(const double *cdf, int n, double u) {
+    int lo = 0, hi = n - 1;
+
+    while ( lo < hi ) {
+        int mid = (lo + hi) / 2;
+        if ( cdf[mid] > u ) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+int main(int argc, char *argv[]) {
+    int groups = 16, users = 1000, c, g, u;
+    unsigned long operations = 200000, i, recentCount = 10;
+    double skew = 1.0, readPct = 30, removePct = 0.5;
+    double balanceWeight = 8, underWeight = 1, recentWeight = 1;
+    double *cdf, total = 0;
+
+    state = 88172645463325252ULL;
+    while ( (c = getopt(argc, argv, "g:u:o:s:r:d:b:p:x:n:S:")) != -1 ) {
+        switch ( c ) {
+        case 'g': groups = atoi(optarg); break;
+        case 'u': users = atoi(optarg); break;
+        case 'o': operations = strtoul(optarg, NULL, 10); break;
+        case 's': skew = atof(optarg); break;
+        case 'r': readPct = atof(optarg); break;
+        case 'd': removePct = atof(optarg); break;
+        case 'b': balanceWeight = atof(optarg); break;
+        case 'p': underWeight = atof(optarg); break;
+        case 'x': recentWeight = atof(optarg); break;
+        case 'n': recentCount = strtoul(optarg, NULL, 10); break;
+        case 'S': state = strtoull(optarg, NULL, 10) | 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-g groups] [-u users] [-o operations] [-s skew] [-r read%%] [-d remove%%]\n"
+                    "       [-b balance weight] [-p under_paid weight] [-x recent_xct weight] [-n recent count] [-S seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if ( groups < 1 || users < 1 || balanceWeight + underWeight + recentWeight <= 0 ) {
+        fprintf(stderr, "Error: bad arguments\n");
+        return 1;
+    }
+
+    // rank r (0 = most active) has weight 1 / (r + 1)^skew
+    cdf = malloc(users * sizeof(double));
+    if ( cdf == NULL ) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+    for ( u = 0; u < users; u++ ) {
+        total += 1 / pow(u + 1, skew);
+        cdf[u] = total;
+    }
+    for ( u = 0; u < users; u++ ) {
+        cdf[u] /= total;
+    }
+
+    for ( g = 0; g < groups; g++ ) {
+        printf("add_group g%d\n", g);
+        for ( u = 0; u < users; u++ ) {
+            printf("add_user g%d u%d\n", g, u);
+        }
+    }
+
+    for ( i = 0; i < operations; i++ ) {
+        g = next_random() % groups;
+        u = pick(cdf, users, next_uniform());
+        if ( next_uniform() * 100 < readPct ) {
+            double r = next_uniform() * (balanceWeight + underWeight + recentWeight);
+            if ( r < balanceWeight ) {
+                printf("user_balance g%d u%d\n", g, u);
+            } else if ( r < balanceWeight + underWeight ) {
+                printf("under_paid g%d\n", g);
+            } else {
+                printf("recent_xct g%d %lu\n", g, recentCount);
+            }
+        } else if ( next_uniform() * 100 < removePct ) {
+            printf("remove_user g%d u%d\nadd_user g%d u%d\n", g, u, g, u);
+        } else {
+            // 0.00 to 199.99, in whole cents
+            printf("add_xct g%d u%d %.2f\n", g, u, (next_random() % 20000) / 100.0);
+        }
+    }
+    free(cdf);
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Load generator for server mode: each connection pipelines add_xct and
+ * user_balance requests, keeping up to depth of them in flight, and the
+ * latency of every request is measured from send to complete response.
+ *
+ * Usage: loadgen address [connections] [requests per connection] [depth] [groups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../server.h"
+
+struct conn {
+    const char *address;
+    int id;
+    int groups;
+    unsigned long requests;
+    unsigned long depth;
+    double *latencies;  // microseconds, one per request
+    int failed;
+    pthread_t thread;
+};
+
+/* A standard template for error messages */
+void error(const char *msg) {
+    fprintf(stderr, "Error: %s\n", msg);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while ( len > 0 ) {
+        ssize_t n = write(fd, buf, len);
+        if ( n <= 0 ) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Responses read from a connection but not yet consumed */
+struct reader {
+    int fd;
+    char buf[65536];
+    size_t start;
+    size_t len;
+};
+
+/*
+ * Consume one whole response from r, reading more as needed. Returns 0, or
+ * -1 if the connection broke.
+ */
+static int read_response(struct reader *r) {
+    for ( ;; ) {
+        char *p = r->buf + r->start, *nl = memchr(p, '\n', r->len);
+        if ( nl ) {
+            unsigned long outLen, errLen;
+            if ( sscanf(p, "%lu %lu", &outLen, &errLen) != 2 ) {
+                return -1;
+            }
+            size_t need = nl + 1 - p + outLen + errLen;
+            if ( need <= r->len ) {
+                r->start += need;
+                r->len -= need;
+                return 0;
+            }
+            if ( need > sizeof(r->buf) ) {
+                return -1;
+            }
+        }
+        memmove(r->buf, r->buf + r->start, r->len);
+        r->start = 0;
+        ssize_t n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+        if ( n <= 0 ) {
+            return -1;
+        }
+        r->len += n;
+    }
+}
+
+static void *conn_main(void *arg) {
+    struct conn *conn = arg;
+    struct reader *r = malloc(sizeof(struct reader));
+    double *sent = malloc(conn->depth * sizeof(double));
+    char group[32], user[32], line[128], *batch = malloc(conn->depth * sizeof(line));
+    unsigned long issued = 0, done = 0;
+    int fd = server_socket(conn->address, 0);
+
+    if ( fd == -1 || r == NULL || sent == NULL || batch == NULL ) {
+        conn->failed = 1;
+        return NULL;
+    }
+    r->fd = fd;
+    r->start = r->len = 0;
+
+    snprintf(group, sizeof(group), "lg%d", conn->id % conn->groups);
+    snprintf(user, sizeof(user), "c%d", conn->id);
+    int n = snprintf(line, sizeof(line), "add_group %s\nadd_user %s %s\n", group, group, user);
+    if ( write_all(fd, line, n) == -1 || read_response(r) == -1 || read_response(r) == -1 ) {
+        conn->failed = 1;
+        return NULL;
+    }
+
+    while ( done < conn->requests ) {
+        size_t len = 0;
+        double t = now();
+        while ( issued < conn->requests && issued - done < conn->depth ) {
+            if ( issued % 10 == 9 ) {
+                len += sprintf(batch + len, "user_balance %s %s\n", group, user);
+            } else {
+                len += sprintf(batch + len, "add_xct %s %s 1.25\n", group, user);
+            }
+            sent[issued % conn->depth] = t;
+            issued++;
+        }
+        if ( len && write_all(fd, batch, len) == -1 ) {
+            conn->failed = 1;
+            break;
+        }
+        do {
+            if ( read_response(r) == -1 ) {
+                conn->failed = 1;
+                goto out;
+            }
+            conn->latencies[done] = (now() - sent[done % conn->depth]) * 1e6;
+            done++;
+        } while ( r->len > 0 && done < issued );   // drain what has arrived
+    }
+out:
+    close(fd);
+    free(batch);
+    free(sent);
+    free(r);
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    if ( argc < 2 ) {
+        fprintf(stderr, "Usage: %s address [connections] [requests] [depth] [groups]\n", argv[0]);
+        return 1;
+    }
+    int connections = argc > 2 ? atoi(argv[2]) : 8;
+    unsigned long requests = argc > 3 ? strtoul(argv[3], NULL, 10) : 100000;
+    unsigned long depth = argc > 4 ? strtoul(argv[4], NULL, 10) : 16;
+    int groups = argc > 5 ? atoi(argv[5]) : connections;
+    struct conn *conns = calloc(connections, sizeof(struct conn));
+    double *all = malloc(connections * requests * sizeof(double));
+    int i;
+
+    if ( connections < 1 || depth < 1 || groups < 1 || conns == NULL || all == NULL ) {
+        fprintf(stderr, "Error: bad arguments\n");
+        return 1;
+    }
+
+    double start = now();
+    for ( i = 0; i < connections; i++ ) {
+        conns[i].address = argv[1];
+        conns[i].id = i;
+        conns[i].groups = groups;
+        conns[i].requests = requests;
+        conns[i].depth = depth;
+        conns[i].latencies = all + i * requests;
+        pthread_create(&conns[i].thread, NULL, conn_main, &conns[i]);
+    }
+    for ( i = 0; i < connections; i++ ) {
+        pthread_join(conns[i].thread, NULL);
+        if ( conns[i].failed ) {
+            fprintf(stderr, "Error: connection %d failed\n", i);
+            return 1;
+        }
+    }
+    double elapsed = now() - start;
+    unsigned long total = connections * requests;
+
+    qsort(all, total, sizeof(double), compare_doubles);
+    printf("connections %d depth %lu requests %lu\n", connections, depth, total);
+    printf("requests/s: %.0f\n", total / elapsed);
+    printf("latency us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+            all[total / 2], all[total * 9 / 10], all[total * 99 / 100], all[total * 999 / 1000], all[total - 1]);
+    free(all);
+    free(conns);
+    return 0;
+}
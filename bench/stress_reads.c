@@ -0,0 +1,215 @@
+/*
+ * Stress lock-free reads of a shared group: one writer posts transactions
+ * and removes and re-adds users while reader threads take snapshots with
+ * group_read_begin / group_read_retry. Every snapshot that is not retried
+ * must be consistent:
+ *
+ *   - the user list is in balance order and holds user_count users
+ *   - the balances add up to the live transactions in the log
+ *   - each user's running totals end at their balance
+ *
+ * Readers also check group_total, the group's running sums and its highest
+ * balance (what group_summary prints) against the same, and run the read
+ * commands through process_args to exercise their retry loops.
+ * The writer's rate is measured alone and with the readers running, to
+ * show readers don't hold it up.
+ *
+ * Usage: stress_reads [readers] [seconds] [users]
+ * Exits 1 if any reader saw an inconsistent snapshot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "../lists.h"
+#include "../xctlog.h"
+#include "../commands.h"
+#include "../output.h"
+
+#define STRESS_MAX_CHUNKS (1UL << 20)
+
+static GroupDir dir;
+static Group *group;
+static int users = 64;
+static volatile int stop;
+
+struct reader {
+    unsigned long reads;
+    unsigned long retries;
+    unsigned long violations;
+    pthread_t thread;
+};
+
+/* A standard template for error messages */
+void error(const char *msg) {
+    err_printf("Error: %s\n", msg);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Post transactions, and now and then remove a user and add it back, until
+ * stop is set. Returns the number of changes made.
+ */
+static unsigned long write_for(double seconds) {
+    unsigned int seed = 1;
+    unsigned long ops = 0;
+    double end = now() + seconds;
+    char name[16];
+
+    while ( !stop && (ops % 1024 != 0 || now() < end) ) {
+        int r = rand_r(&seed) % 1000;
+        snprintf(name, sizeof(name), "u%d", rand_r(&seed) % users);
+        group_write_begin(group);
+        if ( r < 10 ) {
+            remove_user(group, name);
+        } else if ( r < 20 ) {
+            add_user(group, name);
+        } else {
+            add_xct(group, name, (rand_r(&seed) % 40001 - 20000), ops);  // ops for the time
+        }
+        group_write_end(group);
+        ops++;
+    }
+    return ops;
+}
+
+/*
+ * Take one snapshot of the group and check it. Returns 1 if it was
+ * consistent, 0 if it was torn and must be retried, -1 on a violation.
+ */
+static int check_snapshot(void) {
+    unsigned long seq = group_read_begin(group);
+    unsigned long count = group->user_count, seen = 0, xcts = 0, chunks = 0;
+    Money balances = 0, amounts = 0, last = 0, total = group_total(group);
+    int ordered = 1, totalled = 1;
+    User *user;
+    struct xct_chunk *chunk;
+
+    for ( user = group->users; user && seen <= count; user = user->next ) {
+        if ( seen > 0 && user->balance < last ) {
+            ordered = 0;
+        }
+        last = user->balance;
+        balances += user->balance;
+        struct user_totals *totals = __atomic_load_n(&user->totals, __ATOMIC_ACQUIRE);
+        unsigned int n = totals ? __atomic_load_n(&totals->count, __ATOMIC_ACQUIRE) : 0;
+        if ( (n ? totals->items[n - 1] : 0) != user->balance ) {
+            totalled = 0;
+        }
+        seen++;
+    }
+    for ( chunk = group->xcts.head; chunk && chunks < STRESS_MAX_CHUNKS; chunk = chunk->next, chunks++ ) {
+        unsigned long i, n = chunk->count;
+        for ( i = 0; i < n && i < XCT_CHUNK_RECORDS; i++ ) {
+            if ( chunk->records[i].user_id != XCT_REMOVED ) {
+                amounts += chunk->records[i].amount;
+                xcts++;
+            }
+        }
+    }
+    unsigned long logCount = group->xcts.count;
+    Money balanceSum = group->balance_sum, xctSum = group->xct_sum;
+    User *lastUser = group->last_user;
+    int ends = (count == 0 && lastUser == NULL) || (lastUser && lastUser->balance == last);
+
+    if ( group_read_retry(group, seq) ) {
+        return 0;
+    }
+    if ( !ordered || !totalled || seen != count || balances != amounts || total != balances || xcts != logCount
+            || balanceSum != balances || xctSum != amounts || !ends ) {
+        fprintf(stderr, "violation: ordered %d, totals %d, %lu of %lu users, balances %lld, total %lld, transactions %lld (%lu of %lu), "
+                "sums %lld %lld, ends %d\n", ordered, totalled, seen, count, (long long) balances, (long long) total,
+                (long long) amounts, xcts, logCount, (long long) balanceSum, (long long) xctSum, ends);
+        return -1;
+    }
+    return 1;
+}
+
+static void *reader_main(void *arg) {
+    struct reader *reader = arg;
+    struct capture out = {NULL, 0, 0}, err = {NULL, 0, 0};
+    char line[64], *cmd_argv[INPUT_ARG_MAX_NUM];
+    static const char *const commands[] = {
+        "list_users g", "under_paid g", "recent_xct g 20", "user_balance g u1",
+        "group_total g", "group_average g", "xct_range g 100000 100100",
+        "user_spend g u1 0 100000", "group_summary g"
+    };
+    unsigned long i = 0;
+
+    capture_output(&out, &err);
+    while ( !stop ) {
+        int result = check_snapshot();
+        if ( result == 0 ) {
+            reader->retries++;
+            continue;
+        }
+        reader->reads++;
+        if ( result == -1 ) {
+            reader->violations++;
+        }
+        if ( ++i % 16 == 0 ) {
+            strcpy(line, commands[(i / 16) % (sizeof(commands) / sizeof(commands[0]))]);
+            int cmd_argc = tokenize_in_place(line, line + strlen(line), cmd_argv);
+            process_args(cmd_argc, cmd_argv, &dir);
+            out.len = err.len = 0;
+        }
+    }
+    capture_output(NULL, NULL);
+    capture_release(&out);
+    capture_release(&err);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int readers = argc > 1 ? atoi(argv[1]) : 4;
+    double seconds = argc > 2 ? atof(argv[2]) : 2;
+    struct reader *r;
+    unsigned long reads = 0, retries = 0, violations = 0, alone, shared;
+    char name[16];
+    int i;
+
+    if ( argc > 3 ) {
+        users = atoi(argv[3]);
+    }
+    r = calloc(readers > 0 ? readers : 1, sizeof(struct reader));
+    if ( readers < 0 || users < 1 || r == NULL ) {
+        fprintf(stderr, "Usage: %s [readers] [seconds] [users]\n", argv[0]);
+        return 1;
+    }
+
+    init_group_dir(&dir);
+    dir_add_group(&dir, "g");
+    group = dir_find_group(&dir, "g");
+    for ( i = 0; i < users; i++ ) {
+        snprintf(name, sizeof(name), "u%d", i);
+        add_user(group, name);
+    }
+    share_group_dir(&dir);
+
+    alone = write_for(seconds / 2);
+    for ( i = 0; i < readers; i++ ) {
+        pthread_create(&r[i].thread, NULL, reader_main, &r[i]);
+    }
+    shared = write_for(seconds / 2);
+    stop = 1;
+    for ( i = 0; i < readers; i++ ) {
+        pthread_join(r[i].thread, NULL);
+        reads += r[i].reads;
+        retries += r[i].retries;
+        violations += r[i].violations;
+    }
+
+    printf("readers %d, users %d, %.1f s\n", readers, users, seconds);
+    printf("writer: %.0f changes/s alone, %.0f changes/s with readers\n", alone / (seconds / 2), shared / (seconds / 2));
+    printf("readers: %lu consistent snapshots, %lu retries, %lu violations\n", reads, retries, violations);
+    free_group_dir(&dir);
+    free(r);
+    return violations ? 1 : 0;
+}
@@ -3,129 +3,348 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <getopt.h>
 #include "lists.h"
+#include "snapshot.h"
+#include "commands.h"
+#include "output.h"
+#include "parallel.h"
+#include "server.h"
+#include "compile.h"
+#include "xctlog.h"
 
-#define INPUT_BUFFER_SIZE 256
-#define INPUT_ARG_MAX_NUM 5
 #define DELIM " \n"
 
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
 
 /* A standard template for error messages */
 void error(const char *msg) {
-    fprintf(stderr, "Error: %s\n", msg);
+    err_printf("Error: %s\n", msg);
 }
 
-/* 
- * Read and process buxfer commands
+/*
+ * Run the batch file at path by mapping it into memory and tokenizing each
+ * line where it lies, so there is no copy into a line buffer and no limit
+ * on line length. The mapping is private: the '\0's written by the
+ * tokenizer never reach the file, and the pages they dirty are dropped
+ * every MAPPED_RELEASE_BYTES so memory use stays flat on huge files.
+ *
+ * Returns 0 when the file has been processed, or -1 if it can't be read.
  */
-int process_args(int cmd_argc, char **cmd_argv, Group **group_list_addr) {
-    Group *group_list = *group_list_addr; 
-    Group *g;
+static int run_mapped_batch(const char *path, GroupDir *groups, int echo, int prompt) {
+    char *cmd_argv[INPUT_ARG_MAX_NUM];
+    struct stat st;
+    int fd = open(path, O_RDONLY);
 
-    if (cmd_argc <= 0) {
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
         return 0;
-    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
         return -1;
-        
-    } else if (strcmp(cmd_argv[0], "add_group") == 0 && cmd_argc == 2) {
-        if (add_group(group_list_addr, cmd_argv[1]) == -1) {
-            error("Group already exists");
-        }
-        
-    } else if (strcmp(cmd_argv[0], "list_groups") == 0 && cmd_argc == 1) {
-        list_groups(group_list);
-        
-    } else if (strcmp(cmd_argv[0], "add_user") == 0 && cmd_argc == 3) {
-        if ((g = find_group(group_list, cmd_argv[1])) == NULL) {
-            error("Group does not exist");
-        } else {
-            if (add_user(g, cmd_argv[2]) == -1) {
-                error("User already exists");
-            }
-        }
-        
-    } else if (strcmp(cmd_argv[0], "remove_user") == 0 && cmd_argc == 3) {
-        if ((g = find_group(group_list, cmd_argv[1])) == NULL) {
-            error("Group does not exist");
-        } else {
-            if (remove_user(g, cmd_argv[2]) == -1) {
-                error("User does not exist");
-            }
-        }
-        
-    } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 2) {
-        if ((g = find_group(group_list, cmd_argv[1])) == NULL) {
-            error("Group does not exist");
-        } else {
-            list_users(g);
-        }
-        
-    } else if (strcmp(cmd_argv[0], "user_balance") == 0 && cmd_argc == 3) {
-        if ((g = find_group(group_list, cmd_argv[1])) == NULL) {
-            error("Group does not exist");
-        } else {
-            if (user_balance(g, cmd_argv[2]) == -1) {
-                error("User does not exist");
-            }
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    char *end = map + st.st_size;
+    char *released = map;
+    char *line = map;
+    char *last_line = NULL;
+
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        int cmd_argc;
+
+        if (echo) {
+            out_write(line, (eol ? eol + 1 : end) - line);
         }
-        
-    } else if (strcmp(cmd_argv[0], "under_paid") == 0 && cmd_argc == 2) {
-        if ((g = find_group(group_list, cmd_argv[1])) == NULL) {
-            error("Group does not exist");
+        if (eol) {
+            cmd_argc = tokenize_in_place(line, eol, cmd_argv);
         } else {
-            if (under_paid(g) == -1) {
-                error("User list empty");
+            /* the last line has no newline to overwrite, and the byte after
+             * the mapping may not exist, so tokenize a copy of it */
+            last_line = malloc(end - line + 1);
+            if (last_line == NULL) {
+                error("Out of memory");
+                break;
             }
+            memcpy(last_line, line, end - line);
+            cmd_argc = tokenize_in_place(last_line, last_line + (end - line), cmd_argv);
+            eol = end;
         }
-        
-    } else if (strcmp(cmd_argv[0], "add_xct") == 0 && cmd_argc == 4) {
-        if ((g = find_group(group_list, cmd_argv[1])) == NULL) {
-            error("Group does not exist");
-        } else {
-            char *end;
-            double amount = strtod(cmd_argv[3], &end);
-            if (end == cmd_argv[3]) {
-                error("Incorrect number format");
-            } else {
-                if (add_xct(g, cmd_argv[2], amount) == -1) {
-                    error("User does not exist");
-                }
-            }
+        if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, groups) == -1) {
+            break; /* quit command was entered */
         }
-    } else if(strcmp(cmd_argv[0], "recent_xct") == 0 && cmd_argc == 3) {
-        if ((g = find_group(group_list, cmd_argv[1])) == NULL) {
-            error("Group does not exist");
-        } else {
-            char *end;
-            long num = strtol(cmd_argv[2], &end, 10);
-            if (end == cmd_argv[2]) {
-                error("Incorrect number format");
-            } else {
-                recent_xct(g, num);
-            }
+        if (prompt) {
+            out_write(">", 1);
         }
+        out_end_command();
 
-    } else {
-        error("Incorrect syntax");
+        line = eol + 1;
+        if (line - released >= MAPPED_RELEASE_BYTES) {
+            size_t len = (line - released) & ~(size_t) (sysconf(_SC_PAGESIZE) - 1);
+            madvise(released, len, MADV_DONTNEED);
+            released += len;
+        }
     }
+
+    free(last_line);
+    munmap(map, st.st_size);
     return 0;
 }
 
+/*
+ * Stop the output thread, close the journal and the feed and free the
+ * groups, which every way out of main goes through once the groups
+ * exist. If the commands stopped because a change could not be written
+ * (see command_failure), says why after the output of the commands before
+ * it. Returns status, or 1 if the commands stopped that way or the
+ * journal or the feed could not be finished.
+ */
+static int shut_down(GroupDir *groups, int status) {
+    const char *failure = command_failure();
+
+    async_output_stop();
+    if (failure) {
+        fflush(stdout);
+        error(failure);
+        status = 1;
+    }
+    if (command_journal && journal_close(command_journal) == -1 && !failure) {
+        error("Could not write journal");
+        status = 1;
+    }
+    command_journal = NULL;
+    if (command_feed && feed_close(command_feed) == -1 && !failure) {
+        error("Could not write change feed");
+        status = 1;
+    }
+    command_feed = NULL;
+    free_group_dir(groups);
+    return status;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m] [-t threads] [-E] [-P] [-A] [-s snapshot] [-j journal] [-l address | batch_file]\n"
+            "       %s --compile FILE batch_file\n"
+            "  -m  memory-map the batch file: no line length limit, buffered output\n"
+            "  -r, --replay     batch_file was written by --compile: run it without parsing\n"
+            "      --compile FILE   compile batch_file into FILE for --replay, and exit\n"
+            "  -t, --threads N  run the batch file on N threads, one per set of groups (implies -m),\n"
+            "                   or serve clients from N threads with -l\n"
+            "  -E  do not echo batch commands\n"
+            "  -P  do not print the > prompt\n"
+            "  -A, --async-output   write output from a separate thread, so a slow reader doesn't stall commands\n"
+            "  -l, --listen ADDR    serve clients on unix:PATH or [HOST:]PORT instead of reading commands\n"
+            "  -s, --snapshot FILE  start from a snapshot written by save\n"
+            "  -j, --journal FILE   log changes to FILE, replaying it first\n"
+            "      --commit-every N sync the journal every N changes (default 1, 0 = off)\n"
+            "      --commit-ms T    sync the journal within T ms of a change (0 = off)\n"
+            "      --hot-xcts N     keep about N transactions per group in memory, spilling older ones to disk\n"
+            "      --spill-dir DIR  where spilled transactions go (default $TMPDIR or /tmp)\n"
+            "      --feed PATH      write a record of every change to the file or FIFO at PATH\n", prog, prog);
+    exit(1);
+}
+
+static const struct option long_options[] = {
+    {"threads", required_argument, NULL, 't'},
+    {"listen", required_argument, NULL, 'l'},
+    {"snapshot", required_argument, NULL, 's'},
+    {"journal", required_argument, NULL, 'j'},
+    {"commit-every", required_argument, NULL, 'c'},
+    {"commit-ms", required_argument, NULL, 'w'},
+    {"replay", no_argument, NULL, 'r'},
+    {"compile", required_argument, NULL, 'C'},
+    {"hot-xcts", required_argument, NULL, 'H'},
+    {"spill-dir", required_argument, NULL, 'D'},
+    {"async-output", no_argument, NULL, 'A'},
+    {"feed", required_argument, NULL, 'F'},
+    {NULL, 0, NULL, 0}
+};
+
 int main(int argc, char* argv[]) {
-    char input[INPUT_BUFFER_SIZE];
+    char *input = NULL;
+    size_t input_cap = 0;
+    ssize_t input_len;
     char *cmd_argv[INPUT_ARG_MAX_NUM];
     int cmd_argc;
     FILE *input_stream;
+    int opt, mapped = 0, threads = 0, echo = 1, prompt = 1, replay = 0, async = 0;
+    const char *batch_file = NULL;
+    const char *snapshot_file = NULL;
+    const char *listen_address = NULL;
+    const char *journal_file = NULL;
+    const char *compile_file = NULL;
+    const char *feed_file = NULL;
+    unsigned long commit_every = 1, commit_ms = 0;
+    char *end;
+
+    while ((opt = getopt_long(argc, argv, "mrt:EPAl:s:j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            mapped = 1;
+            break;
+        case 't':
+            threads = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || threads < 1 || threads > PARALLEL_MAX_THREADS) {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            replay = 1;
+            break;
+        case 'C':
+            compile_file = optarg;
+            break;
+        case 'E':
+            echo = 0;
+            break;
+        case 'P':
+            prompt = 0;
+            break;
+        case 'A':
+            async = 1;
+            break;
+        case 'l':
+            listen_address = optarg;
+            break;
+        case 's':
+            snapshot_file = optarg;
+            break;
+        case 'j':
+            journal_file = optarg;
+            break;
+        case 'c':
+            commit_every = strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0') {
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            commit_ms = strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0') {
+                usage(argv[0]);
+            }
+            break;
+        case 'H':
+            xct_hot_records = strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || xct_hot_records == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'D':
+            xct_spill_dir = optarg;
+            break;
+        case 'F':
+            feed_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (threads && !listen_address) {
+        mapped = 1;
+    }
+    if (optind < argc - 1 || (mapped && optind == argc) || (listen_address && (mapped || optind < argc))) {
+        usage(argv[0]);
+    }
+    if ((replay || compile_file) && (optind == argc || threads || listen_address)) {
+        usage(argv[0]);
+    }
+    if (optind < argc) {
+        batch_file = argv[optind];
+    } else {
+        echo = 0; /* only batch commands are echoed */
+    }
+
+    /* Compile mode */
+    if (compile_file) {
+        if (replay || snapshot_file || journal_file || feed_file) {
+            usage(argv[0]);
+        }
+        if (compile_batch(batch_file, compile_file) == -1) {
+            error("Could not compile batch file");
+            exit(1);
+        }
+        return 0;
+    }
+
+    /* Initialize the group directory */
+    GroupDir groups;
+    init_group_dir(&groups);
+    if (snapshot_file && load_snapshot(&groups, snapshot_file) == -1) {
+        error("Could not load snapshot");
+        return shut_down(&groups, 1);
+    }
+    if (journal_file && (command_journal = journal_open(journal_file, &groups, commit_every, commit_ms)) == NULL) {
+        error("Could not open journal");
+        return shut_down(&groups, 1);
+    }
+    if (command_journal && command_journal->unapplied) {
+        err_printf("Error: %lu of %lu journal records could not be applied\n",
+                command_journal->unapplied, command_journal->recovered);
+    }
+    if (feed_file && (command_feed = feed_open(feed_file)) == NULL) {
+        error("Could not open feed");
+        return shut_down(&groups, 1);
+    }
+
+    /* Server mode */
+    if (listen_address) {
+        if (run_server(listen_address, &groups, threads ? threads : 1) == -1) {
+            error("Could not listen on address");
+            return shut_down(&groups, 1);
+        }
+        return shut_down(&groups, 0);
+    }
+
+    if (async && async_output_start() == -1) {
+        error("Could not start output thread");
+        return shut_down(&groups, 1);
+    }
+    out_printf("Welcome to Buxfer!\nPlease input command:\n");
+    if (prompt) {
+        out_write(">", 1);
+    }
+    out_flush();
+
+    /* Replay mode */
+    if (replay) {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+        if (replay_compiled(batch_file, &groups, prompt) == -1) {
+            error("Could not replay compiled file");
+            return shut_down(&groups, 1);
+        }
+        return shut_down(&groups, 0);
+    }
 
-    /* Initialize the list head */
-    Group *group_list = NULL;
+    /* Mapped batch mode */
+    if (mapped) {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+        if ((threads ? run_parallel_batch(batch_file, &groups, echo, prompt, threads)
+                : run_mapped_batch(batch_file, &groups, echo, prompt)) == -1) {
+            error("Error opening file");
+            return shut_down(&groups, 1);
+        }
+        return shut_down(&groups, 0);
+    }
 
     /* Batch mode */
-    if (argc == 2) {
-        input_stream = fopen(argv[1], "r");
+    if (batch_file) {
+        input_stream = fopen(batch_file, "r");
         if (input_stream == NULL) {
             error("Error opening file");
-            exit(1);
+            return shut_down(&groups, 1);
         }
     }
     /* Interactive mode */
@@ -133,12 +352,11 @@ int main(int argc, char* argv[]) {
         input_stream = stdin;
     }
 
-    printf("Welcome to Buxfer!\nPlease input command:\n>");
-    
-    while (fgets(input, INPUT_BUFFER_SIZE, input_stream) != NULL) {
+    /* Whole lines of any length, so a long add_xct_batch is never run in parts */
+    while ((input_len = getline(&input, &input_cap, input_stream)) != -1) {
         /* Echo line if in batch mode */
-        if (argc == 2) {
-            printf("%s", input);
+        if (echo) {
+            out_write(input, input_len);
         }
         /* Tokenize arguments */
         char *next_token = strtok(input, DELIM);
@@ -154,15 +372,23 @@ int main(int argc, char* argv[]) {
             next_token = strtok(NULL, DELIM);
         }
         cmd_argv[cmd_argc] = NULL;
-        if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, &group_list) == -1) {
+        if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, &groups) == -1) {
             break; /* quit command was entered */
         }
-        printf(">");
+        if (prompt) {
+            out_write(">", 1);
+        }
+        if (batch_file) {
+            out_end_command();
+        } else {
+            out_flush(); /* the next line may be typed in answer to this output */
+        }
     }
 
     /* Close file if in batch mode */
-    if (argc == 2) {
+    if (batch_file) {
         fclose(input_stream);
     }
-    return 0;
-}
\ No newline at end of file
+    free(input);
+    return shut_down(&groups, 0);
+}
@@ -0,0 +1,643 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "commands.h"
+#include "snapshot.h"
+#include "output.h"
+#include "stats.h"
+#include "settle.h"
+
+/* Journal the changes go to, or NULL when running without -j */
+Journal *command_journal = NULL;
+
+/* Change feed the changes go to, or NULL when running without --feed */
+Feed *command_feed = NULL;
+
+/* Why the commands have stopped, or NULL while they run; see
+ * command_failure */
+static const char *failure = NULL;
+
+/*
+ * Stop the commands for why, unless they have stopped already.
+ */
+static void fail_commands(const char *why) {
+    const char *none = NULL;
+    __atomic_compare_exchange_n(&failure, &none, why, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Why the commands have stopped: a change could not be written where it
+ * must go before it is acknowledged. NULL while they run. Every command
+ * from then on returns -1 from process_args, as quit does, so each way of
+ * running commands stops and shuts down as usual.
+ */
+const char *command_failure(void) {
+    return __atomic_load_n(&failure, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Journal a change when running with -j. Returns 0, or -1 if the journal
+ * could not write and sync it: the change must not be acknowledged, and
+ * the commands stop.
+ */
+int journal_change(enum journal_op op, const char *group_name, const char *user_name,
+        Money amount, uint32_t time) {
+    if (command_journal && journal_append(command_journal, op, group_name, user_name, amount, time) == -1) {
+        fail_commands("Could not write journal");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Add a change to the feed when running with --feed, unless the commands
+ * have stopped. Returns 0, or -1 if a write of the feed has failed: the
+ * feed would leave the change out, so it must not be acknowledged, and
+ * the commands stop.
+ */
+int feed_change(enum feed_op op, const char *group_name, const char *user_name,
+        Money amount, uint32_t time, Money balance) {
+    if (command_feed && !command_failure() && feed_append(command_feed, op, group_name, user_name, amount, time, balance) == -1) {
+        fail_commands("Could not write change feed");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Find a group by name. In a shared directory this is a lock-free read;
+ * groups are never freed while it is shared, so the group stays valid.
+ */
+static Group *lookup_group(GroupDir *groups, const char *group_name) {
+    unsigned long seq;
+    Group *g;
+
+    do {
+        seq = dir_read_begin(groups);
+        g = dir_find_group(groups, group_name);
+    } while (dir_read_retry(groups, seq));
+    return g;
+}
+
+/*
+ * Parse str, either seconds since the epoch or a UTC date and time such as
+ * "2024-03-01", "2024-03-01T09:30" or "2024-03-01T09:30:15Z", into *when.
+ * Returns 0, or -1 if str is neither (or out of range).
+ */
+int parse_time(const char *str, uint32_t *when) {
+    const char *p;
+    unsigned long long seconds = 0;
+    int year, month, day, hour = 0, minute = 0, second = 0, n = 0;
+    struct tm tm, check;
+    time_t t;
+
+    for (p = str; *p >= '0' && *p <= '9'; p++) {
+        seconds = seconds * 10 + (*p - '0');
+        if (seconds > UINT32_MAX) {
+            return -1;
+        }
+    }
+    if (p != str && *p == '\0') {
+        *when = seconds;
+        return 0;
+    }
+
+    if (sscanf(str, "%4d-%2d-%2d%n", &year, &month, &day, &n) != 3) {
+        return -1;
+    }
+    p = str + n;
+    if (*p == 'T') {
+        if (sscanf(p, "T%2d:%2d%n", &hour, &minute, &n) != 2) {
+            return -1;
+        }
+        p += n;
+        if (*p == ':') {
+            if (sscanf(p, ":%2d%n", &second, &n) != 1) {
+                return -1;
+            }
+            p += n;
+        }
+    }
+    if (*p == 'Z') {
+        p++;
+    }
+    if (*p != '\0' || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59) {
+        return -1;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    tm.tm_mday = day;
+    tm.tm_hour = hour;
+    tm.tm_min = minute;
+    tm.tm_sec = second;
+    t = timegm(&tm);
+    // timegm takes 2024-02-30 for 2024-03-01, so check the date came back the same
+    if (t < 0 || (unsigned long long) t > UINT32_MAX || gmtime_r(&t, &check) == NULL
+            || check.tm_mon != month - 1 || check.tm_mday != day) {
+        return -1;
+    }
+    *when = t;
+    return 0;
+}
+
+/*
+ * Take (or drop) every lock in the directory, for commands that look at
+ * all of it at once.
+ */
+static void lock_all(GroupDir *groups) {
+    Group *g;
+
+    dir_write_begin(groups);
+    for (g = groups->head; g; g = g->next) {
+        group_lock(g);
+    }
+}
+
+static void unlock_all(GroupDir *groups) {
+    Group *g;
+
+    for (g = groups->head; g; g = g->next) {
+        group_unlock(g);
+    }
+    dir_write_end(groups);
+}
+
+/*
+ * Split list, "user:amount,user:amount,...", in place into *items, which
+ * the caller frees. A user name runs up to the last ':' of its item.
+ * Returns the number of items, -1 if an item has no name or no ':', and
+ * -2 if an amount doesn't parse.
+ */
+static long parse_batch(char *list, struct batch_xct **items) {
+    unsigned long n = 1, i;
+    char *p, *item, *comma, *colon;
+
+    for (p = list; *p; p++) {
+        n += *p == ',';
+    }
+    *items = malloc(n * sizeof(struct batch_xct));
+    if (*items == NULL) {
+        printf("Error while reading transactions. Program will now exit. \n");
+        exit(0);
+    }
+    for (i = 0, item = list; i < n; i++) {
+        comma = strchr(item, ',');
+        if (comma) {
+            *comma = '\0';
+        }
+        colon = strrchr(item, ':');
+        if (colon == NULL || colon == item) {
+            return -1;
+        }
+        *colon = '\0';
+        (*items)[i].user_name = item;
+        if (parse_money(colon + 1, &(*items)[i].amount) == -1) {
+            return -2;
+        }
+        if (comma) {
+            item = comma + 1;
+        }
+    }
+    return n;
+}
+
+/* 
+ * Read and process buxfer commands
+ */
+static int run_command(int cmd_argc, char **cmd_argv, GroupDir *groups) {
+    Group *g;
+    unsigned long seq;
+    size_t mark;
+    int result;
+
+    /* Reads of a shared group run lock-free and start over, output and
+     * all, if a writer changed the group under them; see lists.h. */
+    if (cmd_argc <= 0) {
+        return 0;
+    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
+        return -1;
+        
+    } else if (strcmp(cmd_argv[0], "add_group") == 0 && cmd_argc == 2) {
+        dir_write_begin(groups);
+        if (dir_add_group(groups, cmd_argv[1]) == -1) {
+            error("Group already exists");
+        } else {
+            journal_change(JOURNAL_ADD_GROUP, cmd_argv[1], NULL, 0, 0);
+            feed_change(FEED_ADD_GROUP, cmd_argv[1], NULL, 0, 0, 0);
+        }
+        dir_write_end(groups);
+        
+    } else if (strcmp(cmd_argv[0], "list_groups") == 0 && cmd_argc == 1) {
+        mark = out_mark();
+        do {
+            out_rewind(mark);
+            seq = dir_read_begin(groups);
+            list_groups(groups->head);
+        } while (dir_read_retry(groups, seq));
+        
+    } else if (strcmp(cmd_argv[0], "save") == 0 && cmd_argc == 2) {
+        lock_all(groups);
+        result = save_snapshot(groups, cmd_argv[1]);
+        if (result == 0 && command_journal && journal_reset(command_journal) == -1) {
+            fail_commands("Could not reset journal");   // it would replay on top of the snapshot
+        }
+        unlock_all(groups);
+        if (result == -1) {
+            error("Could not write snapshot");
+        }
+
+    } else if (strcmp(cmd_argv[0], "load") == 0 && cmd_argc == 2) {
+        if (groups->shared) {
+            error("Cannot load while the groups are shared");   // readers may be in the old groups
+        } else if (command_journal) {
+            error("Cannot load while journaling");  // the journal could not rebuild the groups
+        } else if (load_snapshot(groups, cmd_argv[1]) == -1) {
+            error("Could not load snapshot");
+        }
+
+    } else if (strcmp(cmd_argv[0], "stats") == 0 && cmd_argc == 1) {
+        stats_print();
+
+    } else if (strcmp(cmd_argv[0], "stats") == 0 && cmd_argc == 2 && strcmp(cmd_argv[1], "reset") == 0) {
+        stats_reset();
+
+    } else if (strcmp(cmd_argv[0], "mem_stats") == 0 && cmd_argc == 1) {
+        lock_all(groups);
+        mem_stats(groups);
+        unlock_all(groups);
+
+    } else if (strcmp(cmd_argv[0], "add_user") == 0 && cmd_argc == 3) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            group_write_begin(g);
+            if (add_user(g, cmd_argv[2]) == -1) {
+                error("User already exists");
+            } else {
+                journal_change(JOURNAL_ADD_USER, cmd_argv[1], cmd_argv[2], 0, 0);
+                feed_change(FEED_ADD_USER, cmd_argv[1], cmd_argv[2], 0, 0, 0);
+            }
+            group_write_end(g);
+        }
+        
+    } else if (strcmp(cmd_argv[0], "remove_user") == 0 && cmd_argc == 3) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            group_write_begin(g);
+            User *u = find_user(g, cmd_argv[2]);
+            if (u == NULL) {
+                error("User does not exist");
+            } else {
+                Money balance = u->balance;
+                drop_user(g, u);
+                journal_change(JOURNAL_REMOVE_USER, cmd_argv[1], cmd_argv[2], 0, 0);
+                feed_change(FEED_REMOVE_USER, cmd_argv[1], cmd_argv[2], 0, 0, balance);
+            }
+            group_write_end(g);
+        }
+        
+    } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 2) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            mark = out_mark();
+            do {
+                out_rewind(mark);
+                seq = group_read_begin(g);
+                list_users(g);
+            } while (group_read_retry(g, seq));
+        }
+        
+    } else if (strcmp(cmd_argv[0], "user_balance") == 0 && cmd_argc == 3) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            mark = out_mark();
+            do {
+                out_rewind(mark);
+                seq = group_read_begin(g);
+                result = user_balance(g, cmd_argv[2]);
+            } while (group_read_retry(g, seq));
+            if (result == -1) {
+                error("User does not exist");
+            }
+        }
+        
+    } else if (strcmp(cmd_argv[0], "under_paid") == 0 && cmd_argc == 2) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            mark = out_mark();
+            do {
+                out_rewind(mark);
+                seq = group_read_begin(g);
+                result = under_paid(g);
+            } while (group_read_retry(g, seq));
+            if (result == -1) {
+                error("User list empty");
+            }
+        }
+
+    } else if (strcmp(cmd_argv[0], "group_total") == 0 && cmd_argc == 2) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            Money total;
+            do {
+                seq = group_read_begin(g);
+                total = group_total(g);
+            } while (group_read_retry(g, seq));
+            out_printf("$" MONEY_FMT "\n", MONEY_ARGS(total));
+        }
+
+    } else if (strcmp(cmd_argv[0], "group_summary") == 0 && cmd_argc == 2) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            mark = out_mark();
+            do {
+                out_rewind(mark);
+                seq = group_read_begin(g);
+                group_summary(g);
+            } while (group_read_retry(g, seq));
+        }
+
+    } else if (strcmp(cmd_argv[0], "group_average") == 0 && cmd_argc == 2) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            mark = out_mark();
+            do {
+                out_rewind(mark);
+                seq = group_read_begin(g);
+                result = group_average(g);
+            } while (group_read_retry(g, seq));
+            if (result == -1) {
+                error("User list empty");
+            }
+        }
+        
+    } else if (strcmp(cmd_argv[0], "add_xct") == 0 && (cmd_argc == 4 || cmd_argc == 5)) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            Money amount;
+            uint32_t when = 0;
+            if (parse_money(cmd_argv[3], &amount) == -1) {
+                error("Incorrect number format");
+            } else if (cmd_argc == 5 && parse_time(cmd_argv[4], &when) == -1) {
+                error("Incorrect time format");
+            } else {
+                group_write_begin(g);
+                if (cmd_argc == 4) {
+                    // now, unless the clock went back past the last transaction
+                    when = (uint32_t) time(NULL);
+                    if (when < g->xcts.last_time) {
+                        when = g->xcts.last_time;
+                    }
+                }
+                User *u = find_user(g, cmd_argv[2]);
+                if (u == NULL) {
+                    error("User does not exist");
+                } else if (post_xct(g, u, amount, when) == -2) {
+                    error("Transaction time is before the group's last transaction");
+                } else {
+                    journal_change(JOURNAL_ADD_XCT, cmd_argv[1], cmd_argv[2], amount, when);
+                    feed_change(FEED_ADD_XCT, cmd_argv[1], cmd_argv[2], amount, when, u->balance);
+                }
+                group_write_end(g);
+            }
+        }
+    } else if (strcmp(cmd_argv[0], "add_xct_batch") == 0 && (cmd_argc == 3 || cmd_argc == 4)) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            struct batch_xct *items;
+            long n = parse_batch(cmd_argv[2], &items);
+            uint32_t when = 0;
+            unsigned long missing, i;
+            if (n == -1) {
+                error("Incorrect syntax");
+            } else if (n == -2) {
+                error("Incorrect number format");
+            } else if (cmd_argc == 4 && parse_time(cmd_argv[3], &when) == -1) {
+                error("Incorrect time format");
+            } else {
+                group_write_begin(g);
+                if (cmd_argc == 3) {
+                    // now, unless the clock went back past the last transaction
+                    when = (uint32_t) time(NULL);
+                    if (when < g->xcts.last_time) {
+                        when = g->xcts.last_time;
+                    }
+                }
+                Money *balances = command_feed ? malloc(n * sizeof(Money)) : NULL;
+                if (command_feed && n > 0 && balances == NULL) {
+                    printf("Error while adding transactions. Program will now exit. \n");
+                    exit(0);
+                }
+                result = add_xct_batch(g, items, n, when, &missing, balances);
+                if (result == -1) {
+                    error("User does not exist");
+                } else if (result == -2) {
+                    error("Transaction time is before the group's last transaction");
+                } else {
+                    for (i = 0; i < (unsigned long) n && command_journal; i++) {
+                        journal_change(JOURNAL_ADD_XCT, cmd_argv[1], items[i].user_name, items[i].amount, when);
+                    }
+                    for (i = 0; i < (unsigned long) n && command_feed; i++) {
+                        feed_change(FEED_ADD_XCT, cmd_argv[1], items[i].user_name, items[i].amount, when, balances[i]);
+                    }
+                }
+                group_write_end(g);
+                free(balances);
+            }
+            free(items);
+        }
+
+    } else if(strcmp(cmd_argv[0], "recent_xct") == 0 && cmd_argc == 3) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            char *end;
+            long num = strtol(cmd_argv[2], &end, 10);
+            if (end == cmd_argv[2]) {
+                error("Incorrect number format");
+            } else {
+                mark = out_mark();
+                do {
+                    out_rewind(mark);
+                    seq = group_read_begin(g);
+                    recent_xct(g, num);
+                } while (group_read_retry(g, seq));
+            }
+        }
+
+    } else if (strcmp(cmd_argv[0], "xct_range") == 0 && cmd_argc == 4) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            uint32_t from, to;
+            if (parse_time(cmd_argv[2], &from) == -1 || parse_time(cmd_argv[3], &to) == -1) {
+                error("Incorrect time format");
+            } else if (from > to) {
+                error("Incorrect time range");
+            } else {
+                mark = out_mark();
+                do {
+                    out_rewind(mark);
+                    seq = group_read_begin(g);
+                    xct_range(g, from, to);
+                } while (group_read_retry(g, seq));
+            }
+        }
+
+    } else if (strcmp(cmd_argv[0], "user_spend") == 0 && cmd_argc == 5) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            uint32_t from, to;
+            if (parse_time(cmd_argv[3], &from) == -1 || parse_time(cmd_argv[4], &to) == -1) {
+                error("Incorrect time format");
+            } else if (from > to) {
+                error("Incorrect time range");
+            } else {
+                mark = out_mark();
+                do {
+                    out_rewind(mark);
+                    seq = group_read_begin(g);
+                    result = user_spend(g, cmd_argv[2], from, to);
+                } while (group_read_retry(g, seq));
+                if (result == -1) {
+                    error("User does not exist");
+                }
+            }
+        }
+
+    } else if (strcmp(cmd_argv[0], "top_payers") == 0 && cmd_argc == 3) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            char *end;
+            long num = strtol(cmd_argv[2], &end, 10);
+            if (end == cmd_argv[2]) {
+                error("Incorrect number format");
+            } else {
+                group_lock(g);
+                result = top_payers(g, num);
+                group_unlock(g);
+                if (result == -1) {
+                    error("User list empty");
+                }
+            }
+        }
+
+    } else if (strcmp(cmd_argv[0], "settle") == 0 && cmd_argc == 2) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            group_lock(g);  // settle keeps its result on the group
+            result = settle(g);
+            group_unlock(g);
+            if (result == -1) {
+                error("User list empty");
+            }
+        }
+
+    } else if (strcmp(cmd_argv[0], "user_rank") == 0 && cmd_argc == 3) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            group_lock(g);
+            result = user_rank(g, cmd_argv[2]);
+            group_unlock(g);
+            if (result == -1) {
+                error("User does not exist");
+            }
+        }
+
+    } else if (strcmp(cmd_argv[0], "balance_percentile") == 0 && cmd_argc == 3) {
+        if ((g = lookup_group(groups, cmd_argv[1])) == NULL) {
+            error("Group does not exist");
+        } else {
+            char *end;
+            double percentile = strtod(cmd_argv[2], &end);
+            if (end == cmd_argv[2]) {
+                error("Incorrect number format");
+            } else if (!(percentile >= 0 && percentile <= 100)) {
+                error("Percentile must be between 0 and 100");
+            } else {
+                group_lock(g);
+                result = balance_percentile(g, percentile);
+                group_unlock(g);
+                if (result == -1) {
+                    error("User list empty");
+                }
+            }
+        }
+
+    } else {
+        error("Incorrect syntax");
+    }
+    return 0;
+}
+
+/*
+ * Run one command, timing it for the stats command unless statistics are
+ * compiled out. Returns -1 for quit or once the commands have stopped
+ * (see command_failure), when later commands are not run, and 0
+ * otherwise.
+ */
+int process_args(int cmd_argc, char **cmd_argv, GroupDir *groups) {
+    int result;
+
+    if (command_failure()) {
+        return -1;
+    }
+#ifdef BUXFER_NO_STATS
+    result = run_command(cmd_argc, cmd_argv, groups);
+#else
+    if (cmd_argc <= 0) {
+        return 0;
+    }
+    unsigned long start = stats_clock();
+    result = run_command(cmd_argc, cmd_argv, groups);
+    stats_command(cmd_argv[0], stats_clock() - start);
+#endif
+    return command_failure() ? -1 : result;
+}
+
+/*
+ * Split the line [start, end) into cmd_argv in place, by writing a '\0'
+ * over the space or newline that ends each token; end must be writable.
+ * Returns the number of arguments, or 0 (after reporting an error) if
+ * there are too many.
+ */
+int tokenize_in_place(char *start, char *end, char **cmd_argv) {
+    int cmd_argc = 0;
+    char *p = start;
+
+    while (p < end) {
+        while (p < end && *p == ' ') {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        if (cmd_argc >= INPUT_ARG_MAX_NUM - 1) {
+            error("Too many arguments!");
+            return 0;
+        }
+        cmd_argv[cmd_argc++] = p;
+        while (p < end && *p != ' ') {
+            p++;
+        }
+        *p++ = '\0';
+    }
+    cmd_argv[cmd_argc] = NULL;
+    return cmd_argc;
+}
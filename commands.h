@@ -0,0 +1,28 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include "lists.h"
+#include "journal.h"
+#include "feed.h"
+
+/* The buxfer command language, shared by every way of running commands. */
+
+#define INPUT_ARG_MAX_NUM 6
+
+/* Batch modes that map the input drop the pages they are done with every
+ * MAPPED_RELEASE_BYTES */
+#define MAPPED_RELEASE_BYTES (64UL << 20)
+
+extern Journal *command_journal;
+extern Feed *command_feed;
+
+int process_args(int cmd_argc, char **cmd_argv, GroupDir *groups);
+const char *command_failure(void);
+int journal_change(enum journal_op op, const char *group_name, const char *user_name,
+        Money amount, uint32_t time);
+int feed_change(enum feed_op op, const char *group_name, const char *user_name,
+        Money amount, uint32_t time, Money balance);
+int tokenize_in_place(char *start, char *end, char **cmd_argv);
+int parse_time(const char *str, uint32_t *when);
+
+#endif
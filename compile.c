@@ -0,0 +1,565 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "compile.h"
+#include "commands.h"
+#include "output.h"
+
+#define COMPILE_BUFFER_SIZE (1 << 20)
+#define INTERN_INITIAL_SLOTS 1024
+#define NO_GROUP UINT32_MAX
+
+#define PAD8(n) (((n) + 7) & ~(size_t) 7)
+
+static const char zeros[8];
+
+/* The names of one kind, groups or users, laid out as in the file */
+struct names {
+    struct capture section;     // compiled_name, name, padding, ...
+    struct capture offsets;     // the offset in section of each id's entry
+    uint32_t count;
+};
+
+struct interned {
+    unsigned long hash;
+    uint32_t group;     // NO_GROUP for a group name
+    uint32_t id;        // plus one, 0 for an empty slot
+};
+
+/* Open-addressing table from (group, name) to id */
+struct interner {
+    struct interned *slots;
+    unsigned long nslots;
+    struct names groups;
+    struct names users;
+};
+
+static const char *name_of(const struct names *names, uint32_t id) {
+    size_t offset = ((const size_t *) names->offsets.buf)[id];
+    return names->section.buf + offset + sizeof(struct compiled_name);
+}
+
+static void grow_interner(struct interner *in) {
+    unsigned long nslots = in->nslots ? in->nslots * 2 : INTERN_INITIAL_SLOTS, i;
+    struct interned *slots = calloc(nslots, sizeof(struct interned));
+
+    if ( slots == NULL ) {
+        printf("Error while growing name table. Program will now exit. \n");
+        exit(0);
+    }
+    for ( i = 0; i < in->nslots; i++ ) {
+        if ( in->slots[i].id ) {
+            unsigned long j = in->slots[i].hash & (nslots - 1);
+            while ( slots[j].id ) {
+                j = (j + 1) & (nslots - 1);
+            }
+            slots[j] = in->slots[i];
+        }
+    }
+    free(in->slots);
+    in->slots = slots;
+    in->nslots = nslots;
+}
+
+/*
+ * The id of name, a group name if group is NO_GROUP and otherwise a user
+ * name in that group, given the first time the name is seen.
+ */
+static uint32_t intern(struct interner *in, uint32_t group, const char *name) {
+    struct names *names = group == NO_GROUP ? &in->groups : &in->users;
+    unsigned long hash = hash_name(name) ^ ((group + 1UL) * 0x9E3779B97F4A7C15UL);
+    unsigned long i;
+
+    if ( (in->groups.count + in->users.count + 1) * 2 > in->nslots ) {
+        grow_interner(in);      // at most half full
+    }
+    for ( i = hash & (in->nslots - 1); in->slots[i].id; i = (i + 1) & (in->nslots - 1) ) {
+        struct interned *slot = &in->slots[i];
+        if ( slot->hash == hash && slot->group == group && strcmp(name_of(names, slot->id - 1), name) == 0 ) {
+            return slot->id - 1;
+        }
+    }
+
+    struct compiled_name entry;
+    size_t offset = names->section.len;
+    entry.group = group == NO_GROUP ? 0 : group;
+    entry.name_len = strlen(name) + 1;
+    capture_append(&names->offsets, (const char *) &offset, sizeof(offset));
+    capture_append(&names->section, (const char *) &entry, sizeof(entry));
+    capture_append(&names->section, name, entry.name_len);
+    capture_append(&names->section, zeros, PAD8(entry.name_len) - entry.name_len);
+
+    in->slots[i].hash = hash;
+    in->slots[i].group = group;
+    in->slots[i].id = ++names->count;
+    return names->count - 1;
+}
+
+/*
+ * Turn the line [start, end), whose tokens have been split into the
+ * cmd_argc strings of cmd_argv, into op. Lines whose opcode would not
+ * behave exactly like process_args are left as OP_TEXT for the caller.
+ */
+static void compile_line(struct interner *in, int cmd_argc, char **cmd_argv, struct compiled_op *op) {
+    const char *cmd = cmd_argv[0];
+    char *end;
+
+    op->code = OP_TEXT;
+    if ( cmd_argc == 0 ) {
+        op->code = OP_BLANK;
+    } else if ( strcmp(cmd, "quit") == 0 && cmd_argc == 1 ) {
+        op->code = OP_QUIT;
+    } else if ( cmd_argc == 3 && (strcmp(cmd, "add_user") == 0 || strcmp(cmd, "remove_user") == 0
+            || strcmp(cmd, "user_balance") == 0) ) {
+        op->code = cmd[0] == 'a' ? OP_ADD_USER : cmd[0] == 'r' ? OP_REMOVE_USER : OP_USER_BALANCE;
+    } else if ( cmd_argc == 2 && strcmp(cmd, "list_users") == 0 ) {
+        op->code = OP_LIST_USERS;
+    } else if ( cmd_argc == 2 && strcmp(cmd, "under_paid") == 0 ) {
+        op->code = OP_UNDER_PAID;
+    } else if ( cmd_argc == 2 && strcmp(cmd, "group_total") == 0 ) {
+        op->code = OP_GROUP_TOTAL;
+    } else if ( cmd_argc == 2 && strcmp(cmd, "group_average") == 0 ) {
+        op->code = OP_GROUP_AVERAGE;
+    } else if ( cmd_argc == 3 && strcmp(cmd, "recent_xct") == 0 ) {
+        long num = strtol(cmd_argv[2], &end, 10);
+        if ( end != cmd_argv[2] ) {
+            op->code = OP_RECENT_XCT;
+            op->value = num;
+        }
+    } else if ( (cmd_argc == 4 || cmd_argc == 5) && strcmp(cmd, "add_xct") == 0 ) {
+        Money amount;
+        if ( parse_money(cmd_argv[3], &amount) == 0 && (cmd_argc == 4 || parse_time(cmd_argv[4], &op->arg) == 0) ) {
+            op->code = OP_ADD_XCT;
+            op->value = amount;
+            op->flags = cmd_argc == 5 ? OP_HAS_TIME : 0;
+        }
+    } else if ( strcmp(cmd, "load") == 0 ) {
+        op->flags = OP_RESETS_IDS;
+    }
+
+    if ( op->code != OP_TEXT && op->code != OP_BLANK && op->code != OP_QUIT ) {
+        op->group = intern(in, NO_GROUP, cmd_argv[1]);
+        if ( op->code == OP_ADD_USER || op->code == OP_REMOVE_USER || op->code == OP_USER_BALANCE
+                || op->code == OP_ADD_XCT ) {
+            op->user = intern(in, op->group, cmd_argv[2]);
+        }
+    }
+}
+
+/* Compile the batch file at batch_path into a command stream at path.
+ * Returns 0 on success and -1 if either file can't be used.
+ */
+int compile_batch(const char *batch_path, const char *path) {
+    struct interner in = {NULL, 0, {{NULL, 0, 0}, {NULL, 0, 0}, 0}, {{NULL, 0, 0}, {NULL, 0, 0}, 0}};
+    struct capture ops = {NULL, 0, 0}, text = {NULL, 0, 0};
+    char *cmd_argv[INPUT_ARG_MAX_NUM], *line = NULL;
+    size_t lineCap = 0;
+    struct stat st;
+    const char *map = NULL, *p, *end;
+    int fd = open(batch_path, O_RDONLY), result = -1;
+    FILE *out;
+
+    if ( fd == -1 || fstat(fd, &st) == -1 ) {
+        return -1;
+    }
+    if ( st.st_size > 0 ) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ( map == MAP_FAILED ) {
+            close(fd);
+            return -1;
+        }
+        madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    for ( p = map, end = map + st.st_size; p < end; ) {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t len = (eol ? eol : end) - p;
+        struct compiled_op op;
+        int cmd_argc = 0;
+        char *q;
+
+        // split a copy of the line on spaces, as tokenize_in_place does
+        if ( len + 1 > lineCap ) {
+            lineCap = (len + 1) * 2;
+            free(line);
+            line = malloc(lineCap);
+            if ( line == NULL ) {
+                printf("Error while compiling batch file. Program will now exit. \n");
+                exit(0);
+            }
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+        for ( q = line; *q && cmd_argc < INPUT_ARG_MAX_NUM; ) {
+            while ( *q == ' ' ) {
+                *q++ = '\0';
+            }
+            if ( *q ) {
+                cmd_argv[cmd_argc++] = q;
+                while ( *q && *q != ' ' ) {
+                    q++;
+                }
+            }
+        }
+
+        memset(&op, 0, sizeof(op));
+        if ( cmd_argc < INPUT_ARG_MAX_NUM ) {    // too many arguments is an error, as text
+            compile_line(&in, cmd_argc, cmd_argv, &op);
+        } else {
+            op.code = OP_TEXT;
+        }
+        if ( op.code == OP_TEXT ) {
+            op.value = text.len;
+            op.arg = len;
+            capture_append(&text, p, len);
+        }
+        capture_append(&ops, (const char *) &op, sizeof(op));
+        p += len + 1;
+    }
+
+    out = fopen(path, "wb");
+    if ( out != NULL ) {
+        struct compiled_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, COMPILED_MAGIC, sizeof(header.magic));
+        header.version = COMPILED_VERSION;
+        header.group_count = in.groups.count;
+        header.user_count = in.users.count;
+        header.op_count = ops.len / sizeof(struct compiled_op);
+        header.text_bytes = text.len;
+
+        setvbuf(out, NULL, _IOFBF, COMPILE_BUFFER_SIZE);
+        fwrite(&header, sizeof(header), 1, out);
+        fwrite(in.groups.section.buf, 1, in.groups.section.len, out);
+        fwrite(in.users.section.buf, 1, in.users.section.len, out);
+        fwrite(ops.buf, 1, ops.len, out);
+        fwrite(text.buf, 1, text.len, out);
+        result = fflush(out) != 0 || ferror(out) ? -1 : 0;
+        fclose(out);
+    }
+
+    if ( map ) {
+        munmap((void *) map, st.st_size);
+    }
+    free(line);
+    free(in.slots);
+    capture_release(&in.groups.section);
+    capture_release(&in.groups.offsets);
+    capture_release(&in.users.section);
+    capture_release(&in.users.offsets);
+    capture_release(&ops);
+    capture_release(&text);
+    return result;
+}
+
+/* A compiled stream being replayed */
+struct replay {
+    GroupDir *dir;
+    const char **group_names;
+    const char **user_names;
+    const uint32_t *user_groups;    // each user's group id, in the mapped file
+    Group **groups;     // resolved on first use, NULL until then
+    User **users;
+    uint32_t group_count;
+    uint32_t user_count;
+    const char *text;
+    char *line;         // a copy of a text line for tokenize_in_place
+    size_t line_cap;
+};
+
+static Group *resolve_group(struct replay *r, uint32_t id) {
+    if ( r->groups[id] == NULL ) {
+        r->groups[id] = dir_find_group(r->dir, r->group_names[id]);
+    }
+    return r->groups[id];
+}
+
+static User *resolve_user(struct replay *r, Group *g, uint32_t id) {
+    if ( r->users[id] == NULL ) {
+        r->users[id] = find_user(g, r->user_names[id]);
+    }
+    return r->users[id];
+}
+
+/*
+ * Run a line kept as text through process_args. Returns what it returns.
+ */
+static int replay_text(struct replay *r, const struct compiled_op *op) {
+    char *cmd_argv[INPUT_ARG_MAX_NUM];
+    int cmd_argc, result = 0;
+
+    if ( op->arg + 1 > r->line_cap ) {
+        r->line_cap = (op->arg + 1) * 2;
+        free(r->line);
+        r->line = malloc(r->line_cap);
+        if ( r->line == NULL ) {
+            printf("Error while replaying batch file. Program will now exit. \n");
+            exit(0);
+        }
+    }
+    memcpy(r->line, r->text + op->value, op->arg);
+    cmd_argc = tokenize_in_place(r->line, r->line + op->arg, cmd_argv);
+    if ( cmd_argc > 0 ) {
+        result = process_args(cmd_argc, cmd_argv, r->dir);
+    }
+    if ( op->flags & OP_RESETS_IDS ) {
+        // every Group and User may have been replaced
+        memset(r->groups, 0, r->group_count * sizeof(Group *));
+        memset(r->users, 0, r->user_count * sizeof(User *));
+    }
+    return result;
+}
+
+/*
+ * Run one op the way process_args runs its line, errors, journal and feed
+ * included. Returns -1 for quit or once the commands have stopped, and 0
+ * otherwise.
+ */
+static int replay_op(struct replay *r, const struct compiled_op *op) {
+    Group *g;
+    User *u;
+    Money balance;
+    uint32_t when;
+
+    switch ( op->code ) {
+    case OP_BLANK:
+        return 0;
+    case OP_TEXT:
+        return replay_text(r, op);
+    case OP_QUIT:
+        return -1;
+    }
+
+    if ( (g = resolve_group(r, op->group)) == NULL ) {
+        error("Group does not exist");
+        return 0;
+    }
+    switch ( op->code ) {
+    case OP_ADD_USER:
+        if ( r->users[op->user] || add_user(g, r->user_names[op->user]) == -1 ) {
+            error("User already exists");
+        } else {
+            journal_change(JOURNAL_ADD_USER, r->group_names[op->group], r->user_names[op->user], 0, 0);
+            feed_change(FEED_ADD_USER, r->group_names[op->group], r->user_names[op->user], 0, 0, 0);
+        }
+        break;
+    case OP_REMOVE_USER:
+        if ( (u = resolve_user(r, g, op->user)) == NULL ) {
+            error("User does not exist");
+            break;
+        }
+        balance = u->balance;
+        drop_user(g, u);
+        r->users[op->user] = NULL;
+        journal_change(JOURNAL_REMOVE_USER, r->group_names[op->group], r->user_names[op->user], 0, 0);
+        feed_change(FEED_REMOVE_USER, r->group_names[op->group], r->user_names[op->user], 0, 0, balance);
+        break;
+    case OP_ADD_XCT:
+        if ( (u = resolve_user(r, g, op->user)) == NULL ) {
+            error("User does not exist");
+            break;
+        }
+        when = op->arg;
+        if ( !(op->flags & OP_HAS_TIME) ) {
+            // now, unless the clock went back past the last transaction
+            when = (uint32_t) time(NULL);
+            if ( when < g->xcts.last_time ) {
+                when = g->xcts.last_time;
+            }
+        }
+        if ( post_xct(g, u, op->value, when) == -2 ) {
+            error("Transaction time is before the group's last transaction");
+        } else {
+            journal_change(JOURNAL_ADD_XCT, r->group_names[op->group], r->user_names[op->user], op->value, when);
+            feed_change(FEED_ADD_XCT, r->group_names[op->group], r->user_names[op->user], op->value, when, u->balance);
+        }
+        break;
+    case OP_LIST_USERS:
+        list_users(g);
+        break;
+    case OP_USER_BALANCE:
+        if ( (u = resolve_user(r, g, op->user)) == NULL ) {
+            error("User does not exist");
+        } else {
+            out_printf("$" MONEY_FMT "\n", MONEY_ARGS(u->balance));
+        }
+        break;
+    case OP_UNDER_PAID:
+        if ( under_paid(g) == -1 ) {
+            error("User list empty");
+        }
+        break;
+    case OP_RECENT_XCT:
+        recent_xct(g, op->value);
+        break;
+    case OP_GROUP_TOTAL: {
+        Money total = group_total(g);
+        out_printf("$" MONEY_FMT "\n", MONEY_ARGS(total));
+        break;
+    }
+    case OP_GROUP_AVERAGE:
+        if ( group_average(g) == -1 ) {
+            error("User list empty");
+        }
+        break;
+    }
+    return command_failure() ? -1 : 0;
+}
+
+/*
+ * Check that every op of a stream refers to names and text it has, so
+ * that replay can trust them. Returns 0 if they do and -1 if not.
+ */
+static int check_ops(const struct replay *r, const struct compiled_op *ops, uint64_t count, uint64_t text_bytes) {
+    uint64_t i;
+
+    for ( i = 0; i < count; i++ ) {
+        const struct compiled_op *op = &ops[i];
+        switch ( op->code ) {
+        case OP_BLANK:
+        case OP_QUIT:
+            break;
+        case OP_TEXT:
+            if ( (uint64_t) op->value > text_bytes || op->arg > text_bytes - op->value ) {
+                return -1;
+            }
+            break;
+        case OP_ADD_USER:
+        case OP_REMOVE_USER:
+        case OP_ADD_XCT:
+        case OP_USER_BALANCE:
+            if ( op->user >= r->user_count || r->user_groups[op->user] != op->group ) {
+                return -1;
+            }
+            // fall through
+        case OP_LIST_USERS:
+        case OP_UNDER_PAID:
+        case OP_RECENT_XCT:
+        case OP_GROUP_TOTAL:
+        case OP_GROUP_AVERAGE:
+            if ( op->group >= r->group_count ) {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Point names[i] (and groups[i] if not NULL) at each of the count names
+ * starting at *p, and step *p past them. Returns 0, or -1 if they don't
+ * fit before end or are not terminated where their headers say.
+ */
+static int read_names(const char **p, const char *end, uint32_t count, const char **names, uint32_t *groups) {
+    uint32_t i;
+
+    for ( i = 0; i < count; i++ ) {
+        const struct compiled_name *entry = (const struct compiled_name *) *p;
+        if ( (size_t) (end - *p) < sizeof(*entry) ) {
+            return -1;
+        }
+        size_t len = entry->name_len;
+        const char *name = *p + sizeof(*entry);
+        if ( len == 0 || (size_t) (end - name) < PAD8(len) || name[len - 1] != '\0' || memchr(name, '\0', len - 1) ) {
+            return -1;
+        }
+        names[i] = name;
+        if ( groups ) {
+            groups[i] = entry->group;
+        }
+        *p = name + PAD8(len);
+    }
+    return 0;
+}
+
+/* Run the compiled stream at path on groups, printing a prompt after each
+ * line if prompt is set, until it ends or quits. Returns 0 when it has
+ * run, or -1 if path can't be read or is not a whole compiled stream.
+ */
+int replay_compiled(const char *path, GroupDir *groups, int prompt) {
+    struct replay r;
+    struct stat st;
+    const struct compiled_header *header;
+    const struct compiled_op *ops = NULL;
+    const char *map, *p, *end;
+    uint32_t *userGroups = NULL;
+    uint64_t i;
+    int fd = open(path, O_RDONLY), result = -1;
+
+    if ( fd == -1 || fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(*header) ) {
+        if ( fd != -1 ) {
+            close(fd);
+        }
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) {
+        return -1;
+    }
+    madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+    header = (const struct compiled_header *) map;
+    p = map + sizeof(*header);
+    end = map + st.st_size;
+
+    memset(&r, 0, sizeof(r));
+    r.dir = groups;
+    r.group_count = header->group_count;
+    r.user_count = header->user_count;
+    if ( memcmp(header->magic, COMPILED_MAGIC, sizeof(header->magic)) != 0 || header->version != COMPILED_VERSION
+            || r.group_count > (size_t) (end - p) / sizeof(struct compiled_name)
+            || r.user_count > (size_t) (end - p) / sizeof(struct compiled_name) ) {
+        goto done;
+    }
+    r.group_names = malloc((r.group_count + 1) * sizeof(char *));
+    r.user_names = malloc((r.user_count + 1) * sizeof(char *));
+    userGroups = malloc((r.user_count + 1) * sizeof(uint32_t));
+    r.groups = calloc(r.group_count + 1, sizeof(Group *));
+    r.users = calloc(r.user_count + 1, sizeof(User *));
+    if ( r.group_names == NULL || r.user_names == NULL || userGroups == NULL || r.groups == NULL || r.users == NULL ) {
+        printf("Error while replaying batch file. Program will now exit. \n");
+        exit(0);
+    }
+    r.user_groups = userGroups;
+    if ( read_names(&p, end, r.group_count, r.group_names, NULL) == -1
+            || read_names(&p, end, r.user_count, r.user_names, userGroups) == -1
+            || header->op_count > (uint64_t) (end - p) / sizeof(struct compiled_op) ) {
+        goto done;
+    }
+    ops = (const struct compiled_op *) p;
+    p += header->op_count * sizeof(struct compiled_op);
+    if ( header->text_bytes != (uint64_t) (end - p) || check_ops(&r, ops, header->op_count, header->text_bytes) == -1 ) {
+        goto done;
+    }
+    r.text = p;
+
+    for ( i = 0; i < header->op_count; i++ ) {
+        if ( replay_op(&r, &ops[i]) == -1 ) {
+            break;  // quit
+        }
+        if ( prompt ) {
+            out_write(">", 1);
+        }
+        out_end_command();
+    }
+    result = 0;
+
+done:
+    free(r.group_names);
+    free(r.user_names);
+    free(userGroups);
+    free(r.groups);
+    free(r.users);
+    free(r.line);
+    munmap((void *) map, st.st_size);
+    return result;
+}
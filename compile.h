@@ -0,0 +1,83 @@
+#ifndef COMPILE_H
+#define COMPILE_H
+
+#include <stdint.h>
+#include "lists.h"
+
+/* Batch files compiled to a binary command stream.
+ *
+ * compile_batch parses a batch file once: amounts become cents, times
+ * become seconds, and every group and user name is interned to a small id.
+ * replay_compiled then runs the stream with no tokenizing, number parsing
+ * or string compares, and resolves each id to its Group or User once, on
+ * first use, instead of looking the name up on every line. The output is
+ * what the batch file gives with -m -E (there is no text to echo).
+ *
+ * The file is
+ *
+ *   compiled_header
+ *   group_count x (compiled_name, group name)
+ *   user_count x (compiled_name, user name)     name within its group
+ *   op_count x compiled_op                      one per line of the batch
+ *   text_bytes of text                          lines replayed as text
+ *
+ * with names '\0'-terminated and padded to 8 bytes, as in snapshots.
+ * add_user, remove_user, add_xct, list_users, user_balance, under_paid,
+ * recent_xct, group_total, group_average and quit have opcodes of their
+ * own. Any other line, and any of those whose arguments don't parse, is
+ * kept as text and replayed through process_args, so it behaves (and
+ * fails) exactly as it would in the batch file. Replay doesn't time the
+ * commands it runs from opcodes for the stats command.
+ */
+
+#define COMPILED_MAGIC "BUXFER\0C"
+#define COMPILED_VERSION 1
+
+enum compiled_opcode {
+	OP_BLANK,	/* an empty line: just the prompt */
+	OP_TEXT,	/* value: offset in the text, arg: length */
+	OP_ADD_USER,
+	OP_REMOVE_USER,
+	OP_ADD_XCT,	/* value: cents, arg: time if OP_HAS_TIME */
+	OP_LIST_USERS,
+	OP_USER_BALANCE,
+	OP_UNDER_PAID,
+	OP_RECENT_XCT,	/* value: count */
+	OP_GROUP_TOTAL,
+	OP_GROUP_AVERAGE,
+	OP_QUIT
+};
+
+/* compiled_op flags */
+#define OP_HAS_TIME 1	/* add_xct gave a time; otherwise it is the time of replay */
+#define OP_RESETS_IDS 2	/* text that can replace every group (load) */
+
+struct compiled_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t group_count;
+	uint32_t user_count;
+	uint32_t reserved;
+	uint64_t op_count;
+	uint64_t text_bytes;
+};
+
+struct compiled_name {
+	uint32_t group;	/* a user's group id; unused for groups */
+	uint32_t name_len;	/* including the '\0' */
+};
+
+struct compiled_op {
+	uint8_t code;
+	uint8_t flags;
+	uint16_t reserved;
+	uint32_t group;
+	uint32_t user;
+	uint32_t arg;
+	int64_t value;
+};
+
+int compile_batch(const char *batch_path, const char *path);
+int replay_compiled(const char *path, GroupDir *groups, int prompt);
+
+#endif
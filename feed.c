@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "feed.h"
+
+#define FEED_INITIAL_BUFFER 65536
+#define FEED_SCAN_BYTES 4096
+
+/* A record as feed_append leaves it in its ring. The group and user names
+ * follow, without '\0's, padded to a multiple of 8 bytes so the next
+ * record is aligned. A record never wraps around the end of the ring: a
+ * size of 0 sends the reader back to the start. */
+struct staged {
+    uint32_t size;  /* bytes of the record, names and padding included */
+    uint32_t op;
+    unsigned long seq;
+    Money amount;
+    Money balance;
+    uint32_t time;
+    uint32_t group_len;
+    uint32_t user_len;
+    uint32_t pad;
+};
+
+/* Feeds opened so far, to number them */
+static unsigned long feeds_opened = 0;
+
+/* The ring of the calling thread, and the id of the feed it belongs to */
+static __thread struct feed_ring *thread_ring = NULL;
+static __thread unsigned long thread_ring_feed = 0;
+
+static const char *const op_names[] = {
+    NULL, "add_group", "add_user", "remove_user", "add_xct"
+};
+
+/*
+ * Write all len bytes of buf to fd, retrying short writes. Returns 0 on
+ * success and -1 on error.
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while ( len > 0 ) {
+        ssize_t n = write(fd, buf, len);
+        if ( n == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * The offset just past the last '\n' in the first end bytes of fd, 0 if
+ * there is none, or -1 if fd can't be read.
+ */
+static off_t line_before(int fd, off_t end) {
+    char chunk[FEED_SCAN_BYTES];
+
+    while ( end > 0 ) {
+        size_t n = end < FEED_SCAN_BYTES ? (size_t) end : FEED_SCAN_BYTES;
+        size_t i;
+        if ( pread(fd, chunk, n, end - n) != (ssize_t) n ) {
+            return -1;
+        }
+        for ( i = n; i > 0; i-- ) {
+            if ( chunk[i - 1] == '\n' ) {
+                return end - n + i;
+            }
+        }
+        end -= n;
+    }
+    return 0;
+}
+
+/*
+ * The offset of the first line of fd that starts at or after at, end if
+ * there is none before end, or -1 if fd can't be read.
+ */
+static off_t next_line(int fd, off_t at, off_t end) {
+    char chunk[FEED_SCAN_BYTES];
+
+    if ( at == 0 ) {
+        return 0;
+    }
+    at--;   // a line starts at at if the byte before it is '\n'
+    while ( at < end ) {
+        ssize_t n = pread(fd, chunk, FEED_SCAN_BYTES, at);
+        char *nl;
+        if ( n <= 0 ) {
+            return -1;
+        }
+        if ( (nl = memchr(chunk, '\n', n)) != NULL ) {
+            return at + (nl - chunk) + 1;
+        }
+        at += n;
+    }
+    return end;
+}
+
+/*
+ * Read the sequence number of the record at offset at of fd into seq.
+ * Returns 0 on success and -1 if there is no record there.
+ */
+static int seq_at(int fd, off_t at, unsigned long *seq) {
+    char digits[24];
+    ssize_t n = pread(fd, digits, sizeof(digits) - 1, at);
+    char *end;
+
+    if ( n <= 0 ) {
+        return -1;
+    }
+    digits[n] = '\0';
+    *seq = strtoul(digits, &end, 10);
+    return end == digits || *end != ' ' ? -1 : 0;
+}
+
+/*
+ * Cut a torn last line off the feed open on fd and set next_seq to the
+ * number after its last record. Returns 0 on success and -1 if fd can't
+ * be read or does not hold a feed.
+ */
+static int recover(int fd, unsigned long *next_seq) {
+    struct stat st;
+    off_t good, last;
+    unsigned long seq;
+
+    if ( fstat(fd, &st) == -1 || (good = line_before(fd, st.st_size)) == -1 ) {
+        return -1;
+    }
+    if ( good < st.st_size && ftruncate(fd, good) == -1 ) {
+        return -1;
+    }
+    if ( good == 0 ) {  // new feed
+        *next_seq = 1;
+        return 0;
+    }
+    if ( (last = line_before(fd, good - 1)) == -1 || seq_at(fd, last, &seq) == -1 ) {
+        return -1;
+    }
+    *next_seq = seq + 1;
+    return 0;
+}
+
+/*
+ * Write n in decimal at p. Returns the number of characters written.
+ */
+static size_t put_number(char *p, unsigned long long n) {
+    char digits[20];
+    size_t count = 0, i;
+
+    do {
+        digits[count++] = '0' + n % 10;
+        n /= 10;
+    } while ( n );
+    for ( i = 0; i < count; i++ ) {
+        p[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+/*
+ * Write amount at p as MONEY_FMT does, without going through printf.
+ * Returns the number of characters written.
+ */
+static size_t put_money(char *p, Money amount) {
+    unsigned long long cents = amount < 0 ? -(unsigned long long) amount : (unsigned long long) amount;
+    size_t at = 0;
+
+    if ( amount < 0 ) {
+        p[at++] = '-';
+    }
+    at += put_number(p + at, cents / 100);
+    p[at++] = '.';
+    p[at++] = '0' + cents % 100 / 10;
+    p[at++] = '0' + cents % 10;
+    return at;
+}
+
+/*
+ * Format record, numbered record->seq, into the writer's text buffer at
+ * at. Returns the new length of the text.
+ */
+static size_t format(Feed *feed, const struct staged *record, size_t at) {
+    const char *names = (const char *) (record + 1);
+    size_t need = at + record->group_len + record->user_len + 128;
+
+    if ( need > feed->text_cap ) {
+        while ( need > feed->text_cap ) {
+            feed->text_cap *= 2;
+        }
+        feed->text = realloc(feed->text, feed->text_cap);
+        if ( feed->text == NULL ) {
+            printf("Error while growing feed buffer. Program will now exit. \n");
+            exit(0);
+        }
+    }
+    char *text = feed->text;
+    const char *op = op_names[record->op];
+    size_t opLen = strlen(op);
+
+    at += put_number(text + at, record->seq);
+    text[at++] = ' ';
+    memcpy(text + at, op, opLen);
+    at += opLen;
+    text[at++] = ' ';
+    memcpy(text + at, names, record->group_len);
+    at += record->group_len;
+    if ( record->op != FEED_ADD_GROUP ) {
+        text[at++] = ' ';
+        memcpy(text + at, names + record->group_len, record->user_len);
+        at += record->user_len;
+        if ( record->op == FEED_ADD_XCT ) {
+            text[at++] = ' ';
+            at += put_money(text + at, record->amount);
+            text[at++] = ' ';
+            at += put_number(text + at, record->time);
+        }
+        text[at++] = ' ';
+        at += put_money(text + at, record->balance);
+    }
+    text[at++] = '\n';
+    return at;
+}
+
+/*
+ * The next record of ring the writer has not formatted, or NULL if the
+ * thread has not published one.
+ */
+static const struct staged *next_record(struct feed_ring *ring) {
+    while ( ring->taken != ring->seen ) {
+        size_t at = ring->taken % ring->size;
+        const struct staged *record = (const struct staged *) (ring->buf + at);
+        if ( record->size ) {
+            return record;
+        }
+        ring->taken += ring->size - at;     // wrapped to the start
+    }
+    return NULL;
+}
+
+/*
+ * Format every record published so far whose sequence number follows on
+ * from the last one formatted; a record numbered but not yet published
+ * holds back the ones after it. Returns the length of the text.
+ */
+static size_t gather(Feed *feed) {
+    struct feed_ring *rings = __atomic_load_n(&feed->rings, __ATOMIC_ACQUIRE), *ring, *run = NULL;
+    const struct staged *record;
+    size_t len = 0;
+
+    for ( ring = rings; ring; ring = ring->next ) {
+        ring->seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+    for ( ;; ) {
+        // a thread's records are in sequence order, so stay on its ring while they follow on
+        if ( run == NULL || (record = next_record(run)) == NULL || record->seq != feed->written_seq ) {
+            for ( run = rings; run; run = run->next ) {
+                if ( (record = next_record(run)) != NULL && record->seq == feed->written_seq ) {
+                    break;
+                }
+            }
+            if ( run == NULL ) {
+                return len;
+            }
+        }
+        if ( !feed->failed ) {
+            len = format(feed, record, len);
+        }
+        run->taken += record->size;
+        feed->written_seq++;
+        feed->records++;
+    }
+}
+
+/*
+ * Hand the space of the records formatted back to their threads, and wake
+ * any thread that waits for it.
+ */
+static void release(Feed *feed) {
+    struct feed_ring *ring;
+    int waiting = 0;
+
+    for ( ring = __atomic_load_n(&feed->rings, __ATOMIC_ACQUIRE); ring; ring = ring->next ) {
+        __atomic_store_n(&ring->tail, ring->taken, __ATOMIC_SEQ_CST);
+        waiting |= __atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST);
+    }
+    if ( waiting ) {
+        pthread_mutex_lock(&feed->lock);
+        pthread_cond_broadcast(&feed->space);
+        pthread_mutex_unlock(&feed->lock);
+    }
+}
+
+/*
+ * The writer: every FEED_WINDOW_MS, or FEED_IDLE_MS while no records come,
+ * format the records published since the last window, write them and
+ * hand the space back. Stops once it has written every record published
+ * before feed_close.
+ */
+static void *writer_main(void *arg) {
+    Feed *feed = arg;
+    struct timespec deadline;
+    long window = FEED_WINDOW_MS;
+    int stop;
+
+    for ( ;; ) {
+        pthread_mutex_lock(&feed->lock);
+        if ( !feed->stop ) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += window * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&feed->wake, &feed->lock, &deadline);
+        }
+        stop = feed->stop;
+        pthread_mutex_unlock(&feed->lock);
+
+        unsigned long records = feed->records;
+        size_t len = gather(feed);
+        window = feed->records == records ? FEED_IDLE_MS : FEED_WINDOW_MS;
+        if ( len && !feed->failed ) {
+            if ( write_all(feed->fd, feed->text, len) == -1 ) {
+                __atomic_store_n(&feed->failed, 1, __ATOMIC_SEQ_CST);
+            }
+            feed->writes++;
+        }
+        release(feed);
+        if ( stop ) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Open the feed at path, a FIFO or a file that is created if it does not
+ * exist, and start its writer. Returns NULL if the file can't be opened
+ * or holds something other than a feed.
+ */
+Feed *feed_open(const char *path) {
+    Feed *feed;
+    struct stat st;
+    unsigned long nextSeq = 1;
+    int fd;
+
+    if ( stat(path, &st) == 0 && S_ISFIFO(st.st_mode) ) {
+        fd = open(path, O_RDWR);    // never waits for a reader, and never gets SIGPIPE
+    } else {
+        fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if ( fd != -1 && recover(fd, &nextSeq) == -1 ) {
+            close(fd);
+            return NULL;
+        }
+    }
+    if ( fd == -1 ) {
+        return NULL;
+    }
+
+    feed = calloc(1, sizeof(Feed));
+    if ( feed == NULL ) {
+        close(fd);
+        return NULL;
+    }
+    feed->fd = fd;
+    feed->id = __atomic_add_fetch(&feeds_opened, 1, __ATOMIC_SEQ_CST);
+    feed->next_seq = feed->written_seq = nextSeq;
+    feed->text_cap = FEED_INITIAL_BUFFER;
+    feed->text = malloc(feed->text_cap);
+    if ( feed->text == NULL ) {
+        printf("Error while creating feed buffer. Program will now exit. \n");
+        exit(0);
+    }
+    pthread_mutex_init(&feed->lock, NULL);
+    pthread_cond_init(&feed->wake, NULL);
+    pthread_cond_init(&feed->space, NULL);
+    if ( pthread_create(&feed->writer, NULL, writer_main, feed) != 0 ) {
+        pthread_mutex_destroy(&feed->lock);
+        pthread_cond_destroy(&feed->wake);
+        pthread_cond_destroy(&feed->space);
+        free(feed->text);
+        free(feed);
+        close(fd);
+        return NULL;
+    }
+    return feed;
+}
+
+/*
+ * The calling thread's ring for feed, made the first time it appends.
+ */
+static struct feed_ring *own_ring(Feed *feed) {
+    struct feed_ring *ring;
+
+    if ( thread_ring_feed == feed->id ) {
+        return thread_ring;
+    }
+    ring = calloc(1, sizeof(struct feed_ring));
+    if ( ring == NULL || (ring->buf = malloc(FEED_RING_BYTES)) == NULL ) {
+        printf("Error while creating feed buffer. Program will now exit. \n");
+        exit(0);
+    }
+    ring->size = FEED_RING_BYTES;
+    pthread_mutex_lock(&feed->lock);
+    ring->next = feed->rings;
+    __atomic_store_n(&feed->rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&feed->lock);
+    thread_ring = ring;
+    thread_ring_feed = feed->id;
+    return ring;
+}
+
+/*
+ * Wait until ring, of the calling thread, has room for need more bytes
+ * after head, waking the writer rather than wait out its window.
+ */
+static void wait_for_space(Feed *feed, struct feed_ring *ring, unsigned long head, size_t need) {
+    pthread_mutex_lock(&feed->lock);
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    while ( head + need - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) > ring->size ) {
+        pthread_cond_signal(&feed->wake);
+        pthread_cond_wait(&feed->space, &feed->lock);
+    }
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&feed->lock);
+}
+
+/* Append a record of op to the feed, with the user's balance after it.
+ * user_name and balance are ignored for FEED_ADD_GROUP, and amount and
+ * time are only recorded for FEED_ADD_XCT. Returns 0, or -1 without
+ * appending anything if a write of the feed has failed.
+ */
+int feed_append(Feed *feed, enum feed_op op, const char *group_name,
+        const char *user_name, Money amount, uint32_t time, Money balance) {
+    uint32_t groupLen = strlen(group_name);
+    uint32_t userLen = op == FEED_ADD_GROUP ? 0 : strlen(user_name);
+    size_t size = sizeof(struct staged) + ((groupLen + userLen + 7) & ~7UL);
+    struct feed_ring *ring = own_ring(feed);
+    unsigned long head = ring->head;
+    size_t at = head % ring->size, toEnd = ring->size - at;
+
+    if ( __atomic_load_n(&feed->failed, __ATOMIC_SEQ_CST) ) {
+        return -1;
+    }
+    if ( size > ring->size / 2 ) {
+        // a record this long only goes in an empty, bigger ring
+        wait_for_space(feed, ring, head, ring->size);
+        while ( size > ring->size / 2 ) {
+            ring->size *= 2;
+        }
+        free(ring->buf);
+        ring->buf = malloc(ring->size);
+        if ( ring->buf == NULL ) {
+            printf("Error while growing feed buffer. Program will now exit. \n");
+            exit(0);
+        }
+        at = head % ring->size;     // the writer looks at neither until head moves
+        toEnd = ring->size - at;
+    }
+    if ( head + size + (size > toEnd ? toEnd : 0) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->size ) {
+        wait_for_space(feed, ring, head, size + (size > toEnd ? toEnd : 0));
+    }
+    if ( size > toEnd ) {
+        ((struct staged *) (ring->buf + at))->size = 0;     // go on at the start
+        head += toEnd;
+        at = 0;
+    }
+
+    struct staged *record = (struct staged *) (ring->buf + at);
+    char *names = (char *) (record + 1);
+    record->size = size;
+    record->op = op;
+    record->amount = amount;
+    record->balance = balance;
+    record->time = time;
+    record->group_len = groupLen;
+    record->user_len = userLen;
+    memcpy(names, group_name, groupLen);
+    if ( userLen ) {
+        memcpy(names + groupLen, user_name, userLen);
+    }
+    // numbered while the caller holds the group, so a group's records are in order
+    record->seq = __atomic_fetch_add(&feed->next_seq, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Write the records still buffered, stop the writer and close the feed.
+ * With a FIFO, this waits until a consumer has taken them. Returns 0 on
+ * success and -1 if a write failed, so the feed is missing records.
+ */
+int feed_close(Feed *feed) {
+    struct feed_ring *ring, *next;
+    int result;
+
+    pthread_mutex_lock(&feed->lock);
+    feed->stop = 1;
+    pthread_cond_signal(&feed->wake);
+    pthread_mutex_unlock(&feed->lock);
+    pthread_join(feed->writer, NULL);
+
+    result = feed->failed ? -1 : 0;
+    close(feed->fd);
+    pthread_mutex_destroy(&feed->lock);
+    pthread_cond_destroy(&feed->wake);
+    pthread_cond_destroy(&feed->space);
+    for ( ring = feed->rings; ring; ring = next ) {
+        next = ring->next;
+        free(ring->buf);
+        free(ring);
+    }
+    free(feed->text);
+    free(feed);
+    return result;
+}
+
+/* For a consumer of a feed file open on fd: the offset of the first record
+ * numbered seq or later, found by binary search, or the end of the last
+ * whole record if there is none yet. Returns -1 if fd can't be read.
+ */
+off_t feed_find(int fd, unsigned long seq) {
+    struct stat st;
+    off_t lo = 0, hi, end;
+
+    if ( fstat(fd, &st) == -1 || (end = line_before(fd, st.st_size)) == -1 ) {
+        return -1;
+    }
+    hi = end;
+    while ( lo < hi ) {
+        off_t mid = lo + (hi - lo) / 2, at = next_line(fd, mid, end);
+        unsigned long found;
+
+        if ( at == -1 ) {
+            return -1;
+        }
+        if ( at == end ) {
+            hi = mid;
+        } else if ( seq_at(fd, at, &found) == -1 ) {
+            return -1;
+        } else if ( found >= seq ) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return next_line(fd, lo, end);
+}
@@ -0,0 +1,102 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "lists.h"
+
+/* Change feed of the commands that change the groups.
+ *
+ * Every successful add_group, add_user, remove_user and add_xct (one per
+ * item of an add_xct_batch) is written to the feed as a line of text,
+ * numbered by a sequence number that grows by one per record:
+ *
+ *   <seq> add_group <group>
+ *   <seq> add_user <group> <user> <balance>
+ *   <seq> remove_user <group> <user> <balance>
+ *   <seq> add_xct <group> <user> <amount> <time> <balance>
+ *
+ * where balance is the user's balance after the change (for remove_user,
+ * the balance they left with),
+ * amounts are dollars with two decimals and times are seconds since the
+ * epoch. Records of one group are in the order the changes were made.
+ *
+ * The feed is a regular file, appended to, or a FIFO. A file that already
+ * holds records is continued with the sequence number after its last one,
+ * and a torn last line is cut off first; a consumer can read it while it
+ * grows and, since the records are in sequence order, find where to start
+ * again with feed_find. A FIFO gets the records from sequence number 1.
+ *
+ * feed_append only copies the record into a staging ring of the calling
+ * thread, numbered by one atomic add, and publishes it with one store: no
+ * lock is taken and no other thread is woken. The writer thread wakes
+ * every FEED_WINDOW_MS, or FEED_IDLE_MS after a window with no record,
+ * merges the rings in sequence order, formats the records and writes
+ * them, so the commands pay for neither the formatting nor the write. The
+ * rings are small enough to stay in cache at that rate. A thread whose
+ * ring is full (a FIFO nobody reads, or a burst faster than the writer)
+ * waits for it. The feed is not synced; the journal is what survives a
+ * crash.
+ *
+ * If a write fails, the writer drops that batch and every later one, and
+ * from then on feed_append and feed_close return -1, so the change being
+ * made must not be acknowledged: the feed then has no record after the
+ * last one written.
+ */
+
+#define FEED_WINDOW_MS 2
+#define FEED_IDLE_MS 50
+#define FEED_RING_BYTES (1UL << 18)
+
+enum feed_op {
+	FEED_ADD_GROUP = 1,
+	FEED_ADD_USER,
+	FEED_REMOVE_USER,
+	FEED_ADD_XCT
+};
+
+/* The records one thread has staged and the writer has not written yet.
+ * head and tail count bytes since the ring was made: only the thread
+ * moves head, only the writer moves tail. */
+struct feed_ring {
+	char *buf;
+	size_t size;	/* bytes of buf, a multiple of 8 */
+	unsigned long head;	/* end of the records published */
+	unsigned long tail;	/* end of the records written */
+	unsigned long taken;	/* the writer's: end of the records formatted */
+	unsigned long seen;	/* the writer's: head when it last looked */
+	int waiting;	/* the thread waits for space */
+	struct feed_ring *next;
+};
+
+struct feed {
+	int fd;
+	unsigned long id;	/* tells this feed's rings from a closed one's */
+
+	struct feed_ring *rings;	/* one per thread that has appended */
+	unsigned long next_seq;	/* sequence number of the next record */
+	int failed;	/* a write failed; no record is taken after it */
+
+	pthread_mutex_t lock;	/* for adding rings, stopping and waiting */
+	pthread_cond_t wake;	/* the writer waits on it between windows */
+	pthread_cond_t space;	/* feed_append waits on it while its ring is full */
+	int stop;
+
+	unsigned long written_seq;	/* the writer's: next record to format */
+	char *text;	/* the formatted records */
+	size_t text_cap;
+	pthread_t writer;
+
+	unsigned long records;	/* written since open */
+	unsigned long writes;	/* write calls since open */
+};
+
+typedef struct feed Feed;
+
+Feed *feed_open(const char *path);
+int feed_append(Feed *feed, enum feed_op op, const char *group_name,
+		const char *user_name, Money amount, uint32_t time, Money balance);
+int feed_close(Feed *feed);
+off_t feed_find(int fd, unsigned long seq);
+
+#endif
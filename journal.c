@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+#define JOURNAL_HEADER_BYTES 8
+#define JOURNAL_INITIAL_BUFFER 65536
+
+/*
+ * FNV-1a checksum of a record body.
+ */
+static uint32_t checksum(const char *body, size_t len) {
+    uint32_t sum = 2166136261U;
+    size_t i;
+
+    for ( i = 0; i < len; i++ ) {
+        sum ^= (unsigned char) body[i];
+        sum *= 16777619U;
+    }
+    return sum;
+}
+
+/*
+ * Write all len bytes of buf to fd, retrying short writes. Returns 0 on
+ * success and -1 on error.
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while ( len > 0 ) {
+        ssize_t n = write(fd, buf, len);
+        if ( n == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Apply the record body [body, body + len) to dir. Returns 0 if it was
+ * applied, 1 if it is well formed but can't be applied to dir (say, a
+ * transaction of a group that does not exist), and -1 if it is not well
+ * formed. Only changes that succeeded are journaled, so a record that
+ * can't be applied means the journal does not match the snapshot it
+ * was started from.
+ */
+static int replay(GroupDir *dir, const char *body, size_t len) {
+    const char *end = body + len, *groupName, *userName = NULL;
+    enum journal_op op;
+    Money amount = 0;
+    uint32_t when = 0;
+    Group *group;
+
+    if ( len < 2 ) {
+        return -1;
+    }
+    op = (unsigned char) *body++;
+    groupName = body;
+    body = memchr(body, '\0', end - body);
+    if ( body == NULL ) {
+        return -1;
+    }
+    body++;
+    if ( op != JOURNAL_ADD_GROUP ) {
+        userName = body;
+        body = memchr(body, '\0', end - body);
+        if ( body == NULL ) {
+            return -1;
+        }
+        body++;
+    }
+    if ( op == JOURNAL_ADD_XCT ) {
+        if ( end - body != sizeof(Money) + sizeof(uint32_t) ) {
+            return -1;
+        }
+        memcpy(&amount, body, sizeof(Money));
+        memcpy(&when, body + sizeof(Money), sizeof(uint32_t));
+        body += sizeof(Money) + sizeof(uint32_t);
+    }
+    if ( body != end ) {
+        return -1;
+    }
+
+    if ( op == JOURNAL_ADD_GROUP ) {
+        return dir_add_group(dir, groupName) == -1;
+    }
+    if ( op != JOURNAL_ADD_USER && op != JOURNAL_REMOVE_USER && op != JOURNAL_ADD_XCT ) {
+        return -1;
+    }
+    if ( (group = dir_find_group(dir, groupName)) == NULL ) {
+        return 1;
+    }
+    switch ( op ) {
+    case JOURNAL_ADD_USER:
+        return add_user(group, userName) == -1;
+    case JOURNAL_REMOVE_USER:
+        return remove_user(group, userName) == -1;
+    default:
+        return add_xct(group, userName, amount, when) < 0;
+    }
+}
+
+/*
+ * Replay the journal open on fd into dir, and cut off anything after the
+ * last whole record (a write torn by a crash). Counts the records replayed
+ * in *recovered and those that could not be applied in *unapplied.
+ * Returns the offset new records go to, or -1 if fd does not hold a
+ * journal.
+ */
+static off_t recover(int fd, GroupDir *dir, unsigned long *recovered, unsigned long *unapplied) {
+    struct stat st;
+    const char *map, *p, *end;
+
+    if ( fstat(fd, &st) == -1 ) {
+        return -1;
+    }
+    if ( st.st_size == 0 ) {    // new journal
+        if ( write_all(fd, JOURNAL_MAGIC, JOURNAL_HEADER_BYTES) == -1 ) {
+            return -1;
+        }
+        return JOURNAL_HEADER_BYTES;
+    }
+    if ( st.st_size < JOURNAL_HEADER_BYTES ) {
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ( map == MAP_FAILED ) {
+        return -1;
+    }
+    if ( memcmp(map, JOURNAL_MAGIC, JOURNAL_HEADER_BYTES) != 0 ) {
+        munmap((void *) map, st.st_size);
+        return -1;
+    }
+    madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+    p = map + JOURNAL_HEADER_BYTES;
+    end = map + st.st_size;
+    while ( end - p >= 8 ) {
+        uint32_t len, sum;
+        int applied;
+        memcpy(&len, p, 4);
+        memcpy(&sum, p + 4, 4);
+        if ( (size_t) (end - p - 8) < len || checksum(p + 8, len) != sum
+                || (applied = replay(dir, p + 8, len)) == -1 ) {
+            break;
+        }
+        p += 8 + len;
+        (*recovered)++;
+        *unapplied += applied;
+    }
+
+    off_t good = p - map;
+    munmap((void *) map, st.st_size);
+    if ( good < st.st_size && ftruncate(fd, good) == -1 ) {
+        return -1;
+    }
+    return good;
+}
+
+/*
+ * Background group commit: sync whatever is pending at most commit_ms
+ * after the first record of a batch was appended.
+ */
+static void *flusher_main(void *arg) {
+    Journal *journal = arg;
+
+    pthread_mutex_lock(&journal->lock);
+    while ( !journal->stop ) {
+        if ( journal->pending == 0 ) {
+            pthread_cond_wait(&journal->wake, &journal->lock);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += journal->commit_ms / 1000;
+        deadline.tv_nsec += (journal->commit_ms % 1000) * 1000000L;
+        if ( deadline.tv_nsec >= 1000000000L ) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while ( !journal->stop && pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline) != ETIMEDOUT ) {
+        }
+
+        pthread_mutex_unlock(&journal->lock);
+        journal_commit(journal);
+        pthread_mutex_lock(&journal->lock);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+/* Open the journal at path, creating it if it does not exist, and replay
+ * the records already in it into dir. New records are made durable every
+ * commit_every records and/or within commit_ms milliseconds (0 turns a
+ * trigger off; with both off, records are only synced by journal_commit
+ * and journal_close). Returns NULL if the file can't be opened or is not
+ * a journal.
+ */
+Journal *journal_open(const char *path, GroupDir *dir, unsigned long commit_every, unsigned long commit_ms) {
+    Journal *journal;
+    unsigned long recovered = 0, unapplied = 0;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    off_t offset;
+
+    if ( fd == -1 ) {
+        return NULL;
+    }
+    if ( (offset = recover(fd, dir, &recovered, &unapplied)) == -1 || lseek(fd, offset, SEEK_SET) == -1 ) {
+        close(fd);
+        return NULL;
+    }
+
+    journal = calloc(1, sizeof(Journal));
+    if ( journal == NULL ) {
+        close(fd);
+        return NULL;
+    }
+    journal->fd = fd;
+    journal->commit_every = commit_every;
+    journal->commit_ms = commit_ms;
+    journal->cap = JOURNAL_INITIAL_BUFFER;
+    journal->buf = malloc(journal->cap);
+    journal->spare_cap = JOURNAL_INITIAL_BUFFER;
+    journal->spare = malloc(journal->spare_cap);
+    if ( journal->buf == NULL || journal->spare == NULL ) {
+        printf("Error while creating journal buffer. Program will now exit. \n");
+        exit(0);
+    }
+    journal->good = offset;
+    journal->recovered = recovered;
+    journal->unapplied = unapplied;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_mutex_init(&journal->io_lock, NULL);
+    pthread_cond_init(&journal->wake, NULL);
+
+    if ( commit_ms > 0 && pthread_create(&journal->flusher, NULL, flusher_main, journal) == 0 ) {
+        journal->has_flusher = 1;
+    }
+    return journal;
+}
+
+/* Append a record of op to the journal. user_name is ignored for
+ * JOURNAL_ADD_GROUP, and amount and time are only recorded for
+ * JOURNAL_ADD_XCT. If
+ * this record fills a count-triggered commit, the batch is synced before
+ * returning. Returns 0 on success and -1 if that commit, or an earlier
+ * one, failed.
+ */
+int journal_append(Journal *journal, enum journal_op op, const char *group_name,
+        const char *user_name, Money amount, uint32_t time) {
+    size_t groupLen = strlen(group_name) + 1;
+    size_t userLen = op == JOURNAL_ADD_GROUP ? 0 : strlen(user_name) + 1;
+    size_t amountLen = op == JOURNAL_ADD_XCT ? sizeof(Money) + sizeof(uint32_t) : 0;
+    uint32_t len = 1 + groupLen + userLen + amountLen;
+    int commit, failed;
+
+    pthread_mutex_lock(&journal->lock);
+    if ( journal->len + 8 + len > journal->cap ) {
+        while ( journal->len + 8 + len > journal->cap ) {
+            journal->cap *= 2;
+        }
+        journal->buf = realloc(journal->buf, journal->cap);
+        if ( journal->buf == NULL ) {
+            printf("Error while growing journal buffer. Program will now exit. \n");
+            exit(0);
+        }
+    }
+
+    char *record = journal->buf + journal->len;
+    char *body = record + 8;
+    body[0] = op;
+    memcpy(body + 1, group_name, groupLen);
+    if ( userLen ) {
+        memcpy(body + 1 + groupLen, user_name, userLen);
+    }
+    if ( amountLen ) {
+        memcpy(body + 1 + groupLen + userLen, &amount, sizeof(Money));
+        memcpy(body + 1 + groupLen + userLen + sizeof(Money), &time, sizeof(uint32_t));
+    }
+    uint32_t sum = checksum(body, len);
+    memcpy(record, &len, 4);
+    memcpy(record + 4, &sum, 4);
+    journal->len += 8 + len;
+    journal->records++;
+
+    if ( ++journal->pending == 1 && journal->has_flusher ) {
+        pthread_cond_signal(&journal->wake);   // start the time window
+    }
+    commit = journal->commit_every > 0 && journal->pending >= journal->commit_every;
+    failed = journal->failed;
+    pthread_mutex_unlock(&journal->lock);
+
+    if ( commit ) {
+        return journal_commit(journal);
+    }
+    return failed ? -1 : 0;
+}
+
+/*
+ * Put the records of a failed commit, buf (len bytes, pending records),
+ * back in front of those appended since. Called with the lock held.
+ */
+static void restore_failed(Journal *journal, char *buf, size_t len, size_t cap, unsigned long pending) {
+    if ( len + journal->len > cap ) {
+        while ( len + journal->len > cap ) {
+            cap *= 2;
+        }
+        buf = realloc(buf, cap);
+        if ( buf == NULL ) {
+            printf("Error while growing journal buffer. Program will now exit. \n");
+            exit(0);
+        }
+    }
+    memcpy(buf + len, journal->buf, journal->len);
+    journal->spare = journal->buf;
+    journal->spare_cap = journal->cap;
+    journal->buf = buf;
+    journal->cap = cap;
+    journal->len += len;
+    journal->pending += pending;
+    journal->failed = 1;
+}
+
+/* Write every buffered record and fdatasync the journal. Appends can carry
+ * on into the other buffer while this one is written. Returns 0 on
+ * success and -1 if the write or sync failed, now or in an earlier
+ * commit; the records are then kept to be written by the next one.
+ */
+int journal_commit(Journal *journal) {
+    unsigned long pending;
+    char *buf;
+    size_t len, cap;
+
+    pthread_mutex_lock(&journal->io_lock);
+    pthread_mutex_lock(&journal->lock);
+    if ( journal->pending == 0 ) {
+        int failed = journal->failed;
+        pthread_mutex_unlock(&journal->lock);
+        pthread_mutex_unlock(&journal->io_lock);
+        return failed ? -1 : 0;
+    }
+    buf = journal->buf;
+    len = journal->len;
+    cap = journal->cap;
+    pending = journal->pending;
+    journal->buf = journal->spare;
+    journal->cap = journal->spare_cap;
+    journal->len = 0;
+    journal->pending = 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    journal->commits++;
+    // after a failure, cut off whatever part of it reached the file first
+    if ( (journal->failed && (ftruncate(journal->fd, journal->good) == -1
+                    || lseek(journal->fd, journal->good, SEEK_SET) == -1))
+            || write_all(journal->fd, buf, len) == -1 || fdatasync(journal->fd) == -1 ) {
+        pthread_mutex_lock(&journal->lock);
+        restore_failed(journal, buf, len, cap, pending);
+        pthread_mutex_unlock(&journal->lock);
+        pthread_mutex_unlock(&journal->io_lock);
+        return -1;
+    }
+    journal->good += len;
+    journal->spare = buf;
+    journal->spare_cap = cap;
+    pthread_mutex_unlock(&journal->io_lock);
+    return journal->failed ? -1 : 0;
+}
+
+/*
+ * Drop every record, synced or pending, once the groups they rebuild are
+ * in a snapshot: the journal starts over from that snapshot. The caller
+ * keeps changes from being journaled meanwhile. Returns 0 on success and
+ * -1 if the file could not be cut back, which fails the journal like a
+ * failed commit.
+ */
+int journal_reset(Journal *journal) {
+    int result = 0;
+
+    pthread_mutex_lock(&journal->io_lock);
+    pthread_mutex_lock(&journal->lock);
+    journal->len = 0;
+    journal->pending = 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    if ( ftruncate(journal->fd, JOURNAL_HEADER_BYTES) == -1
+            || lseek(journal->fd, JOURNAL_HEADER_BYTES, SEEK_SET) == -1 || fdatasync(journal->fd) == -1 ) {
+        pthread_mutex_lock(&journal->lock);
+        journal->failed = 1;
+        pthread_mutex_unlock(&journal->lock);
+        result = -1;
+    } else {
+        journal->good = JOURNAL_HEADER_BYTES;
+    }
+    pthread_mutex_unlock(&journal->io_lock);
+    return result;
+}
+
+/* Stop the background committer, sync any pending records and close the
+ * journal. Returns 0 on success and -1 if a commit failed, so some
+ * records may not be on disk.
+ */
+int journal_close(Journal *journal) {
+    int result;
+
+    if ( journal->has_flusher ) {
+        pthread_mutex_lock(&journal->lock);
+        journal->stop = 1;
+        pthread_cond_signal(&journal->wake);
+        pthread_mutex_unlock(&journal->lock);
+        pthread_join(journal->flusher, NULL);
+    }
+    result = journal_commit(journal);
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_mutex_destroy(&journal->io_lock);
+    pthread_cond_destroy(&journal->wake);
+    free(journal->buf);
+    free(journal->spare);
+    free(journal);
+    return result;
+}
@@ -0,0 +1,82 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+#include "lists.h"
+
+/* Write-ahead journal of the commands that change the groups.
+ *
+ * Every successful add_group, add_user, remove_user and add_xct is
+ * appended as a record; replaying the journal on startup rebuilds the
+ * groups after a crash. The file starts with JOURNAL_MAGIC and each
+ * record is
+ *
+ *   uint32 length      bytes in the body
+ *   uint32 checksum    FNV-1a of the body
+ *   body               op, group name '\0', [user name '\0'],
+ *                      [int64 cents, uint32 time]
+ *
+ * so a record torn by a crash is detected and dropped on recovery.
+ *
+ * Records are buffered and made durable by group commit: the buffer is
+ * written and fdatasync'ed once commit_every records are pending, and/or
+ * by a background thread at most commit_ms milliseconds after the first
+ * pending record. commit_every = 1 makes each record durable before
+ * journal_append returns; larger values and time windows trade the last
+ * few records of a crash for throughput.
+ *
+ * A commit whose write or sync fails keeps its records in the buffer and
+ * cuts the file back to the end of the last good commit, so a torn record
+ * never ends up in front of later ones. From then on journal_append,
+ * journal_commit and journal_close return -1, and the change must not be
+ * acknowledged.
+ */
+
+#define JOURNAL_MAGIC "BUXJRNL3"
+
+enum journal_op {
+	JOURNAL_ADD_GROUP = 1,
+	JOURNAL_ADD_USER,
+	JOURNAL_REMOVE_USER,
+	JOURNAL_ADD_XCT
+};
+
+struct journal {
+	int fd;
+	unsigned long commit_every;	/* 0 = no count trigger */
+	unsigned long commit_ms;	/* 0 = no time trigger */
+
+	pthread_mutex_t lock;	/* protects buf, len and pending */
+	pthread_cond_t wake;
+	char *buf;	/* records not yet written */
+	size_t len;
+	size_t cap;
+	unsigned long pending;	/* records not yet synced */
+
+	pthread_mutex_t io_lock;	/* serializes write + fdatasync */
+	char *spare;	/* buffer being written while buf fills */
+	size_t spare_cap;
+
+	pthread_t flusher;
+	int has_flusher;
+	int stop;
+
+	off_t good;	/* end of the last record written and synced */
+	int failed;	/* a commit failed; its records are still in buf */
+
+	unsigned long recovered;	/* replayed by journal_open */
+	unsigned long unapplied;	/* of those, records that could not be applied */
+	unsigned long records;	/* appended since open */
+	unsigned long commits;	/* fdatasync calls since open */
+};
+
+typedef struct journal Journal;
+
+Journal *journal_open(const char *path, GroupDir *dir, unsigned long commit_every, unsigned long commit_ms);
+int journal_append(Journal *journal, enum journal_op op, const char *group_name,
+		const char *user_name, Money amount, uint32_t time);
+int journal_commit(Journal *journal);
+int journal_reset(Journal *journal);
+int journal_close(Journal *journal);
+
+#endif
@@ -3,7 +3,140 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <math.h>
 #include "lists.h"
+#include "output.h"
+#include "ostree.h"
+#include "xctlog.h"
+#include "stats.h"
+
+#define GROUP_DIR_INITIAL_BUCKETS 64
+#define USER_TOTALS_INITIAL 4
+
+/* add_xct_batch moves users one at a time while fewer than 1 in this many
+ * move, and rebuilds the order at once otherwise */
+#define BATCH_REBUILD_FRACTION 16
+
+/*
+ * FNV-1a hash of a group or user name. Used to index the group directory.
+ */
+unsigned long hash_name(const char *name) {
+    unsigned long hash = 2166136261UL;
+
+    while ( *name ) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/*
+ * Initialize newGrp as an empty group named group_name that is not yet
+ * linked into any list. Everything the group allocates later comes from
+ * its own pools and arena, so release_group can free it all at once.
+ */
+void _init_group(Group *newGrp, const char *group_name) {
+    arena_init(&newGrp->names);
+    newGrp->name = arena_strdup(&newGrp->names, group_name);
+    pool_init(&newGrp->user_pool, sizeof(User), sizeof(void *), POOL_MAX_SLAB);
+
+    newGrp->users = NULL;
+    newGrp->last_user = NULL;
+    xct_log_init(&newGrp->xcts);
+    newGrp->next = NULL; // assign the next to NULL to indicate end of list.
+    newGrp->hnext = NULL;
+    newGrp->hash = hash_name(group_name);
+    newGrp->user_buckets = NULL; // the user index is created by the first add_user
+    newGrp->user_nbuckets = 0;
+    newGrp->user_count = 0;
+    newGrp->user_tree = NULL;
+    newGrp->order_front = 0;
+    newGrp->order_back = 0;
+    newGrp->user_ids = NULL; // the id table is created by the first add_user
+    newGrp->balances = NULL;
+    newGrp->id_capacity = 0;
+    newGrp->id_count = 0;
+    newGrp->free_ids = NULL;
+    newGrp->free_id_count = 0;
+    newGrp->balance_sum = 0;
+    newGrp->balance_squares = 0;
+    newGrp->xct_sum = 0;
+    newGrp->version = 1;
+    newGrp->transfers = NULL; // settled on demand
+    newGrp->transfer_count = 0;
+    newGrp->transfer_capacity = 0;
+    newGrp->settled_version = 0;
+    newGrp->seq = 0;
+    pthread_mutex_init(&newGrp->write_lock, NULL);
+    newGrp->shared = 0;
+    newGrp->retired = NULL;
+}
+
+/*
+ * Free ptr now, or put it on the retired list if readers of a shared
+ * group or directory may still be using it.
+ */
+void _retire(struct retired **retired, int shared, void *ptr) {
+    if ( !shared || ptr == NULL ) {
+        free(ptr);
+        return;
+    }
+    struct retired *node = malloc(sizeof(struct retired));
+    if ( node == NULL ) {
+        printf("Error while retiring memory. Program will now exit. \n");
+        exit(0);
+    }
+    node->ptr = ptr;
+    node->next = *retired;
+    *retired = node;
+}
+
+/*
+ * Free everything on a retired list.
+ */
+void _free_retired(struct retired **retired) {
+    struct retired *node, *next;
+
+    for ( node = *retired; node; node = next ) {
+        next = node->next;
+        free(node->ptr);
+        free(node);
+    }
+    *retired = NULL;
+}
+
+/* Free all the users, transactions and names of group, including its own
+* name. Apart from one free per user for its running totals, the cost
+* depends on the number of slabs and blocks the group has allocated, not
+* on the number of users or transactions. The Group struct itself belongs
+* to the caller.
+*/
+void release_group(Group *group) {
+    User *currentUser;
+
+    for ( currentUser = group->users; currentUser; currentUser = currentUser->next ) {
+        free(currentUser->totals);
+    }
+    free(group->transfers);
+    pool_release(&group->user_pool);
+    xct_log_release(&group->xcts);
+    arena_release(&group->names);
+    free(group->user_buckets);
+    free(group->user_ids);
+    free(group->balances);
+    free(group->free_ids);
+    _free_retired(&group->retired);
+    pthread_mutex_destroy(&group->write_lock);
+    group->name = NULL;
+    group->users = NULL;
+    group->user_tree = NULL;
+    group->user_buckets = NULL;
+    group->user_ids = NULL;
+    group->balances = NULL;
+    group->free_ids = NULL;
+}
 
 /* Add a group with name group_name to the group_list referred to by 
 * group_list_ptr. The groups are ordered by the time that the group was 
@@ -14,6 +147,9 @@
 * (I.e, allocate and initialize a Group struct, and insert it
 * into the group_list. Note that the head of the group list might change
 * which is why the first argument is a double pointer.) 
+*
+* This walks the whole list; use dir_add_group when the groups are kept in
+* a GroupDir.
 */
 int add_group(Group **group_list_ptr, const char *group_name) {
     // First, check if the group already exists
@@ -21,26 +157,13 @@ int add_group(Group **group_list_ptr, const char *group_name) {
         return -1;      //group already exists.
     } else {
         //group doesn't exist, proceed to make one.
-        // First, create a new pointer to a Group
         Group *newGrp = malloc(sizeof(Group)); // use malloc memory allocation
 
         if ( newGrp == NULL ) { //print error and exit
             printf("Error when creating group pointer. Program will now exit. \n");
             exit(0);
-        } else {
-            int LENGTH = strlen(group_name) + 1;
-            newGrp->name = malloc(LENGTH); //assign group name from the passed in param
-            // since name is char, we only need # of bytes = length of string + 1;
-
-            if ( newGrp->name == NULL ) {
-                printf("Error when adding group name. Program will now exit \n");
-                exit(0);
-            } else {
-                strncpy(newGrp->name, group_name, LENGTH ); // assign group_name as name of newGrp
-                newGrp->name[LENGTH] = '\0'; // add the terminating character
-                newGrp->next = NULL; // assign the next to NULL to indicate end of list.
-            }
         }
+        _init_group(newGrp, group_name);
 
         // now that you've created your group and assigned it the name, time to add it to the group list.
         // if group list is empty, just point the group list ptr to our newly created group.
@@ -69,11 +192,11 @@ void list_groups(Group *group_list) {
 
     if ( currentGrp ) { // if groups exist, proceed
         while ( currentGrp->next ) { // go through & print all grps that have a "next"
-            printf("%s \n", currentGrp->name);
+            out_printf("%s \n", currentGrp->name);
             currentGrp = currentGrp->next;
         }
-        printf("%s \n", currentGrp->name); // lastly, print the last grp (the one without next)
-    } else printf(" \n");   // if no groups exist yet, print blank line
+        out_printf("%s \n", currentGrp->name); // lastly, print the last grp (the one without next)
+    } else out_printf(" \n");   // if no groups exist yet, print blank line
 }
 
 /* Search the list of groups for a group with matching group_name
@@ -101,6 +224,471 @@ Group *find_group(Group *group_list, const char *group_name) {
 
 }
 
+/* Initialize an empty group directory.
+*/
+void init_group_dir(GroupDir *dir) {
+    dir->head = NULL;
+    dir->tail = NULL;
+    dir->count = 0;
+    pool_init(&dir->group_pool, sizeof(Group), __alignof__(Group), POOL_MAX_SLAB);
+    dir->seq = 0;
+    pthread_mutex_init(&dir->write_lock, NULL);
+    dir->shared = 0;
+    dir->retired = NULL;
+    dir->nbuckets = GROUP_DIR_INITIAL_BUCKETS;
+    dir->buckets = calloc(dir->nbuckets, sizeof(Group *));
+    if ( dir->buckets == NULL ) {
+        printf("Error when creating group directory. Program will now exit. \n");
+        exit(0);
+    }
+}
+
+/*
+ * Double the number of buckets in dir and rehash every group into them.
+ * Walks the insertion-ordered list, so the cost is amortized over the
+ * inserts that filled the table.
+ */
+void _grow_group_dir(GroupDir *dir) {
+    unsigned long nbuckets = dir->nbuckets * 2;
+    Group **buckets = calloc(nbuckets, sizeof(Group *));
+    Group *currentGrp;
+
+    if ( buckets == NULL ) {
+        printf("Error when growing group directory. Program will now exit. \n");
+        exit(0);
+    }
+    for ( currentGrp = dir->head; currentGrp; currentGrp = currentGrp->next ) {
+        unsigned long b = currentGrp->hash & (nbuckets - 1);
+        currentGrp->hnext = buckets[b];
+        buckets[b] = currentGrp;
+    }
+    _retire(&dir->retired, dir->shared, dir->buckets);
+    STAT_COUNT(COUNT_INDEX_GROWS, 1);
+    dir->buckets = buckets;
+    __atomic_store_n(&dir->nbuckets, nbuckets, __ATOMIC_RELEASE);    // readers load nbuckets, then buckets
+}
+
+/* Same as add_group, but for a group directory: the duplicate check is a
+* single bucket lookup and the new group is appended at the tail, so this
+* is O(1) expected rather than O(number of groups).
+*
+* Returns 0 on success and -1 if a group with this name already exists.
+*/
+int dir_add_group(GroupDir *dir, const char *group_name) {
+    if ( dir_find_group(dir, group_name) ) {
+        return -1;      //group already exists.
+    }
+
+    if ( dir->count >= dir->nbuckets ) { // keep the load factor at most 1
+        _grow_group_dir(dir);
+    }
+
+    Group *newGrp = pool_alloc(&dir->group_pool);
+    _init_group(newGrp, group_name);
+    newGrp->shared = dir->shared;
+    unsigned long b = newGrp->hash & (dir->nbuckets - 1);
+    newGrp->hnext = dir->buckets[b];
+    dir->buckets[b] = newGrp;
+
+    // append to the insertion-ordered list
+    if ( dir->tail == NULL ) {
+        dir->head = newGrp;
+    } else {
+        dir->tail->next = newGrp;
+    }
+    dir->tail = newGrp;
+    dir->count++;
+    return 0;
+}
+
+/* Search the directory for a group with matching group_name. Returns NULL
+* if there is no such group, otherwise a pointer to the matching group.
+*/
+Group *dir_find_group(GroupDir *dir, const char *group_name) {
+    unsigned long hash = hash_name(group_name);
+    unsigned long nbuckets = __atomic_load_n(&dir->nbuckets, __ATOMIC_ACQUIRE);
+    Group *currentGrp = dir->buckets[hash & (nbuckets - 1)];
+    unsigned long visited = 0;
+
+    while ( currentGrp ) {
+        visited++;
+        if ( currentGrp->hash == hash && strcmp(currentGrp->name, group_name) == 0 ) {
+            break;
+        }
+        currentGrp = currentGrp->hnext;
+    }
+    STAT_WALK(WALK_FIND_GROUP, visited);
+    return currentGrp; // NULL if the group name was not found
+}
+
+/* Free every group in dir together with its users and transactions. dir
+* must be initialized again before it is reused.
+*/
+void free_group_dir(GroupDir *dir) {
+    Group *currentGrp;
+
+    for ( currentGrp = dir->head; currentGrp; currentGrp = currentGrp->next ) {
+        release_group(currentGrp);
+    }
+    pool_release(&dir->group_pool);
+    free(dir->buckets);
+    _free_retired(&dir->retired);
+    pthread_mutex_destroy(&dir->write_lock);
+    dir->buckets = NULL;
+    dir->head = NULL;
+    dir->tail = NULL;
+    dir->count = 0;
+}
+
+/* Print to standard output how much memory each pool is using: bytes in
+* live objects, and bytes reserved from the system for them. Index tables
+* are allocated separately and are reported by size, and so are the users'
+* running totals, which takes a walk over every user. Last come the bytes
+* reserved per user (nodes, names and user indexes) and per transaction
+* in memory (log chunks, totals and log tables), and what has been spilled
+* to disk, if anything.
+*/
+void mem_stats(GroupDir *dir) {
+    size_t usersInUse = 0, usersReserved = 0, xctsInUse = 0, xctsReserved = 0;
+    size_t namesInUse = 0, namesReserved = 0, indexBytes = dir->nbuckets * sizeof(Group *);
+    size_t totalsInUse = 0, totalsReserved = 0, userIndexBytes = 0, xctIndexBytes = 0;
+    unsigned long userCount = 0, xctCount = 0, coldCount = 0, coldRecords = 0;
+    Group *currentGrp;
+    User *currentUser;
+
+    for ( currentGrp = dir->head; currentGrp; currentGrp = currentGrp->next ) {
+        for ( currentUser = currentGrp->users; currentUser; currentUser = currentUser->next ) {
+            if ( currentUser->totals ) {
+                totalsInUse += (currentUser->totals->count - currentUser->totals->first) * (sizeof(Money) + sizeof(XctRef));
+                totalsReserved += sizeof(struct user_totals) + currentUser->totals->capacity * (sizeof(Money) + sizeof(XctRef));
+            }
+        }
+        usersInUse += currentGrp->user_pool.in_use * currentGrp->user_pool.object_size;
+        usersReserved += currentGrp->user_pool.reserved;
+        xctsInUse += (currentGrp->xcts.count - currentGrp->xcts.cold_live) * sizeof(Xct);
+        xctsReserved += currentGrp->xcts.chunks.reserved;
+        namesInUse += currentGrp->names.in_use;
+        namesReserved += currentGrp->names.reserved;
+        userIndexBytes += currentGrp->user_nbuckets * sizeof(User *)
+                + currentGrp->id_capacity * (sizeof(User *) + sizeof(Money) + sizeof(unsigned int));
+        xctIndexBytes += currentGrp->xcts.index_capacity * sizeof(struct xct_chunk *)
+                + currentGrp->xcts.table_capacity * (sizeof(struct xct_chunk *) + sizeof(unsigned int))
+                + currentGrp->xcts.cold_cut_capacity * sizeof(unsigned long);
+        userCount += currentGrp->user_count;
+        xctCount += currentGrp->xcts.count - currentGrp->xcts.cold_live;
+        coldCount += currentGrp->xcts.cold_live;
+        coldRecords += currentGrp->xcts.cold_count;
+    }
+    indexBytes += userIndexBytes + xctIndexBytes;
+
+    out_printf("groups: %lu bytes in use, %lu bytes reserved\n",
+            (unsigned long) (dir->group_pool.in_use * dir->group_pool.object_size),
+            (unsigned long) dir->group_pool.reserved);
+    out_printf("users: %lu bytes in use, %lu bytes reserved\n", (unsigned long) usersInUse, (unsigned long) usersReserved);
+    out_printf("transactions: %lu bytes in use, %lu bytes reserved\n", (unsigned long) xctsInUse, (unsigned long) xctsReserved);
+    out_printf("names: %lu bytes in use, %lu bytes reserved\n", (unsigned long) namesInUse, (unsigned long) namesReserved);
+    out_printf("totals: %lu bytes in use, %lu bytes reserved\n", (unsigned long) totalsInUse, (unsigned long) totalsReserved);
+    out_printf("indexes: %lu bytes\n", (unsigned long) indexBytes);
+    out_printf("per user: %.1f bytes, per transaction: %.1f bytes\n",
+            userCount ? (double) (usersReserved + namesReserved + userIndexBytes) / userCount : 0.0,
+            xctCount ? (double) (xctsReserved + totalsReserved + xctIndexBytes) / xctCount : 0.0);
+    if ( coldRecords ) {
+        out_printf("on disk: %lu transactions, %lu bytes\n", coldCount, (unsigned long) (coldRecords * sizeof(Xct)));
+    }
+}
+
+/*
+ * Sequence lock: a writer makes *seq odd for the length of its change, and
+ * a reader saw a whole state if *seq was even and did not move meanwhile.
+ */
+void _seq_write_begin(unsigned long *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);    // odd before any change is seen
+}
+
+void _seq_write_end(unsigned long *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+unsigned long _seq_read_begin(const unsigned long *seq) {
+    unsigned long start;
+
+    while ( (start = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1 ) {
+        sched_yield();  // a writer is in the middle of a change
+    }
+    return start;
+}
+
+int _seq_read_retry(const unsigned long *seq, unsigned long start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);    // finish reading before checking
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+/* Let several threads use dir and its groups at once, see lists.h. There
+* is no going back: a shared directory can only be freed. Until then the
+* lock and read functions below do nothing.
+*/
+void share_group_dir(GroupDir *dir) {
+    Group *currentGrp;
+
+    dir->shared = 1;
+    for ( currentGrp = dir->head; currentGrp; currentGrp = currentGrp->next ) {
+        currentGrp->shared = 1;
+    }
+}
+
+/* Take the group's writer lock without changing it, to read it with no
+* writer in the way or to change it without readers.
+*/
+void group_lock(Group *group) {
+    if ( !group->shared ) {
+        return;
+    }
+    pthread_mutex_lock(&group->write_lock);
+}
+
+void group_unlock(Group *group) {
+    if ( !group->shared ) {
+        return;
+    }
+    pthread_mutex_unlock(&group->write_lock);
+}
+
+/* Take the group's writer lock and tell readers a change is under way.
+*/
+void group_write_begin(Group *group) {
+    if ( !group->shared ) {
+        return;
+    }
+    pthread_mutex_lock(&group->write_lock);
+    _seq_write_begin(&group->seq);
+}
+
+void group_write_end(Group *group) {
+    if ( !group->shared ) {
+        return;
+    }
+    _seq_write_end(&group->seq);
+    pthread_mutex_unlock(&group->write_lock);
+}
+
+/* Start a lock-free read of group, waiting out a change under way. Returns
+* the sequence number to pass to group_read_retry.
+*/
+unsigned long group_read_begin(Group *group) {
+    if ( !group->shared ) {
+        return 0;
+    }
+    return _seq_read_begin(&group->seq);
+}
+
+/* Return 1 if group changed since group_read_begin returned seq, so what
+* was read must be thrown away and read again, or 0 if it is consistent.
+*/
+int group_read_retry(Group *group, unsigned long seq) {
+    if ( !group->shared ) {
+        return 0;
+    }
+    if ( _seq_read_retry(&group->seq, seq) ) {
+        STAT_COUNT(COUNT_READ_RETRIES, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* The same for the directory itself: adding groups and reading the list
+* of groups.
+*/
+void dir_write_begin(GroupDir *dir) {
+    if ( !dir->shared ) {
+        return;
+    }
+    pthread_mutex_lock(&dir->write_lock);
+    _seq_write_begin(&dir->seq);
+}
+
+void dir_write_end(GroupDir *dir) {
+    if ( !dir->shared ) {
+        return;
+    }
+    _seq_write_end(&dir->seq);
+    pthread_mutex_unlock(&dir->write_lock);
+}
+
+unsigned long dir_read_begin(GroupDir *dir) {
+    if ( !dir->shared ) {
+        return 0;
+    }
+    return _seq_read_begin(&dir->seq);
+}
+
+int dir_read_retry(GroupDir *dir, unsigned long seq) {
+    if ( !dir->shared ) {
+        return 0;
+    }
+    return _seq_read_retry(&dir->seq, seq);
+}
+
+#define USER_INDEX_INITIAL_BUCKETS 16
+
+/*
+ * Double the number of buckets in the group's user index (or create it on
+ * the first call) and rehash every user into it.
+ */
+void _grow_user_index(Group *group) {
+    unsigned long nbuckets = group->user_nbuckets ? group->user_nbuckets * 2 : USER_INDEX_INITIAL_BUCKETS;
+    User **buckets = calloc(nbuckets, sizeof(User *));
+    User *currentUser;
+
+    if ( buckets == NULL ) {
+        printf("Error while growing user index. Program will now exit. \n");
+        exit(0);
+    }
+    for ( currentUser = group->users; currentUser; currentUser = currentUser->next ) {
+        unsigned long b = currentUser->hash & (nbuckets - 1);
+        currentUser->hnext = buckets[b];
+        buckets[b] = currentUser;
+    }
+    _retire(&group->retired, group->shared, group->user_buckets);
+    STAT_COUNT(COUNT_INDEX_GROWS, 1);
+    group->user_buckets = buckets;
+    __atomic_store_n(&group->user_nbuckets, nbuckets, __ATOMIC_RELEASE);   // readers load nbuckets, then buckets
+}
+
+/* Return the user in group with user_name, or NULL if there is no such
+* user. This is a lookup in the group's user index, so it does not depend
+* on the number of users in the group.
+*/
+User *find_user(Group *group, const char *user_name) {
+    unsigned long nbuckets = __atomic_load_n(&group->user_nbuckets, __ATOMIC_ACQUIRE);
+
+    if ( nbuckets == 0 ) { // no user was ever added
+        return NULL;
+    }
+
+    unsigned long hash = hash_name(user_name);
+    User *currentUser = group->user_buckets[hash & (nbuckets - 1)];
+    unsigned long visited = 0;
+
+    while ( currentUser ) {
+        visited++;
+        if ( currentUser->hash == hash && strcmp(currentUser->name, user_name) == 0 ) {
+            break;
+        }
+        currentUser = currentUser->hnext;
+    }
+    STAT_WALK(WALK_FIND_USER, visited);
+    return currentUser;
+}
+
+/*
+ * Unlink user from the group's balance-ordered list. The user stays in the
+ * user index.
+ */
+void _unlink_user(Group *group, User *user) {
+    if ( user->prev ) {
+        user->prev->next = user->next;
+    } else {
+        group->users = user->next;
+    }
+    if ( user->next ) {
+        user->next->prev = user->prev;
+    } else {
+        group->last_user = user->prev;
+    }
+    user->next = NULL;
+    user->prev = NULL;
+}
+
+/*
+ * Insert user into the balance tree and link it into the user list right
+ * before the next user in balance order, keeping both in the same order.
+ */
+void _link_user(Group *group, User *user) {
+    ost_insert(&group->user_tree, user);
+
+    User *next = ost_next(group->user_tree, user);
+    if ( next ) {   // insert before next
+        user->next = next;
+        user->prev = next->prev;
+        if ( next->prev ) {
+            next->prev->next = user;
+        } else {
+            group->users = user;
+        }
+        next->prev = user;
+    } else {    // highest balance in the group, append after the previous maximum
+        User *last = group->last_user;
+        user->next = NULL;
+        user->prev = last;
+        if ( last ) {
+            last->next = user;
+        } else {
+            group->users = user;
+        }
+        group->last_user = user;
+    }
+}
+
+/*
+ * Move a user's part of the group's balance aggregates from a balance of
+ * before to one of after. Integer sums, so taking a user out (after = 0)
+ * exactly undoes putting them in.
+ */
+void _adjust_balance_sums(Group *group, Money before, Money after) {
+    group->balance_sum += after - before;
+    group->balance_squares += (unsigned __int128) ((__int128) after * after)
+            - (unsigned __int128) ((__int128) before * before);
+}
+
+/*
+ * Grow the group's id table (and the balance column and free id stack with
+ * it) until it can hold at least capacity ids. New slots are NULL and 0.
+ */
+void _reserve_user_ids(Group *group, unsigned int capacity) {
+    unsigned int newCapacity = group->id_capacity ? group->id_capacity : USER_INDEX_INITIAL_BUCKETS;
+
+    if ( capacity <= group->id_capacity ) {
+        return;
+    }
+    while ( newCapacity < capacity ) {
+        newCapacity *= 2;
+    }
+    User **ids = malloc(newCapacity * sizeof(User *));
+    Money *balances = malloc(newCapacity * sizeof(Money));
+    unsigned int *freeIds = realloc(group->free_ids, newCapacity * sizeof(unsigned int));
+    if ( ids == NULL || balances == NULL || freeIds == NULL ) {
+        printf("Error while growing user id table. Program will now exit. \n");
+        exit(0);
+    }
+    if ( group->id_capacity ) {
+        memcpy(ids, group->user_ids, group->id_capacity * sizeof(User *));
+        memcpy(balances, group->balances, group->id_capacity * sizeof(Money));
+    }
+    memset(ids + group->id_capacity, 0, (newCapacity - group->id_capacity) * sizeof(User *));
+    memset(balances + group->id_capacity, 0, (newCapacity - group->id_capacity) * sizeof(Money));
+    _retire(&group->retired, group->shared, group->user_ids);
+    _retire(&group->retired, group->shared, group->balances);
+    group->user_ids = ids;
+    group->balances = balances;
+    group->free_ids = freeIds;
+    __atomic_store_n(&group->id_capacity, newCapacity, __ATOMIC_RELEASE);  // readers load id_capacity, then the tables
+}
+
+/*
+ * Give user a free id in group, reusing the ids of
+ * removed users first, and record it in the group's id table.
+ */
+void _assign_user_id(Group *group, User *user) {
+    if ( group->free_id_count > 0 ) {
+        user->id = group->free_ids[--group->free_id_count];
+    } else {
+        _reserve_user_ids(group, group->id_count + 1);
+        user->id = group->id_count++;
+    }
+    group->user_ids[user->id] = user;
+}
+
 /* Add a new user with the specified user name to the specified group. Return zero
 * on success and -1 if the group already has a user with that name.
 * (allocate and initialize a User data structure and insert it into the
@@ -109,72 +697,179 @@ Group *find_group(Group *group_list, const char *group_name) {
 int add_user(Group *group, const char *user_name) {
     // ASSUMPTION : group exists
     // check if user already exists in the group
-    if ( find_prev_user(group, user_name) != NULL ) {   // if user_name already in group, return -1
+    if ( find_user(group, user_name) != NULL ) {   // if user_name already in group, return -1
         return -1;
     } else {
         // if the user_name is not already in the group, then add new user to the beginning of group user list
         // First, let's make a new user
-        User *newUsr = malloc(sizeof(User));
-        if ( newUsr == NULL ) {  //if error, exit
-            printf("Error while creating a new user. Program will now exit. \n");
-            exit(0);
-        } else {
-            int LENGTH = strlen(user_name) + 1;
-            newUsr->name = malloc(LENGTH);
-
-            if ( newUsr->name == NULL ) {
-                printf("Error while creating user name. Program will now exit. \n");
-                exit(0);
-            } else { // assign the new user name
-                strncpy(newUsr->name, user_name, LENGTH ); // assign user_name as name of newUsr
-                newUsr->name[LENGTH] = '\0';
-                newUsr->balance = 0; // assign the initial user balance to 0
-                newUsr->next = NULL; // assign next to NULL to indicate end of list.
-            }
-        }
+        User *newUsr = pool_alloc(&group->user_pool);   // exits if out of memory
+        newUsr->name = arena_strdup(&group->names, user_name);
+        newUsr->balance = 0; // assign the initial user balance to 0
+        newUsr->order = --group->order_front; // ahead of every other user with the same balance
+        newUsr->hash = hash_name(user_name);
+        newUsr->totals = NULL; // no transactions yet
+        _assign_user_id(group, newUsr);
 
         // Now that we've made a user, it's time to add it to the given group_name
-        if ( group->users == NULL ) { // if group is empty, assign user and exit
-            group->users = newUsr;
+        _link_user(group, newUsr);
+
+        // and to the user index, growing it to keep the load factor at most 1
+        if ( group->user_count >= group->user_nbuckets ) {
+            _grow_user_index(group); // rehashes newUsr too, it is already on the list
         } else {
-            newUsr->next = group->users;    // since lowest paying user first, add newUsr to beginning of list
-            group->users = newUsr;
+            unsigned long b = newUsr->hash & (group->user_nbuckets - 1);
+            newUsr->hnext = group->user_buckets[b];
+            group->user_buckets[b] = newUsr;
         }
+        group->user_count++;
+        group->version++;
         return 0;   // successfully add, return 0;
     }
 }
 
+/*
+ * Remove all of user's transactions from the group's log, newest first,
+ * and with them the user's totals.
+ */
+void _remove_user_xcts(Group *group, User *user) {
+    struct user_totals *totals = user->totals;
+    unsigned int i = totals ? totals->count : 0, first = totals ? totals->first : 0;
+
+    STAT_WALK(WALK_REMOVE_XCT, i - first);
+    while ( i > first ) {
+        Xct *xct = xct_log_at(&group->xcts, USER_TOTALS_REFS(totals)[--i]);
+        group->xct_sum -= xct->amount;
+        xct_log_remove(&group->xcts, xct);
+    }
+    if ( totals && totals->cold ) {
+        // the ones on disk stay there, cut off from the id; base is their sum
+        group->xct_sum -= totals->base;
+        group->xcts.count -= totals->cold;
+        group->xcts.cold_live -= totals->cold;
+        xct_log_cut(&group->xcts, user->id);
+    }
+    __atomic_store_n(&user->totals, NULL, __ATOMIC_RELEASE);
+    _retire(&group->retired, group->shared, totals);
+}
+
 /* Remove the user with matching user and group name and
 * remove all her transactions from the transaction list. 
 * Return 0 on success, and -1 if no matching user exists.
 * Remember to free memory no longer needed.
-* (Wait on implementing the removal of the user's transactions until you 
-* get to Part III below, when you will implement transactions.)
 */
 int remove_user(Group *group, const char *user_name) {
-    User *currentUser = group->users;
-    User *prevUser = NULL;
-
-    if ( currentUser ) {    // if the group has any users
-        prevUser = find_prev_user(group, user_name);
-        if ( prevUser ) {
-            if ( strcmp(prevUser->name, user_name) == 0 ) {
-                currentUser = prevUser; // the first user = user_name
-                if ( currentUser->next != NULL ) { // if more than one user in the group
-                    group->users = currentUser->next; // redirect head to user #2 (next)
-                } else {
-                    group->users = NULL;    // if current user is only one, assign list to NULL
-                }
-            } else {
-                currentUser = prevUser->next;
-                prevUser->next = currentUser->next; // redirect prev pointer to next
-            }
-            currentUser->next = NULL;  // break link with rest of the list
-            free(currentUser);  // free memory
-            remove_xct(group, user_name); // remove all transactions associated with this user
-            return 0;
-        } else return -1; // user not in group
-    } else return -1;
+    User *currentUser = find_user(group, user_name);
+
+    if ( currentUser == NULL ) {
+        return -1; // user not in group
+    }
+    drop_user(group, currentUser);
+    return 0;
+}
+
+/* Remove currentUser, a user of group that the caller has already found,
+* and all her transactions, as remove_user does.
+*/
+void drop_user(Group *group, User *currentUser) {
+    _remove_user_xcts(group, currentUser); // remove all transactions associated with this user
+
+    // take the user out of its index bucket
+    User **link = &group->user_buckets[currentUser->hash & (group->user_nbuckets - 1)];
+    while ( *link != currentUser ) {
+        link = &(*link)->hnext;
+    }
+    *link = currentUser->hnext;
+    group->user_count--;
+
+    ost_remove(&group->user_tree, currentUser);
+    _unlink_user(group, currentUser); // break link with rest of the list
+
+    // no transaction refers to the id any more, so it can be handed out again
+    group->user_ids[currentUser->id] = NULL;
+    group->balances[currentUser->id] = 0;
+    _adjust_balance_sums(group, currentUser->balance, 0);
+    group->free_ids[group->free_id_count++] = currentUser->id;
+    arena_free_str(&group->names, currentUser->name);
+    pool_free(&group->user_pool, currentUser);  // recycle memory for the next add_user
+    group->version++;
+}
+
+/* Append a user with the given name, balance and id to the end of the
+* group's user list, after prev (NULL for the first one). Used to rebuild a
+* group whose users are known to be in balance order and to have distinct
+* names and ids, such as from a snapshot; the balance tree and the free id
+* list are not updated until finish_restore. Returns the new user.
+*/
+User *restore_user(Group *group, User *prev, const char *user_name, Money balance, unsigned int id) {
+    User *newUsr = pool_alloc(&group->user_pool);
+
+    newUsr->name = arena_strdup(&group->names, user_name);
+    newUsr->balance = balance;
+    newUsr->hash = hash_name(user_name);
+    newUsr->totals = NULL;
+    newUsr->id = id;
+    newUsr->left = NULL;
+    newUsr->right = NULL;
+
+    newUsr->prev = prev;
+    newUsr->next = NULL;
+    if ( prev ) {
+        prev->next = newUsr;
+    } else {
+        group->users = newUsr;
+    }
+    group->last_user = newUsr;
+    _adjust_balance_sums(group, 0, balance);
+
+    // the ids in between are filled in later or freed by finish_restore
+    _reserve_user_ids(group, id + 1);
+    group->user_ids[id] = newUsr;
+    group->balances[id] = balance;
+    if ( id >= group->id_count ) {
+        group->id_count = id + 1;
+    }
+
+    if ( group->user_count >= group->user_nbuckets ) {
+        _grow_user_index(group);
+    } else {
+        unsigned long b = newUsr->hash & (group->user_nbuckets - 1);
+        newUsr->hnext = group->user_buckets[b];
+        group->user_buckets[b] = newUsr;
+    }
+    group->user_count++;
+    return newUsr;
+}
+
+/* Finish rebuilding a group after its users were appended with
+* restore_user: build the balance tree from the list in O(n), give the
+* users tie-break orders that keep the list order, and put the unused ids
+* below id_count (the number of ids the group had handed out) on the free
+* list.
+*/
+void finish_restore(Group *group, unsigned int id_count) {
+    User *currentUser;
+    unsigned int id;
+    long order = 0;
+
+    if ( id_count > group->id_count ) {
+        _reserve_user_ids(group, id_count);
+        group->id_count = id_count;
+    }
+
+    for ( currentUser = group->users; currentUser; currentUser = currentUser->next ) {
+        currentUser->order = order++;
+    }
+    group->order_front = 0;
+    group->order_back = order;
+    group->user_tree = ost_build(group->users, group->user_count);
+    group->version++;
+
+    group->free_id_count = 0;
+    for ( id = group->id_count; id-- > 0; ) {
+        if ( group->user_ids[id] == NULL ) {
+            group->free_ids[group->free_id_count++] = id;
+        }
+    }
 }
 
 /* Print to standard output the names of all the users in group, one
@@ -183,41 +878,34 @@ int remove_user(Group *group, const char *user_name) {
 */
 void list_users(Group *group) {
     // ASSUMPTION : group exists (since buxfer checks for group before calling this func )
-    User *userPtr = group->users; // list of all users
+    User *userPtr = group->users, *nextPtr; // list of all users
+    unsigned long left = group->user_count;   // a torn read of a shared group may not end
+    unsigned long visited = 1;
 
     if ( userPtr ) {    // if 1 or more users exist
-        while ( userPtr->next ) { // iterate through user list, print out all users
-            printf("%s \n", userPtr->name);
-            userPtr = userPtr->next;
+        // next is loaded once, as a writer of a shared group may clear it between two loads
+        while ( (nextPtr = __atomic_load_n(&userPtr->next, __ATOMIC_RELAXED)) && left-- > 1 ) { // iterate through user list, print out all users
+            out_printf("%s \n", userPtr->name);
+            userPtr = nextPtr;
+            visited++;
         }
 
-        printf("%s \n", userPtr->name); // last user
-    } else printf(" \n");   // if no users, print blank line
+        out_printf("%s \n", userPtr->name); // last user
+        STAT_WALK(WALK_LIST_USERS, visited);
+    } else out_printf(" \n");   // if no users, print blank line
 }
 
 /* Print to standard output the balance of the specified user. Return 0
 * on success, or -1 if the user with the given name is not in the group.
 */
 int user_balance(Group *group, const char *user_name) {
+    User *user = find_user(group, user_name);
 
-    User *currentUser = group->users;   // pointer to user group user list
-    User *prevUser = NULL;  // pointer for previous user
-
-    if( currentUser ) {  // if user list is not empty
-        prevUser = find_prev_user(group, user_name);
-        if ( prevUser ) {
-            // if this user is in the group
-            if ( strcmp(prevUser->name, user_name) == 0 ) {  // if first user is user_name
-                // then get this user balance
-                printf("$%.2f\n", prevUser->balance);
-                return 0;
-            } else {
-                // get the next user balance
-                printf("$%.2f\n", prevUser->next->balance);
-                return 0;
-            }
-        } else return -1;   // user not in this group.
-    } else return -1;   // user list is empty, user does not exist in this group.
+    if ( user == NULL ) {
+        return -1;   // user not in this group.
+    }
+    out_printf("$" MONEY_FMT "\n", MONEY_ARGS(user->balance));
+    return 0;
 }
 
 /* Print to standard output the name of the user who has paid the least 
@@ -228,200 +916,511 @@ int user_balance(Group *group, const char *user_name) {
 int under_paid(Group *group) {
     // ASSUMPTION : group exists ( since buxfer checks for group before calling this )
     User *currentUser = group->users;
+    unsigned long left = group->user_count;   // a torn read of a shared group may not end
+    unsigned long visited = 0;
     if ( currentUser ) {
         User *underPaid = currentUser;  // assign "underPaid" pointer to currentUser (#1 which is always the lowest)
-        while ( currentUser->next ) {
-            /*
-             * Iterate through the list, comparing each user to the underPaid one.
-             * If the user balance of current user is less than or equal to that of underPaid, then
-             * it gets printed to screen.
-             */
-            if ( currentUser->balance <= underPaid->balance ) {
-                // if the currentUser balance is <= to the underpaid balance, then print to screen
-                printf("%s\n", currentUser->name);
-            }
-            currentUser = currentUser->next; // go on to next one w/o exiting because we want ALL under_paid
-        }
-
-        if ( currentUser->balance <= underPaid->balance ) { // check the last element
-            printf("%s\n", currentUser->name );
+        // the list is sorted, so the users tied with the first one are the ones right after it
+        while ( currentUser && currentUser->balance <= underPaid->balance && left-- > 0 ) {
+            out_printf("%s\n", currentUser->name);
+            currentUser = currentUser->next;
+            visited++;
         }
+        STAT_WALK(WALK_UNDER_PAID, visited);
         return 0;   // successful exit
     } else return -1;  // no users in this group
 }
 
+/* Print to standard output the names and balances of the k users who have
+* paid the most, highest balance first, one per line. Prints fewer if the
+* group has fewer than k users. Returns 0 on success, and -1 if the list of
+* users is empty.
+*/
+int top_payers(Group *group, long k) {
+    User *currentUser = ost_last(group->user_tree);
+
+    if ( currentUser == NULL ) {
+        return -1;  // no users in this group
+    }
+    for ( ; k > 0 && currentUser; k-- ) {
+        out_printf("%s: $" MONEY_FMT "\n", currentUser->name, MONEY_ARGS(currentUser->balance));
+        currentUser = currentUser->prev;
+    }
+    return 0;
+}
+
+/* Print to standard output the rank of the specified user among all users
+* of the group, where rank 1 is the user who has paid the most. Return 0 on
+* success, or -1 if the user with the given name is not in the group.
+*/
+int user_rank(Group *group, const char *user_name) {
+    User *user = find_user(group, user_name);
+
+    if ( user == NULL ) {
+        return -1;
+    }
+    out_printf("#%lu of %lu\n", group->user_count - ost_rank(group->user_tree, user), group->user_count);
+    return 0;
+}
+
+/* Print to standard output the balance at the given percentile (0 to 100)
+* of the group's balances, using the nearest-rank method: the smallest
+* balance that at least percentile% of the users are at or below. Returns 0
+* on success, and -1 if the list of users is empty.
+*/
+int balance_percentile(Group *group, double percentile) {
+    unsigned long n = group->user_count;
+
+    if ( n == 0 ) {
+        return -1;
+    }
+    unsigned long k = (unsigned long) ((percentile / 100.0) * n); // nearest rank, rounded up
+    if ( (double) k < (percentile / 100.0) * n ) {
+        k++;
+    }
+    if ( k == 0 ) {
+        k = 1;
+    } else if ( k > n ) {
+        k = n;
+    }
+    Money balance = ost_select(group->user_tree, k - 1)->balance;
+    out_printf("$" MONEY_FMT "\n", MONEY_ARGS(balance));
+    return 0;
+}
+
+/* Return the sum of the balances of all the users in group. This is a scan
+* of the group's balance column rather than of its users.
+*/
+Money group_total(Group *group) {
+    unsigned int capacity = __atomic_load_n(&group->id_capacity, __ATOMIC_ACQUIRE);
+    unsigned int n = group->id_count;
+
+    if ( n > capacity ) {   // a torn read of a shared group
+        n = capacity;
+    }
+    return money_sum(group->balances, n);
+}
+
+/*
+ * total / n rounded to the cent, half away from zero like the cents of an
+ * amount; n must not be 0.
+ */
+Money _average(Money total, unsigned long n) {
+    return (total < 0 ? total - (Money) n / 2 : total + (Money) n / 2) / (Money) n;
+}
+
+/* Print to standard output the average balance of the users in group,
+* rounded to the cent. Returns 0 on success, and -1 if the list of users is
+* empty.
+*/
+int group_average(Group *group) {
+    unsigned long n = group->user_count;
+    Money total = group_total(group);
+
+    if ( n == 0 ) {
+        return -1;
+    }
+    Money average = _average(total, n);
+    out_printf("$" MONEY_FMT "\n", MONEY_ARGS(average));
+    return 0;
+}
+
+/* Print to standard output, on one line, the group's number of users, the
+* total, average, lowest and highest of their balances and the standard
+* deviation of the balances, then the number and total of its
+* transactions. Everything comes from sums kept up to date by every change
+* and from the two ends of the user list, so this is O(1) however big the
+* group is. An empty group has all zeros.
+*/
+void group_summary(Group *group) {
+    User *first = __atomic_load_n(&group->users, __ATOMIC_RELAXED);
+    User *last = __atomic_load_n(&group->last_user, __ATOMIC_RELAXED);
+    unsigned long n = group->user_count;
+    Money total = group->balance_sum, average = 0, deviation = 0;
+
+    if ( n > 0 ) {
+        // the variance is (n * squares - total^2) / n^2; the difference is
+        // exact unless n * squares overflows, so only the root rounds
+        unsigned __int128 squares = group->balance_squares;
+        long double variance;
+        if ( squares <= ~(unsigned __int128) 0 / n ) {
+            variance = (long double) (squares * n - (unsigned __int128) ((__int128) total * total)) / n / n;
+        } else {
+            long double mean = (long double) total / n;
+            variance = (long double) squares / n - mean * mean;
+        }
+        average = _average(total, n);
+        deviation = variance > 0 ? llroundl(sqrtl(variance)) : 0;
+    }
+    out_printf("Users: %lu; Total: $" MONEY_FMT "; Average: $" MONEY_FMT "; Min: $" MONEY_FMT "; Max: $" MONEY_FMT
+            "; Std dev: $" MONEY_FMT "; Transactions: %lu; Transaction total: $" MONEY_FMT ".\n",
+            n, MONEY_ARGS(total), MONEY_ARGS(average), MONEY_ARGS(first ? first->balance : 0),
+            MONEY_ARGS(last ? last->balance : 0), MONEY_ARGS(deviation), group->xcts.count, MONEY_ARGS(group->xct_sum));
+}
+
 /* Return a pointer to the user prior to the one in group with user_name. If 
 * the matching user is the first in the list (i.e. there is no prior user in 
 * the list), return a pointer to the matching user itself. If no matching user 
 * exists, return NULL. 
 *
-* The reason for returning the prior user is that returning the matching user 
-* itself does not allow us to change the user that occurs before the
-* matching user, and some of the functions you will implement require that
-* we be able to do this.
+* The users are doubly linked, so this is a find_user lookup followed by
+* one step back; callers that only need the user should use find_user.
 */
 User *find_prev_user(Group *group, const char *user_name) {
+    User *user = find_user(group, user_name);
 
-    User *previous, *current; // pointers for previous and current users
+    if ( user == NULL ) {
+        STAT_WALK(WALK_FIND_PREV_USER, 0);
+        return NULL; // if user not found in the group, return NULL.
+    }
+    STAT_WALK(WALK_FIND_PREV_USER, 1);  // the step back, on top of find_user's walk
+    return user->prev ? user->prev : user;
+}
 
-    if ( group->users ) { // if there are users in the group
-        current = group->users; // assign current to the head of the group user list
-        // case 1 : 1 user
-        if( current->next == NULL ){
-            if ( strcmp(current->name, user_name) == 0 ) {
-                return current;
-            } else return NULL;
-        } else {
-            // case 2 : multiple users
-            // Check current (head = first user)
-            if ( strcmp(current->name, user_name) == 0 ) {
-                return current;     // if first user = user_name, return the first element itself.
-            } else {
-                // if it's not the first one, proceed to further users
-                previous = current;
-                current = current->next;
-                while ( current->next ) {
-                    if ( strcmp(current->name, user_name) == 0 ) {  // if the current = user_name
-                        return previous;    // return the pointer to the previous user
-                    }
-                    previous = current; // reassign previous and current, continue to iterate
-                    current = current->next;
-                }
+/*
+ * Add the transaction xct of amount, the user's newest, and their running
+ * total after it to the end of their totals.
+ */
+void _append_total(Group *group, User *user, Xct *xct, Money amount) {
+    struct user_totals *totals = user->totals;
+    unsigned int count = totals ? totals->count : 0, first = totals ? totals->first : 0;
+    Money before = count > first ? totals->items[count - 1] : totals ? totals->base : 0;
 
-                if(strcmp(current->name, user_name) == 0) { // check the last element
-                    return previous;
-                }
-            }
-            return NULL; // if user not found in the group, return NULL.
+    if ( totals == NULL || count == totals->capacity ) {
+        // only the entries still in memory are copied
+        count -= first;
+        unsigned int capacity = count ? count * 2 : USER_TOTALS_INITIAL;
+        struct user_totals *grown = malloc(sizeof(struct user_totals) + capacity * (sizeof(Money) + sizeof(XctRef)));
+        if ( grown == NULL ) {
+            printf("Error while growing user totals. Program will now exit. \n");
+            exit(0);
+        }
+        grown->count = count;
+        grown->capacity = capacity;
+        grown->first = 0;
+        grown->cold = totals ? totals->cold : 0;
+        grown->base = totals ? totals->base : 0;
+        if ( count ) {
+            memcpy(grown->items, totals->items + first, count * sizeof(Money));
+            memcpy(USER_TOTALS_REFS(grown), USER_TOTALS_REFS(totals) + first, count * sizeof(XctRef));
         }
-    } else return NULL; // if no users in the group, return NULL.
+        __atomic_store_n(&user->totals, grown, __ATOMIC_RELEASE);  // readers load totals, then its count
+        _retire(&group->retired, group->shared, totals);
+        totals = grown;
+    }
+    totals->items[count] = before + amount;
+    USER_TOTALS_REFS(totals)[count] = xct_log_ref(xct);
+    __atomic_store_n(&totals->count, count + 1, __ATOMIC_RELEASE);
 }
 
 /*
- * Meant to be used inside add_xct, with it's parameters.
- * This bit of code makes a new transaction, then adds it to the head of the xcts struct
-*/
-
-void _xct_helper (Group *group, const char *user_name, double amount) {
-    Xct *newTrans = malloc(sizeof(Xct));    // make new transaction
-    if ( newTrans != NULL ) {
-        int LENGTH = strlen(user_name) + 1;
-        newTrans->name = malloc(LENGTH); // make new transaction name element
-        if ( newTrans->name != NULL ) {
-            strncpy(newTrans->name, user_name, LENGTH ); // assign user_name as name of transaction
-            newTrans->name[LENGTH] = '\0';
-            newTrans->amount = amount;  // assign amount to the transaction
-        } else {
-            printf("Error while making new transaction name.\n");
-            exit(0);
-        }
+ * Spill the oldest chunk of the group's log to disk. Its records are the
+ * oldest entries still in memory of their users' totals, so each one moves
+ * its user's first entry on and becomes their base; once half of a user's
+ * entries have been passed, the rest are moved down over them.
+ */
+void _spill_oldest(Group *group) {
+    struct xct_chunk *chunk = group->xcts.head;
+    unsigned long i;
 
-        if (  group->xcts == NULL ) {   // if no transactions, just assign it to transaction
-            group->xcts = newTrans;
-        } else {
-             // add transaction to head to it will be easier to retrieve for "recent_xct" function
-            newTrans->next = group->xcts;
-            group->xcts = newTrans;
+    for ( i = 0; i < chunk->count; i++ ) {
+        unsigned int userId = chunk->records[i].user_id;
+        if ( userId == XCT_REMOVED ) {
+            continue;
         }
-    } else {
-        printf("Error while making a new transaction. \n");
-        exit(0);
+        struct user_totals *totals = group->user_ids[userId]->totals;
+        unsigned int first = totals->first;
+        totals->base = totals->items[first++];
+        totals->cold++;
+        if ( first * 2 >= totals->count ) {
+            unsigned int live = totals->count - first;
+            memmove(totals->items, totals->items + first, live * sizeof(Money));
+            memmove(USER_TOTALS_REFS(totals), USER_TOTALS_REFS(totals) + first, live * sizeof(XctRef));
+            __atomic_store_n(&totals->count, live, __ATOMIC_RELEASE);
+            first = 0;
+        }
+        __atomic_store_n(&totals->first, first, __ATOMIC_RELEASE);
     }
+    xct_log_spill_head(&group->xcts);
 }
 
 /*
-*   This is a helper function for add transaction. It updates the user position in the user list,
-*   rearranging the list in an ascending order, so that the lowest paying users are at the beginning.
+ * Meant to be used inside add_xct, with it's parameters.
+ * This bit of code appends a new transaction to the group's transaction log,
+ * and the user's new running total to their totals.
+ * The record refers to the user by id; remove_user removes the user's
+ * transactions before the id can be reused. A log with a hot window spills
+ * its oldest chunk once it has one chunk too many.
+ */
+
+void _xct_helper (Group *group, User *user, Money amount, uint32_t when) {
+    Xct *newTrans = xct_log_append(&group->xcts, when);    // make new transaction
+
+    newTrans->user_id = user->id;
+    newTrans->amount = amount;  // assign amount to the transaction
+    group->xct_sum += amount;
+    _append_total(group, user, newTrans, amount);   // and keep it with the user's others
+    if ( group->xcts.hot_chunks && group->xcts.nchunks > group->xcts.hot_chunks ) {
+        _spill_oldest(group);
+    }
+}
+
+/*
+*   This is a helper function for add transaction. It changes the user's balance to new_balance
+*   and moves the user to its new position in the balance tree and user list, which stay in
+*   ascending order, so that the lowest paying users are at the beginning.
 *   return 0 = success; return -1 = fail.
 *   @param user -- this is a pointer to user to be repositioned.
 *   @param group -- a pointer to your group (in which the user is).
+*   @param new_balance -- the user's balance after the transaction.
 */
 
-int _update_user_position(Group *group, User *user){
-
-    // make new placeholder pointers to be used here
-    User *prevUser;
-    User *currentUser = group->users; //get the head
-
+int _update_user_position(Group *group, User *user, Money new_balance){
     if ( user == NULL ) { // if invalid user input
         return -1;
     }
 
-    // if only one user in list, exit successfully
-    if ( currentUser->next == NULL ) {
-        return 0;
-    } else {
-        /* IF multiple users in list:
-        * 1) Remove user from list by reassigning previous and next pointers.
-        * 2) Reinsert the user at a new position
-        */
-        prevUser = find_prev_user(group, user->name);
-
-        if ( strcmp(prevUser->name, user->name) == 0 ) {  // if first user
-            group->users = user->next; // redirect head to #2 (next)
-            user->next = NULL;  // break link with rest of the list
-        } else {    // if middle user
-            prevUser->next = user->next;    // redirect previous pointer to next
-            user->next = NULL;  // break link with next/rest of the list
-        }
+    unsigned long treeNodes = STAT_VALUE(COUNT_TREE_NODES);
 
-        currentUser = group->users;
-
-        while ( currentUser->next ) {
-            /*
-                Iterate through the list until you arrive at a place where our user's balance
-                if LESS or EQUAL TO than the current user's balance. At this point, get the
-                prevUser of currentUser, assign prevUser.next pointer to our user.
-                Then assign our user.next pointer to currentUser, thereby inserting our
-                user into it's correct place in the user list.
-            */
-            if ( user->balance < currentUser->balance ) {
-                prevUser = find_prev_user(group, currentUser->name);    // find previous user
-                prevUser->next = user;    // redirect it's pointer to our user
-                user->next = currentUser; // point our user's next to current user
-                return 0;   // exit successfully
-            }
-            currentUser = currentUser->next;
-        }
+    // the tree is keyed on the balance, so take the user out before changing it
+    ost_remove(&group->user_tree, user);
+    _unlink_user(group, user);
 
-        // if not in above, check if the last currentUser balance in list is greater than our user balance
-        if ( user->balance < currentUser->balance ) {
-            prevUser = find_prev_user(group, currentUser->name);
-            prevUser->next = user;
-            user->next = currentUser;
-            return 0;
-        }
+    _adjust_balance_sums(group, user->balance, new_balance);
+    user->balance = new_balance;
+    group->balances[user->id] = new_balance;
+    user->order = ++group->order_back; // behind every other user with the same balance
+    _link_user(group, user);
+    STAT_WALK(WALK_UPDATE_POSITION, STAT_VALUE(COUNT_TREE_NODES) - treeNodes);
+    return 0;
+}
 
-        // if our user balance is greater than the entire list, place it at the end and exit
-        currentUser->next = user;
-        return 0;
+/* Append a transaction of amount by the user with user_id at time when to
+* the group's log without touching the user's balance, for rebuilding a
+* group whose balances are already known. Returns 0 on success, and -1 if
+* no user has that id or when is before the last transaction's time.
+*/
+int restore_xct(Group *group, unsigned int user_id, Money amount, uint32_t when) {
+    if ( user_id >= group->id_count || group->user_ids[user_id] == NULL || when < group->xcts.last_time ) {
+        return -1;
     }
+    _xct_helper(group, group->user_ids[user_id], amount, when);
+    return 0;
 }
 
 /* Add the transaction represented by user_name and amount to the appropriate 
 * transaction list, and update the balances of the corresponding user and group. 
 * Note that updating a user's balance might require the user to be moved to a
-* different position in the list to keep the list in sorted order. Returns 0 on
-* success, and -1 if the specified user does not exist.
+* different position in the list to keep the list in sorted order. The
+* transaction happened at time when, which keeps the log in time order, so
+* it can't be before the group's last transaction. Returns 0 on success, -1
+* if the specified user does not exist, and -2 if when is too early.
+*/
+int add_xct(Group *group, const char *user_name, Money amount, uint32_t when) {
+    User *user = find_user(group, user_name); // user associated with this transaction
+
+    if ( user == NULL ) {
+        return -1; // user does not exist in this group
+    }
+    return post_xct(group, user, amount, when);
+}
+
+/* Add a transaction of amount at time when for user, a user of group that
+* the caller has already found, as add_xct does. Returns 0 on success, and
+* -2 if when is before the group's last transaction.
 */
-int add_xct(Group *group, const char *user_name, double amount) {
-    User *prevUser = NULL; // pointer for previous user
-    User *user = NULL; // pointer to user associated with this transaction
+int post_xct(Group *group, User *user, Money amount, uint32_t when) {
+    if ( when < group->xcts.last_time ) {
+        return -2;
+    }
+    _xct_helper(group, user, amount, when);  // add the transaction to the log
+    _update_user_position(group, user, user->balance + amount); // update balance and position
+    group->version++;
+    return 0;
+}
+
+/* A user with transactions in an add_xct_batch: the sum of their amounts,
+ * and the position in the batch of the last one.
+ */
+struct batch_user {
+    User *user;
+    unsigned long last;
+    Money amount;
+};
+
+int _by_user(const void *a, const void *b) {
+    const struct batch_user *x = a, *y = b;
+
+    if ( x->user->id != y->user->id ) {
+        return x->user->id < y->user->id ? -1 : 1;
+    }
+    return x->last < y->last ? -1 : x->last > y->last;
+}
 
-    // Check if user exists
-    prevUser = find_prev_user(group, user_name);
+int _by_last(const void *a, const void *b) {
+    const struct batch_user *x = a, *y = b;
 
-    if ( prevUser ) {   // if user in group
-        if ( strcmp(prevUser->name, user_name) == 0 ) {
-            user = prevUser;
+    return x->last < y->last ? -1 : x->last > y->last;
+}
+
+/*
+ * Whether a comes before b in the user list: by balance, then by order.
+ */
+int _user_before(const User *a, const User *b) {
+    return a->balance < b->balance || (a->balance == b->balance && a->order < b->order);
+}
+
+int _by_balance(const void *a, const void *b) {
+    const User *x = *(User * const *) a, *y = *(User * const *) b;
+
+    return _user_before(x, y) ? -1 : _user_before(y, x);
+}
+
+/*
+ * Give the k users of moved, in the order of their last transaction, their
+ * new balances, then put the whole user list back in order at once: the
+ * moved users are sorted among themselves and merged with the others,
+ * which are still in order, and the balance tree is built again from the
+ * list. O(n + k log k) for n users, instead of k moves of O(log n) each.
+ */
+void _reorder_users(Group *group, struct batch_user *moved, unsigned long k) {
+    User **sorted = malloc(k * sizeof(User *));
+    User *rest, *head = NULL, *tail = NULL, *next;
+    unsigned long i, j = 0;
+
+    if ( sorted == NULL ) {
+        printf("Error while reordering users. Program will now exit. \n");
+        exit(0);
+    }
+    for ( i = 0; i < k; i++ ) {
+        User *user = moved[i].user;
+        _unlink_user(group, user);  // the tree is rebuilt below
+        _adjust_balance_sums(group, user->balance, user->balance + moved[i].amount);
+        user->balance += moved[i].amount;
+        group->balances[user->id] = user->balance;
+        user->order = ++group->order_back; // behind every other user with the same balance
+        sorted[i] = user;
+    }
+    qsort(sorted, k, sizeof(User *), _by_balance);
+
+    for ( rest = group->users; rest || j < k; tail = next ) {
+        if ( j < k && (rest == NULL || _user_before(sorted[j], rest)) ) {
+            next = sorted[j++];
         } else {
-            user = prevUser->next;
+            next = rest;
+            rest = rest->next;
         }
-        _xct_helper(group, user_name, amount);  // add the transaction to xct node
-        user->balance = user->balance + amount; // update user balance
-        _update_user_position(group, user);     // update user position based on new balance
+        next->prev = tail;
+        if ( tail ) {
+            tail->next = next;
+        } else {
+            head = next;
+        }
+    }
+    tail->next = NULL;
+    group->users = head;
+    group->last_user = tail;
+    group->user_tree = ost_build(head, group->user_count);
+    free(sorted);
+}
+
+/* Add the n transactions of items, at time when, to group as n add_xct
+* calls would, but resolving every user first and putting the users back
+* in balance order once: each user moves once however many of the
+* transactions are theirs, and when many users move the list is merged and
+* the tree rebuilt instead. The log, the totals, the balances and the
+* order of the users (ties included) end up the same as with add_xct.
+* If balances is not NULL, balances[i] is set to the balance of item i's
+* user right after item i, as add_xct would have left it.
+* Returns 0 on success, -2 if when is before the group's last
+* transaction, and -1, with *missing set to the position of the first
+* item whose user is not in the group, if one isn't; then nothing is added.
+*/
+int add_xct_batch(Group *group, const struct batch_xct *items, unsigned long n, uint32_t when, unsigned long *missing,
+        Money *balances) {
+    struct batch_user *touched;
+    unsigned long i, k;
+    Money running = 0;  // the balance of the user of item i, see balances
+
+    if ( when < group->xcts.last_time ) {
+        return -2;
+    }
+    if ( n == 0 ) {
         return 0;
-    } else return -1; // user does not exist in this group
+    }
+    touched = malloc(n * sizeof(struct batch_user));
+    if ( touched == NULL ) {
+        printf("Error while adding transactions. Program will now exit. \n");
+        exit(0);
+    }
+    for ( i = 0; i < n; i++ ) {
+        touched[i].user = find_user(group, items[i].user_name);
+        if ( touched[i].user == NULL ) {
+            *missing = i;
+            free(touched);
+            return -1;
+        }
+        touched[i].last = i;
+        touched[i].amount = items[i].amount;
+    }
+
+    // the log and the users' totals take the transactions in batch order
+    for ( i = 0; i < n; i++ ) {
+        _xct_helper(group, touched[i].user, items[i].amount, when);
+    }
+
+    // one entry per user, then in the order one add_xct at a time would
+    // have moved them last; each user's items are in batch order here, and
+    // their balances not yet changed
+    qsort(touched, n, sizeof(struct batch_user), _by_user);
+    for ( i = 0, k = 0; i < n; i++ ) {
+        if ( balances ) {
+            running = (k > 0 && touched[k - 1].user == touched[i].user ? running : touched[i].user->balance) + touched[i].amount;
+            balances[touched[i].last] = running;
+        }
+        if ( k > 0 && touched[k - 1].user == touched[i].user ) {
+            touched[k - 1].amount += touched[i].amount;
+            touched[k - 1].last = touched[i].last;
+        } else {
+            touched[k++] = touched[i];
+        }
+    }
+    qsort(touched, k, sizeof(struct batch_user), _by_last);
+
+    if ( k * BATCH_REBUILD_FRACTION < group->user_count ) {
+        for ( i = 0; i < k; i++ ) {
+            _update_user_position(group, touched[i].user, touched[i].user->balance + touched[i].amount);
+        }
+    } else {
+        _reorder_users(group, touched, k);
+    }
+    group->version++;
+    free(touched);
+    return 0;
+}
+
+/*
+ * The name of the user with userId, or "" if a reader of a shared group
+ * sees a record whose user was just removed.
+ */
+const char *_xct_user_name(Group *group, unsigned int userId) {
+    User *user = userId < __atomic_load_n(&group->id_capacity, __ATOMIC_ACQUIRE) ? group->user_ids[userId] : NULL;
+
+    return user ? user->name : "";
+}
+
+/*
+ * A stream over the group's spilled transactions, see xct_stream_at.
+ */
+struct xct_stream *_open_stream(Group *group) {
+    struct xct_stream *stream = malloc(sizeof(struct xct_stream));
+
+    if ( stream == NULL ) {
+        printf("Error while reading transactions. Program will now exit. \n");
+        exit(0);
+    }
+    xct_stream_init(stream, &group->xcts);
+    return stream;
 }
 
 /* Print to standard output the num_xct most recent transactions for the 
@@ -429,61 +1428,198 @@ int add_xct(Group *group, const char *user_name, double amount) {
 * transactions posted for this group). The output should have one line per 
 * transaction that prints the name and the amount of the transaction. If 
 * there are no transactions, this function will print nothing.
+*
+* Those past the ones in memory are streamed backwards from disk.
 */
 void recent_xct(Group *group, long nu_xct) {
     // ASSUMPTION : group exists
 
-    Xct *xctPtr = group->xcts;
+    struct xct_chunk *chunk = group->xcts.tail;
 
-    if( xctPtr == NULL ) {
-        printf(" \n"); //print nothing if no transactions
+    if( group->xcts.count == 0 ) {
+        out_printf(" \n"); //print nothing if no transactions
     } else {
-        long num;
-        for ( num = nu_xct ; num > 0; num-- ) {
-            printf("Transaction #%s; Amount: %.2f.\n", xctPtr->name, xctPtr->amount);
-            if( xctPtr->next == NULL ) {
+        long num = nu_xct;
+        unsigned long visited = 0;
+        // newest first: walk each chunk's records backwards, then move to the older chunk
+        for ( ; chunk && num > 0; chunk = chunk->prev ) {
+            Xct *xctPtr = &chunk->records[chunk->count];
+            while ( xctPtr != chunk->records && num > 0 ) {
+                xctPtr--;
+                visited++;
+                unsigned int userId = xctPtr->user_id;
+                if ( userId != XCT_REMOVED ) {
+                    out_printf("Transaction #%s; Amount: " MONEY_FMT ".\n", _xct_user_name(group, userId), MONEY_ARGS(xctPtr->amount));
+                    num--;
+                }
+            }
+        }
+        unsigned long index = __atomic_load_n(&group->xcts.cold_count, __ATOMIC_ACQUIRE);
+        if ( num > 0 && index > 0 ) {
+            struct xct_stream *stream = _open_stream(group);
+            const Xct *xct;
+            while ( num > 0 && index > 0 && (xct = xct_stream_at(stream, --index)) != NULL ) {
+                visited++;
+                if ( xct_log_cold_live(&group->xcts, xct, index) ) {
+                    out_printf("Transaction #%s; Amount: " MONEY_FMT ".\n", _xct_user_name(group, xct->user_id), MONEY_ARGS(xct->amount));
+                    num--;
+                }
+            }
+            free(stream);
+        }
+        STAT_WALK(WALK_RECENT_XCT, visited);
+    }
+}
+
+/*
+ * Print xct, a transaction of group, with its time, as xct_range does.
+ */
+void _print_timed_xct(Group *group, const Xct *xct) {
+    time_t seconds = xct->time;
+    struct tm tm;
+    char when[32];
+
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&seconds, &tm));
+    out_printf("Transaction #%s; Amount: " MONEY_FMT "; Time: %s.\n", _xct_user_name(group, xct->user_id), MONEY_ARGS(xct->amount), when);
+}
+
+/* Print to standard output the transactions of group from time from to time
+* to, both included, oldest first, one per line with their time, followed
+* by their total. The first one is found by binary search and the rest
+* are read in log order: first those on disk, if the range starts there,
+* streamed forwards, then those in memory.
+*/
+void xct_range(Group *group, uint32_t from, uint32_t to) {
+    Xct *xctPtr;
+    unsigned long left = __atomic_load_n(&group->xcts.nchunks, __ATOMIC_ACQUIRE) * XCT_CHUNK_RECORDS;
+    unsigned long visited = 0, count = 0;
+    Money total = 0;
+    int ended = 0;
+
+    unsigned long coldCount = __atomic_load_n(&group->xcts.cold_count, __ATOMIC_ACQUIRE);
+    if ( coldCount > 0 && from <= group->xcts.cold_last_time ) {
+        struct xct_stream *stream = _open_stream(group);
+        unsigned long index = xct_log_cold_seek(&group->xcts, from);
+        const Xct *xct;
+        // what a writer spills meanwhile is left to the retry
+        for ( ; index < coldCount && (xct = xct_stream_at(stream, index)) != NULL; index++ ) {
+            if ( xct->time > to ) {
+                ended = 1;
                 break;
             }
-            xctPtr = xctPtr->next;
-         }
+            visited++;
+            if ( xct_log_cold_live(&group->xcts, xct, index) ) {
+                _print_timed_xct(group, xct);
+                total += xct->amount;
+                count++;
+            }
+        }
+        free(stream);
     }
+    // left bounds the walk, since a torn read of a shared group may not end
+    for ( xctPtr = ended ? NULL : xct_log_seek(&group->xcts, from); xctPtr && xctPtr->time <= to && left-- > 0;
+            xctPtr = xct_log_next(xctPtr) ) {
+        visited++;
+        if ( xctPtr->user_id == XCT_REMOVED ) {
+            continue;
+        }
+        _print_timed_xct(group, xctPtr);
+        total += xctPtr->amount;
+        count++;
+    }
+    STAT_WALK(WALK_XCT_RANGE, visited);
+    out_printf("Total: $" MONEY_FMT " in %lu transactions.\n", MONEY_ARGS(total), count);
+}
+
+/*
+ * The total of the transactions of the user with userId on disk that are
+ * at or before time when, streamed from whichever end of the segment is
+ * nearer when: those up to it, or base less those after it.
+ */
+Money _cold_total_at(Group *group, unsigned int userId, Money base, uint32_t when) {
+    unsigned long split = xct_log_cold_seek(&group->xcts, when + 1);
+    unsigned long count = __atomic_load_n(&group->xcts.cold_count, __ATOMIC_ACQUIRE);
+    int upTo = split < count - split;
+    unsigned long index = upTo ? 0 : split, end = upTo ? split : count;
+    struct xct_stream *stream = _open_stream(group);
+    const Xct *xct;
+    Money sum = 0;
+
+    for ( ; index < end && (xct = xct_stream_at(stream, index)) != NULL; index++ ) {
+        if ( xct->user_id == userId && xct_log_cold_live(&group->xcts, xct, index) ) {
+            sum += xct->amount;
+        }
+    }
+    free(stream);
+    return upTo ? sum : base - sum;
+}
+
+/*
+ * The user's total in entries first to count of totals as of time when:
+ * that of the last transaction at or before when. The times are read from
+ * the records in the group's log; before the first of them, the total is
+ * 0, or base once the user's transactions on disk are all that old, or
+ * else is read from disk.
+ */
+Money _total_at(Group *group, const User *user, const struct user_totals *totals, unsigned int first, unsigned int count, uint32_t when) {
+    const XctRef *refs = USER_TOTALS_REFS(totals);
+    unsigned int lo = first, hi = count;
+
+    while ( lo < hi ) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if ( xct_log_at(&group->xcts, refs[mid])->time <= when ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ( lo > first ) {
+        return totals->items[lo - 1];
+    }
+    if ( totals->cold == 0 ) {
+        return 0;
+    }
+    return when >= group->xcts.cold_last_time ? totals->base : _cold_total_at(group, user->id, totals->base, when);
+}
+
+/* Print to standard output how much the specified user spent from time from
+* to time to, both included: the difference of two running totals, each
+* found by binary search, or streamed from disk for a time before the
+* user's transactions in memory. Return 0 on success, or -1 if the user with the
+* given name is not in the group.
+*/
+int user_spend(Group *group, const char *user_name, uint32_t from, uint32_t to) {
+    User *user = find_user(group, user_name);
+    Money spent = 0;
+
+    if ( user == NULL ) {
+        return -1;
+    }
+    struct user_totals *totals = __atomic_load_n(&user->totals, __ATOMIC_ACQUIRE);
+    if ( totals ) {
+        unsigned int count = __atomic_load_n(&totals->count, __ATOMIC_ACQUIRE);
+        unsigned int first = __atomic_load_n(&totals->first, __ATOMIC_ACQUIRE);
+        spent = _total_at(group, user, totals, first, count, to) - (from > 0 ? _total_at(group, user, totals, first, count, from - 1) : 0);
+    }
+    out_printf("$" MONEY_FMT "\n", MONEY_ARGS(spent));
+    return 0;
 }
 
 /* Remove all transactions that belong to the user_name from the group's 
 * transaction list. This helper function should be called by remove_user. 
 * If there are no transactions for this user, the function should do nothing.
 * Remember to free memory no longer needed.
+*
+* Only the user's own transactions are visited, through the refs in their
+* totals, newest first; chunks that end up empty are freed. The user's
+* totals go with them.
 */
 
 void remove_xct(Group *group, const char *user_name) {
-    Xct *currentXct = group->xcts;  // make your pointers
-    Xct *prevXct = NULL;
-
-    if ( currentXct ) { // if there are any transactions
-        while ( currentXct->next ) {
-            // iterate through xcts to find ones associated with given user_name
-            // then get the previous pointer and point it to then next,
-            // free up memory and then go on down the list. Continue till last element.
-            if ( strcmp(currentXct->name, user_name) == 0 ) {
-                if ( prevXct == NULL  ) {
-                    group->xcts = currentXct->next;
-                } else {
-                    prevXct->next = currentXct->next;
-                }
-                //currentXct->next = NULL;
-                free(currentXct);
-            }
-            prevXct = currentXct;
-            currentXct = currentXct->next;
-        }
+    User *user = find_user(group, user_name);
 
-        if ( strcmp(currentXct->name, user_name) == 0 ) {
-            if ( prevXct == NULL ) {    // if this is the only transaction
-                group->xcts = NULL;
-            } else {    // if this is the last transaction
-                free(currentXct);
-                prevXct->next = NULL;
-            }
-        }
+    if ( user != NULL ) {
+        _remove_user_xcts(group, user);
     }
-}
\ No newline at end of file
+}
+
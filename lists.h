@@ -3,42 +3,240 @@
 #ifndef LISTS_H
 #define LISTS_H
 
+#include <pthread.h>
+#include "pool.h"
+#include "money.h"
+
+/* Memory that a shared group or directory replaced while readers may still
+ * be looking at it. It is freed together with the group or directory.
+ */
+struct retired {
+	struct retired *next;
+	void *ptr;
+};
+
+/* Append-only transaction log, see xctlog.h. The records live in large
+ * chunks that are chained oldest (head) to newest (tail); count is the
+ * number of records that have not been removed.
+ */
+struct xct_log {
+	struct xct_chunk *head;
+	struct xct_chunk *tail;
+	unsigned long count;
+	uint32_t last_time;	/* time of the newest record */
+	struct xct_chunk **index;	/* the chunks, oldest first */
+	unsigned long nchunks;
+	unsigned long index_capacity;
+	struct xct_chunk **table;	/* chunk id -> chunk, see XctRef */
+	unsigned int table_count;	/* chunk ids handed out so far */
+	unsigned int table_capacity;
+	unsigned int *free_chunk_ids;	/* ids of freed chunks, ready for reuse */
+	unsigned int free_chunk_count;
+	struct retired *retired;	/* outgrown indexes and tables */
+	struct pool chunks;
+	unsigned long hot_chunks;	/* chunks kept in memory, 0 for all */
+	int cold_fd;	/* older records, spilled to disk; -1 until the first spill */
+	unsigned long cold_count;	/* records in the cold segment */
+	unsigned long cold_live;	/* of those, the ones not removed */
+	uint32_t cold_last_time;	/* time of the segment's last record */
+	unsigned long *cold_cut;	/* user id -> the id's records before this
+				 * index in the segment have been removed */
+	unsigned int cold_cut_capacity;
+};
+
 struct group {
 	char *name;
 	struct user *users;
-	struct xct *xcts;
+	struct user *last_user;	/* the end of users, the highest balance */
+	struct xct_log xcts;
 	struct group *next;
+	struct group *hnext;	/* next group in the same directory bucket */
+	unsigned long hash;
+	struct user **user_buckets;	/* name -> User index over users */
+	unsigned long user_nbuckets;
+	unsigned long user_count;
+	struct user *user_tree;	/* users ordered by (balance, order) */
+	long order_front;	/* order given to the last user added */
+	long order_back;	/* order given to the last user moved */
+	struct user **user_ids;	/* id -> User, NULL for ids not in use */
+	Money *balances;	/* id -> balance, 0 for ids not in use: the
+				 * balances as one column, for whole-group sums */
+	unsigned int id_capacity;
+	unsigned int id_count;	/* ids handed out so far */
+	unsigned int *free_ids;	/* ids of removed users, ready for reuse */
+	unsigned int free_id_count;
+	struct pool user_pool;	/* User nodes */
+	struct arena names;	/* the group's and its users' names */
+	Money balance_sum;	/* the users' balances, summed and */
+	unsigned __int128 balance_squares;	/* squared and summed; exact, and
+				 * modulo 2^128 so a removal always undoes an add */
+	Money xct_sum;	/* amounts of the transactions in the log */
+	unsigned long version;	/* bumped by every change to the users or balances */
+	struct transfer *transfers;	/* the last settlement, see settle.h */
+	unsigned long transfer_count;
+	unsigned long transfer_capacity;
+	unsigned long settled_version;	/* the version the transfers are for */
+	unsigned long seq;	/* odd while a writer is changing the group */
+	pthread_mutex_t write_lock;
+	int shared;	/* readers may run alongside writers, see group_read_begin */
+	struct retired *retired;
 };
 
 struct user {
+	unsigned long hash;	/* first: a freed User's first word is the pool's
+				 * free list, and a reader of a shared group may
+				 * still be looking at it */
 	char *name;
-	double balance;
+	Money balance;
 	struct user *next;
+	struct user *prev;
+	struct user *hnext;	/* next user in the same index bucket */
+	struct user *left;	/* balance tree links, see ostree.h */
+	struct user *right;
+	unsigned long size;
+	long order;	/* breaks ties between equal balances */
+	int height;	/* next to id, so neither is padded */
+	unsigned int id;	/* small per-group id, stored in transactions */
+	struct user_totals *totals;	/* the user's transactions, oldest first */
 };
 
-struct xct{
-	char *name;
-	double amount;
-	struct xct *next;
+/* A transaction: 16 bytes, with no pointers. Its user is named by id, and
+ * the user's own transactions are found through their totals. */
+struct xct {
+	unsigned int user_id;	/* see group->user_ids; XCT_REMOVED once removed */
+	uint32_t time;	/* seconds since the epoch; the log is in time order */
+	Money amount;
+};
+
+/* A 32-bit reference to a record of a group's transaction log, see xctlog.h */
+typedef uint32_t XctRef;
+
+/* A user's transactions, oldest first: for each, where it is in the log
+ * and the sum of the user's transactions up to and including it. They are
+ * in time order, so the amount spent in a time range is the difference of
+ * two totals found by binary search, and removing the user visits just
+ * their own records. The totals and the refs are two columns, capacity
+ * long each, so an entry takes 12 bytes with no padding. The array knows
+ * its own size, so a reader of a shared group that loads the user's
+ * totals pointer never reads past its end. When the log spills its oldest
+ * records to disk, their entries are dropped from the front and the user
+ * keeps only their count and the running total after them, base.
+ */
+struct user_totals {
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int first;	/* entries before first were spilled to disk */
+	unsigned int cold;	/* the user's transactions on disk */
+	Money base;	/* the user's total as of their last one on disk */
+	Money items[];	/* capacity totals, then capacity XctRefs */
+};
+
+#define USER_TOTALS_REFS(totals) ((XctRef *) ((totals)->items + (totals)->capacity))
+
+/* One transaction of an add_xct_batch */
+struct batch_xct {
+	const char *user_name;
+	Money amount;
+};
+
+/* One payment of a settlement, between users of a group by id */
+struct transfer {
+	unsigned int from;
+	unsigned int to;
+	Money amount;
 };
 
 typedef struct group Group;
 typedef struct user User;
 typedef struct xct Xct;
+typedef struct xct_log XctLog;
+
+#define XCT_REMOVED (~0U)
+
+/* Hash-indexed directory of groups. The groups are still chained through
+ * their next pointers in insertion order (starting at head), so head can be
+ * passed anywhere a plain group list is expected.
+ */
+struct group_dir {
+	Group *head;
+	Group *tail;
+	Group **buckets;
+	unsigned long nbuckets;
+	unsigned long count;
+	struct pool group_pool;	/* Group nodes */
+	unsigned long seq;	/* odd while a writer is changing the directory */
+	pthread_mutex_t write_lock;
+	int shared;
+	struct retired *retired;
+};
+
+typedef struct group_dir GroupDir;
 
 int add_group(Group **group_list, const char *group_name);
 void list_groups(Group *group_list);
 Group *find_group(Group *group_list, const char *group_name);
 
+void init_group_dir(GroupDir *dir);
+int dir_add_group(GroupDir *dir, const char *group_name);
+Group *dir_find_group(GroupDir *dir, const char *group_name);
+void free_group_dir(GroupDir *dir);
+void release_group(Group *group);
+void mem_stats(GroupDir *dir);
+unsigned long hash_name(const char *name);
+
+/* Shared groups.
+ *
+ * Once share_group_dir has been called, several threads may use the
+ * directory at once. Writers serialize on a per-group (or directory)
+ * mutex, and bump a sequence number to odd before they change anything
+ * and back to even after. Readers take no lock: they note the sequence
+ * number with group_read_begin, read, and start over if group_read_retry
+ * says a writer got in the way, so a slow reader never holds up a writer.
+ * What a reader can reach stays readable while it runs: users, chunks and
+ * names are recycled within their group's pools, and tables that grow are
+ * retired rather than freed. Only list_users, user_balance, under_paid,
+ * recent_xct, xct_range, user_spend, group_total, group_average and
+ * list_groups are written to cope with a torn read; every
+ * other operation needs group_lock or group_write_begin.
+ */
+void share_group_dir(GroupDir *dir);
+void group_lock(Group *group);
+void group_unlock(Group *group);
+void group_write_begin(Group *group);
+void group_write_end(Group *group);
+unsigned long group_read_begin(Group *group);
+int group_read_retry(Group *group, unsigned long seq);
+void dir_write_begin(GroupDir *dir);
+void dir_write_end(GroupDir *dir);
+unsigned long dir_read_begin(GroupDir *dir);
+int dir_read_retry(GroupDir *dir, unsigned long seq);
+
 int add_user(Group *group, const char *user_name);
 int remove_user(Group *group, const char *user_name);
+void drop_user(Group *group, User *user);
 void list_users(Group *group);
 int user_balance(Group *group, const char *user_name);
 int under_paid(Group *group);
 User *find_prev_user(Group *group, const char *user_name);
+User *find_user(Group *group, const char *user_name);
+int top_payers(Group *group, long k);
+int user_rank(Group *group, const char *user_name);
+int balance_percentile(Group *group, double percentile);
+Money group_total(Group *group);
+int group_average(Group *group);
+void group_summary(Group *group);
+
+User *restore_user(Group *group, User *prev, const char *user_name, Money balance, unsigned int id);
+void finish_restore(Group *group, unsigned int id_count);
+int restore_xct(Group *group, unsigned int user_id, Money amount, uint32_t time);
 
-int add_xct(Group *group, const char *user_name, double amount);
+int add_xct(Group *group, const char *user_name, Money amount, uint32_t time);
+int post_xct(Group *group, User *user, Money amount, uint32_t time);
+int add_xct_batch(Group *group, const struct batch_xct *items, unsigned long n, uint32_t time, unsigned long *missing,
+		Money *balances);
 void recent_xct(Group *group, long nu_xct);
+void xct_range(Group *group, uint32_t from, uint32_t to);
+int user_spend(Group *group, const char *user_name, uint32_t from, uint32_t to);
 void remove_xct(Group *group, const char *user_name);
 
 void error(const char *msg);
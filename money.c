@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include "money.h"
+
+/* The largest number of dollars parse_money accepts */
+#define MONEY_MAX_DOLLARS ((INT64_MAX - 100) / 100)
+
+/*
+ * Parse str, an optionally signed decimal number of dollars such as "12",
+ * "-3.5" or "110.95", into cents, rounding half away from zero past the
+ * second decimal. Returns 0, or -1 if str is not such a number (or is too
+ * large), in which case *amount is unchanged.
+ */
+int parse_money(const char *str, Money *amount) {
+    const char *p = str;
+    int negative = 0, digits = 0;
+    int64_t dollars = 0, cents = 0;
+
+    if ( *p == '-' || *p == '+' ) {
+        negative = *p++ == '-';
+    }
+    for ( ; *p >= '0' && *p <= '9'; p++, digits++ ) {
+        if ( dollars > (MONEY_MAX_DOLLARS - (*p - '0')) / 10 ) {
+            return -1;
+        }
+        dollars = dollars * 10 + (*p - '0');
+    }
+    if ( *p == '.' ) {
+        int place;
+        for ( p++, place = 0; *p >= '0' && *p <= '9'; p++, place++, digits++ ) {
+            if ( place < 2 ) {
+                cents = cents * 10 + (*p - '0');
+            } else if ( place == 2 && *p >= '5' ) {
+                cents++;    // round on the third decimal, ignore the rest
+            }
+        }
+        if ( place == 1 ) {
+            cents *= 10;
+        }
+    }
+    if ( digits == 0 || *p != '\0' ) {
+        return -1;
+    }
+    *amount = negative ? -(dollars * 100 + cents) : dollars * 100 + cents;
+    return 0;
+}
+
+/*
+ * Sum n amounts. Four independent running sums break the dependency chain
+ * and let the compiler add them two or four at a time with vector
+ * instructions.
+ */
+Money money_sum(const Money *values, unsigned long n) {
+    Money s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    unsigned long i = 0;
+
+    for ( ; i + 4 <= n; i += 4 ) {
+        s0 += values[i];
+        s1 += values[i + 1];
+        s2 += values[i + 2];
+        s3 += values[i + 3];
+    }
+    for ( ; i < n; i++ ) {
+        s0 += values[i];
+    }
+    return s0 + s1 + s2 + s3;
+}
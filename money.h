@@ -0,0 +1,25 @@
+#ifndef MONEY_H
+#define MONEY_H
+
+#include <stdint.h>
+
+/* Amounts of money are whole cents in a 64-bit integer, so balances add up
+ * exactly and users with the same balance really are tied.
+ *
+ * Print one with
+ *
+ *   out_printf("$" MONEY_FMT "\n", MONEY_ARGS(balance));
+ *
+ * which gives the same text as "%.2f" of the amount in dollars.
+ */
+
+typedef int64_t Money;
+
+#define MONEY_FMT "%s%lld.%02lld"
+#define MONEY_ARGS(m) ((m) < 0 ? "-" : ""), \
+	(long long) ((m) < 0 ? -(m) : (m)) / 100, (long long) ((m) < 0 ? -(m) : (m)) % 100
+
+int parse_money(const char *str, Money *amount);
+Money money_sum(const Money *values, unsigned long n);
+
+#endif
@@ -0,0 +1,247 @@
+#include <stddef.h>
+#include "ostree.h"
+#include "stats.h"
+
+/*
+ * Compare two users by (balance, order).
+ */
+static int _compare(const User *a, const User *b) {
+    if ( a->balance < b->balance ) return -1;
+    if ( a->balance > b->balance ) return 1;
+    return (a->order > b->order) - (a->order < b->order);
+}
+
+static int _height(const User *node) {
+    return node ? node->height : 0;
+}
+
+static unsigned long _size(const User *node) {
+    return node ? node->size : 0;
+}
+
+/*
+ * Recompute the height and subtree size of node from its children.
+ */
+static void _update(User *node) {
+    int lh = _height(node->left), rh = _height(node->right);
+    node->height = (lh > rh ? lh : rh) + 1;
+    node->size = _size(node->left) + _size(node->right) + 1;
+}
+
+static User *_rotate_right(User *node) {
+    User *pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    _update(node);
+    _update(pivot);
+    return pivot;
+}
+
+static User *_rotate_left(User *node) {
+    User *pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    _update(node);
+    _update(pivot);
+    return pivot;
+}
+
+/*
+ * Restore the AVL invariant at node after one of its subtrees changed
+ * height by at most one. Returns the new root of the subtree.
+ */
+static User *_rebalance(User *node) {
+    int balance;
+
+    _update(node);
+    balance = _height(node->left) - _height(node->right);
+    if ( balance > 1 ) {
+        if ( _height(node->left->left) < _height(node->left->right) ) {
+            node->left = _rotate_left(node->left);
+        }
+        return _rotate_right(node);
+    }
+    if ( balance < -1 ) {
+        if ( _height(node->right->right) < _height(node->right->left) ) {
+            node->right = _rotate_right(node->right);
+        }
+        return _rotate_left(node);
+    }
+    return node;
+}
+
+static User *_insert_node(User *node, User *user) {
+    if ( node == NULL ) {
+        user->left = NULL;
+        user->right = NULL;
+        user->height = 1;
+        user->size = 1;
+        return user;
+    }
+    STAT_COUNT(COUNT_TREE_NODES, 1);
+    if ( _compare(user, node) < 0 ) {
+        node->left = _insert_node(node->left, user);
+    } else {
+        node->right = _insert_node(node->right, user);
+    }
+    return _rebalance(node);
+}
+
+/*
+ * Detach the minimum node of the subtree at node, storing it in *min.
+ * Returns the new root of the subtree.
+ */
+static User *_remove_min(User *node, User **min) {
+    STAT_COUNT(COUNT_TREE_NODES, 1);
+    if ( node->left == NULL ) {
+        *min = node;
+        return node->right;
+    }
+    node->left = _remove_min(node->left, min);
+    return _rebalance(node);
+}
+
+static User *_remove_node(User *node, User *user) {
+    int c;
+
+    if ( node == NULL ) {
+        return NULL;    // not in the tree
+    }
+    STAT_COUNT(COUNT_TREE_NODES, 1);
+    c = _compare(user, node);
+    if ( c < 0 ) {
+        node->left = _remove_node(node->left, user);
+    } else if ( c > 0 ) {
+        node->right = _remove_node(node->right, user);
+    } else {
+        User *left = node->left, *right = node->right, *min;
+
+        node->left = NULL;
+        node->right = NULL;
+        if ( right == NULL ) {
+            return left;
+        }
+        right = _remove_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return _rebalance(min);
+    }
+    return _rebalance(node);
+}
+
+/* Insert user into the tree rooted at *root, keyed on its current balance
+ * and order.
+ */
+void ost_insert(User **root, User *user) {
+    *root = _insert_node(*root, user);
+}
+
+/* Remove user from the tree rooted at *root. The user's key must be the
+ * same as when it was inserted.
+ */
+void ost_remove(User **root, User *user) {
+    *root = _remove_node(*root, user);
+}
+
+/* Return the user with k users before it in balance order (k counts from
+ * 0), or NULL if the tree has k or fewer users.
+ */
+User *ost_select(User *root, unsigned long k) {
+    User *node = root;
+
+    while ( node ) {
+        unsigned long leftSize = _size(node->left);
+        STAT_COUNT(COUNT_TREE_NODES, 1);
+        if ( k < leftSize ) {
+            node = node->left;
+        } else if ( k == leftSize ) {
+            return node;
+        } else {
+            k -= leftSize + 1;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+/* Return the number of users before user in balance order. user must be
+ * in the tree.
+ */
+unsigned long ost_rank(User *root, const User *user) {
+    User *node = root;
+    unsigned long rank = 0;
+
+    while ( node ) {
+        int c = _compare(user, node);
+        if ( c < 0 ) {
+            node = node->left;
+        } else if ( c > 0 ) {
+            rank += _size(node->left) + 1;
+            node = node->right;
+        } else {
+            return rank + _size(node->left);
+        }
+    }
+    return rank;
+}
+
+/* Return the first user after user in balance order, or NULL if there is
+ * none. user itself need not be in the tree.
+ */
+User *ost_next(User *root, const User *user) {
+    User *node = root, *next = NULL;
+    unsigned long visited = 0;
+
+    while ( node ) {
+        visited++;
+        if ( _compare(user, node) < 0 ) {
+            next = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    STAT_COUNT(COUNT_TREE_NODES, visited);
+    return next;
+}
+
+/* Return the user with the highest balance, or NULL if the tree is empty.
+ */
+User *ost_last(User *root) {
+    User *node = root;
+
+    if ( node == NULL ) {
+        return NULL;
+    }
+    while ( node->right ) {
+        node = node->right;
+    }
+    return node;
+}
+
+/*
+ * Build a perfectly balanced tree out of the next n users of the list at
+ * *cursor, advancing *cursor past them.
+ */
+static User *_build(User **cursor, unsigned long n) {
+    User *left, *node;
+
+    if ( n == 0 ) {
+        return NULL;
+    }
+    left = _build(cursor, n / 2);
+    node = *cursor;
+    *cursor = node->next;
+    node->left = left;
+    node->right = _build(cursor, n - n / 2 - 1);
+    _update(node);
+    return node;
+}
+
+/* Return the root of a tree holding the first n users of list, which must
+ * already be in balance order. Takes O(n), against O(n log n) for n
+ * inserts.
+ */
+User *ost_build(User *list, unsigned long n) {
+    return _build(&list, n);
+}
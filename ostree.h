@@ -0,0 +1,27 @@
+#ifndef OSTREE_H
+#define OSTREE_H
+
+#include "lists.h"
+
+/* Order-statistics AVL tree over the users of a group.
+ *
+ * Users are ordered by (balance, order): order breaks ties between equal
+ * balances the same way the user list always has, so an in-order walk of
+ * the tree visits users in exactly the order of group->users. Every node
+ * also records the size of its subtree, which gives O(log n) rank and
+ * select.
+ *
+ * A user's balance and order must not change while it is in a tree;
+ * remove it, update the key, then insert it again.
+ */
+
+void ost_insert(User **root, User *user);
+void ost_remove(User **root, User *user);
+
+User *ost_select(User *root, unsigned long k);
+unsigned long ost_rank(User *root, const User *user);
+User *ost_next(User *root, const User *user);
+User *ost_last(User *root);
+User *ost_build(User *list, unsigned long n);
+
+#endif
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "output.h"
+
+#define CAPTURE_MIN_BYTES 4096
+
+#define OUTPUT_QUEUE_SLOTS 256
+#define OUTPUT_SLOT_BYTES 16384    // a slot is handed over once it holds this much
+#define OUTPUT_SLOT_KEEP_BYTES (1 << 20)   // bigger slot buffers are freed once written
+#define OUTPUT_WRITEV_MAX 64
+
+/* Output and error captures of this thread, or NULL for stdout/stderr */
+static __thread struct capture *capture_out = NULL;
+static __thread struct capture *capture_err = NULL;
+
+/* Set in the thread whose output goes through the writer thread */
+static __thread int async_producer = 0;
+
+/* What the producer hands the writer at once: the output and errors of
+ * one or more commands */
+struct out_slot {
+    struct capture out;
+    struct capture err;
+    size_t err_at;  // output bytes written before the first error
+};
+
+/* The writer thread and its queue. The producer fills the slot at tail
+ * and hands it over by bumping tail; the writer writes the slots from head
+ * on and bumps head past them. Each index is written by one side only, so
+ * neither takes the lock except to sleep and to wake the other. */
+struct async_output {
+    struct out_slot slots[OUTPUT_QUEUE_SLOTS];
+    unsigned long head;
+    unsigned long tail;
+    int writer_idle;    // the writer is waiting for a slot
+    int producer_waiting;   // the producer is waiting for a free slot
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // the writer waits on it
+    pthread_cond_t space;   // the producer waits on it
+    pthread_t thread;
+};
+
+static struct async_output async;
+
+/*
+ * Make room for at least need more bytes in capture.
+ */
+static void _reserve(struct capture *capture, size_t need) {
+    size_t cap = capture->cap ? capture->cap : CAPTURE_MIN_BYTES;
+
+    while ( cap - capture->len < need ) {
+        cap *= 2;
+    }
+    if ( cap != capture->cap ) {
+        capture->buf = realloc(capture->buf, cap);
+        if ( capture->buf == NULL ) {
+            printf("Error while allocating output buffer. Program will now exit. \n");
+            exit(0);
+        }
+        capture->cap = cap;
+    }
+}
+
+/* Send the output of the calling thread to out and its errors to err, or
+ * back to stdout and stderr if both are NULL.
+ */
+void capture_output(struct capture *out, struct capture *err) {
+    capture_out = out;
+    capture_err = err;
+}
+
+/* Append len bytes of buf to capture.
+ */
+void capture_append(struct capture *capture, const char *buf, size_t len) {
+    if ( len == 0 ) {
+        return;
+    }
+    if ( capture->cap - capture->len < len ) {
+        _reserve(capture, len);
+    }
+    memcpy(capture->buf + capture->len, buf, len);
+    capture->len += len;
+}
+
+/* Free the buffer of capture.
+ */
+void capture_release(struct capture *capture) {
+    free(capture->buf);
+    capture->buf = NULL;
+    capture->len = capture->cap = 0;
+}
+
+/*
+ * vprintf into capture.
+ */
+static void _capture_vprintf(struct capture *capture, const char *fmt, va_list args) {
+    va_list retry;
+    int n;
+
+    va_copy(retry, args);
+    n = vsnprintf(capture->buf + capture->len, capture->cap - capture->len, fmt, args);
+    if ( n >= 0 && (size_t) n >= capture->cap - capture->len ) {
+        _reserve(capture, n + 1);
+        n = vsnprintf(capture->buf + capture->len, capture->cap - capture->len, fmt, retry);
+    }
+    if ( n > 0 ) {
+        capture->len += n;
+    }
+    va_end(retry);
+}
+
+/* printf to the command output.
+ */
+void out_printf(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    if ( capture_out ) {
+        _capture_vprintf(capture_out, fmt, args);
+    } else {
+        vprintf(fmt, args);
+    }
+    va_end(args);
+}
+
+/*
+ * Note where in the output of the slot being filled its errors go, once
+ * the first one is written.
+ */
+static void _mark_errors(void) {
+    struct out_slot *slot = &async.slots[async.tail % OUTPUT_QUEUE_SLOTS];
+
+    if ( slot->err.len == 0 ) {
+        slot->err_at = slot->out.len;
+    }
+}
+
+/* printf to the command errors.
+ */
+void err_printf(const char *fmt, ...) {
+    va_list args;
+
+    if ( async_producer ) {
+        _mark_errors();
+    }
+    va_start(args, fmt);
+    if ( capture_err ) {
+        _capture_vprintf(capture_err, fmt, args);
+    } else {
+        vfprintf(stderr, fmt, args);
+    }
+    va_end(args);
+}
+
+/* Return a mark to rewind the command output to. Only captured output can
+ * be rewound.
+ */
+size_t out_mark(void) {
+    return capture_out ? capture_out->len : 0;
+}
+
+/* Throw away the command output written since out_mark returned mark.
+ */
+void out_rewind(size_t mark) {
+    if ( capture_out ) {
+        capture_out->len = mark;
+    }
+}
+
+/* Write len bytes of buf to the command output.
+ */
+void out_write(const char *buf, size_t len) {
+    if ( len == 0 ) {
+        return;
+    }
+    if ( capture_out ) {
+        capture_append(capture_out, buf, len);
+    } else {
+        fwrite(buf, 1, len, stdout);
+    }
+}
+
+/* Write len bytes of buf to the command errors.
+ */
+void err_write(const char *buf, size_t len) {
+    if ( len == 0 ) {
+        return;
+    }
+    if ( async_producer ) {
+        _mark_errors();
+    }
+    if ( capture_err ) {
+        capture_append(capture_err, buf, len);
+    } else {
+        fwrite(buf, 1, len, stderr);
+    }
+}
+
+/*
+ * Write the iovcnt buffers of iov to fd, all of them, going on after
+ * short writes. Output that can't be written is dropped, as stdio would.
+ */
+static void _write_all(int fd, struct iovec *iov, int iovcnt) {
+    while ( iovcnt > 0 ) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if ( n < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return;
+        }
+        while ( iovcnt > 0 && (size_t) n >= iov->iov_len ) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if ( iovcnt > 0 ) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/*
+ * The writer thread: write the slots handed over, the output of up to
+ * OUTPUT_WRITEV_MAX of them with one writev, until async_output_stop.
+ * A slot with errors ends a write at the point its first error was
+ * written, and the errors and then the rest of its output follow, so they
+ * come out where they would have without the writer.
+ */
+static void *_writer_main(void *arg) {
+    struct iovec iov[OUTPUT_WRITEV_MAX];
+
+    for ( ;; ) {
+        unsigned long head = async.head, end;
+        unsigned long tail = __atomic_load_n(&async.tail, __ATOMIC_SEQ_CST);
+        int n = 0;
+
+        if ( head == tail ) {
+            pthread_mutex_lock(&async.lock);
+            __atomic_store_n(&async.writer_idle, 1, __ATOMIC_SEQ_CST);
+            while ( (tail = __atomic_load_n(&async.tail, __ATOMIC_SEQ_CST)) == head && !async.stopping ) {
+                pthread_cond_wait(&async.wake, &async.lock);
+            }
+            __atomic_store_n(&async.writer_idle, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&async.lock);
+            if ( tail == head ) {
+                break;  // stopping, and everything is written
+            }
+        }
+
+        struct out_slot *slot = NULL;
+        for ( end = head; end != tail && n < OUTPUT_WRITEV_MAX; ) {
+            slot = &async.slots[end++ % OUTPUT_QUEUE_SLOTS];
+            size_t len = slot->err.len && slot->err_at < slot->out.len ? slot->err_at : slot->out.len;
+            if ( len ) {
+                iov[n].iov_base = slot->out.buf;
+                iov[n].iov_len = len;
+                n++;
+            }
+            if ( slot->err.len ) {
+                break;
+            }
+        }
+        _write_all(STDOUT_FILENO, iov, n);
+        if ( slot->err.len ) {
+            iov[0].iov_base = slot->err.buf;
+            iov[0].iov_len = slot->err.len;
+            _write_all(STDERR_FILENO, iov, 1);
+            if ( slot->err_at < slot->out.len ) {
+                iov[0].iov_base = slot->out.buf + slot->err_at;
+                iov[0].iov_len = slot->out.len - slot->err_at;
+                _write_all(STDOUT_FILENO, iov, 1);
+            }
+        }
+
+        for ( ; head != end; head++ ) {
+            slot = &async.slots[head % OUTPUT_QUEUE_SLOTS];
+            slot->out.len = slot->err.len = 0;
+            if ( slot->out.cap > OUTPUT_SLOT_KEEP_BYTES ) {
+                capture_release(&slot->out);
+            }
+            if ( slot->err.cap > OUTPUT_SLOT_KEEP_BYTES ) {
+                capture_release(&slot->err);
+            }
+        }
+        __atomic_store_n(&async.head, end, __ATOMIC_SEQ_CST);
+        if ( __atomic_load_n(&async.producer_waiting, __ATOMIC_SEQ_CST) ) {
+            pthread_mutex_lock(&async.lock);
+            pthread_cond_signal(&async.space);
+            pthread_mutex_unlock(&async.lock);
+        }
+    }
+    return arg;
+}
+
+/*
+ * Hand the slot being filled to the writer, and go on to the next one
+ * once it is free: when all the slots are queued, the producer waits.
+ */
+static void _async_push(void) {
+    unsigned long tail = async.tail + 1;
+
+    __atomic_store_n(&async.tail, tail, __ATOMIC_SEQ_CST);
+    if ( __atomic_load_n(&async.writer_idle, __ATOMIC_SEQ_CST) ) {
+        pthread_mutex_lock(&async.lock);
+        pthread_cond_signal(&async.wake);
+        pthread_mutex_unlock(&async.lock);
+    }
+    if ( tail - __atomic_load_n(&async.head, __ATOMIC_SEQ_CST) >= OUTPUT_QUEUE_SLOTS ) {
+        pthread_mutex_lock(&async.lock);
+        __atomic_store_n(&async.producer_waiting, 1, __ATOMIC_SEQ_CST);
+        while ( tail - __atomic_load_n(&async.head, __ATOMIC_SEQ_CST) >= OUTPUT_QUEUE_SLOTS ) {
+            pthread_cond_wait(&async.space, &async.lock);
+        }
+        __atomic_store_n(&async.producer_waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&async.lock);
+    }
+    capture_out = &async.slots[tail % OUTPUT_QUEUE_SLOTS].out;
+    capture_err = &async.slots[tail % OUTPUT_QUEUE_SLOTS].err;
+}
+
+/* Start a writer thread for the output and errors of the calling thread,
+ * which from now on are collected in memory and handed to the writer by
+ * out_end_command and out_flush. Returns 0 on success, and -1 if the thread can't be started.
+ */
+int async_output_start(void) {
+    fflush(stdout);
+    fflush(stderr);
+    memset(&async.slots, 0, sizeof(async.slots));
+    async.head = 0;
+    async.tail = 0;
+    async.writer_idle = 0;
+    async.producer_waiting = 0;
+    async.stopping = 0;
+    pthread_mutex_init(&async.lock, NULL);
+    pthread_cond_init(&async.wake, NULL);
+    pthread_cond_init(&async.space, NULL);
+    if ( pthread_create(&async.thread, NULL, _writer_main, NULL) != 0 ) {
+        return -1;
+    }
+    async_producer = 1;
+    capture_out = &async.slots[0].out;
+    capture_err = &async.slots[0].err;
+    return 0;
+}
+
+/* Hand what the calling thread has written so far to its writer thread,
+ * if it has one, to be written out at once; otherwise it is left to stdio.
+ */
+void out_flush(void) {
+    struct out_slot *slot = &async.slots[async.tail % OUTPUT_QUEUE_SLOTS];
+
+    if ( async_producer && (slot->out.len || slot->err.len) ) {
+        _async_push();
+    }
+}
+
+/* Mark the end of a command. With a writer thread, the output collected
+ * so far is handed over once it has grown past OUTPUT_SLOT_BYTES, so it
+ * goes out in large writes without a wakeup per command, or if it has
+ * errors, which must be placed among the output of one command only.
+ */
+void out_end_command(void) {
+    struct out_slot *slot = &async.slots[async.tail % OUTPUT_QUEUE_SLOTS];
+
+    if ( async_producer && (slot->err.len || slot->out.len >= OUTPUT_SLOT_BYTES) ) {
+        _async_push();
+    }
+}
+
+/* Hand over what is left, wait for the writer thread to write everything,
+ * and stop it. Output goes back to stdout and stderr.
+ */
+void async_output_stop(void) {
+    int i;
+
+    if ( !async_producer ) {
+        return;
+    }
+    out_flush();
+    pthread_mutex_lock(&async.lock);
+    async.stopping = 1;
+    pthread_cond_signal(&async.wake);
+    pthread_mutex_unlock(&async.lock);
+    pthread_join(async.thread, NULL);
+
+    for ( i = 0; i < OUTPUT_QUEUE_SLOTS; i++ ) {
+        capture_release(&async.slots[i].out);
+        capture_release(&async.slots[i].err);
+    }
+    pthread_mutex_destroy(&async.lock);
+    pthread_cond_destroy(&async.wake);
+    pthread_cond_destroy(&async.space);
+    async_producer = 0;
+    capture_out = NULL;
+    capture_err = NULL;
+}
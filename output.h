@@ -0,0 +1,47 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+/* Where command output goes.
+ *
+ * Everything the commands print goes through out_printf and out_write,
+ * and every error through err_printf and err_write. Normally that is stdout and stderr; a thread that runs
+ * commands on behalf of another (see parallel.h) captures its output in
+ * memory instead, so that it can be written out in input order later.
+ *
+ * With async_output_start, the calling thread's output and errors are
+ * collected in memory too and written by a writer thread, so a slow
+ * reader of stdout no longer holds up the commands. The thread calls
+ * out_end_command after each command, which hands what it wrote over in
+ * slots of about OUTPUT_SLOT_BYTES, and out_flush when the output must go
+ * out now, such as before waiting for input. The writer takes the slots
+ * through a single-producer, single-consumer queue of OUTPUT_QUEUE_SLOTS
+ * and writes many at a time with writev. Once every slot is queued the
+ * producer waits for the writer, so memory use is bounded.
+ * async_output_stop writes the rest and stops the writer.
+ */
+
+struct capture {
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+void out_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void out_write(const char *buf, size_t len);
+size_t out_mark(void);
+void out_rewind(size_t mark);
+void err_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void err_write(const char *buf, size_t len);
+
+void out_end_command(void);
+void out_flush(void);
+int async_output_start(void);
+void async_output_stop(void);
+
+void capture_output(struct capture *out, struct capture *err);
+void capture_append(struct capture *capture, const char *buf, size_t len);
+void capture_release(struct capture *capture);
+
+#endif
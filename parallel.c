@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "parallel.h"
+#include "commands.h"
+#include "output.h"
+
+/* A line of the batch file. line..eol is tokenized in place, so eol must
+ * be writable: it is the '\n' ending the line, or the end of a copy.
+ */
+struct job {
+    char *line;
+    char *eol;
+    size_t echo_len;    // bytes to echo, including the '\n'
+};
+
+/* The lines of an epoch routed to one worker, and their output.
+ */
+struct shard {
+    struct job *jobs;
+    size_t *lens;       // output and error bytes of each job
+    size_t count;
+    size_t cap;
+    struct capture out;
+    struct capture err;
+};
+
+struct epoch {
+    char *start;        // first input byte of the epoch
+    unsigned short *route;      // worker of each line, in input order
+    size_t count;
+    struct shard *shards;
+    struct job barrier; // line to run alone after the epoch, if line != NULL
+};
+
+struct parallel {
+    GroupDir *groups;
+    int echo;
+    int prompt;
+    int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long generation;   // bumped to hand workers a new epoch
+    struct epoch *current;
+    int busy;           // workers still running current
+    int stop;
+};
+
+struct worker {
+    struct parallel *par;
+    int id;
+    pthread_t thread;
+};
+
+/* Commands that run alone, because they use the group directory itself */
+static const char *const barrier_commands[] = {
+    "add_group", "list_groups", "save", "load", "mem_stats", "stats", "quit", NULL
+};
+
+/*
+ * Echo, tokenize and run one line, as run_mapped_batch does. Returns -1
+ * if it was the quit command, or if the commands have stopped, in which
+ * case the line is skipped.
+ */
+static int run_job(struct job *job, GroupDir *groups, int echo, int prompt) {
+    char *cmd_argv[INPUT_ARG_MAX_NUM];
+    int cmd_argc;
+
+    if ( command_failure() ) {
+        return -1;
+    }
+    if ( echo ) {
+        out_write(job->line, job->echo_len);
+    }
+    cmd_argc = tokenize_in_place(job->line, job->eol, cmd_argv);
+    if ( cmd_argc > 0 && process_args(cmd_argc, cmd_argv, groups) == -1 ) {
+        return -1;
+    }
+    if ( prompt ) {
+        out_write(">", 1);
+    }
+    return 0;
+}
+
+/*
+ * Pick the worker for the line [line, eol): the one that owns its group
+ * (the second word), worker 0 if it has none, or -1 if it must run alone.
+ */
+static int route_line(const char *line, const char *eol, int threads) {
+    const char *cmd;
+    size_t cmdLen;
+    int i;
+
+    while ( line < eol && *line == ' ' ) {
+        line++;
+    }
+    cmd = line;
+    while ( line < eol && *line != ' ' ) {
+        line++;
+    }
+    cmdLen = line - cmd;
+    for ( i = 0; barrier_commands[i]; i++ ) {
+        if ( strlen(barrier_commands[i]) == cmdLen && memcmp(barrier_commands[i], cmd, cmdLen) == 0 ) {
+            return -1;
+        }
+    }
+
+    while ( line < eol && *line == ' ' ) {
+        line++;
+    }
+    if ( line == eol ) {
+        return 0;
+    }
+    unsigned long hash = 2166136261UL;
+    while ( line < eol && *line != ' ' ) {
+        hash ^= (unsigned char) *line++;
+        hash *= 16777619UL;
+    }
+    return hash % threads;
+}
+
+/*
+ * Add job to shard.
+ */
+static void shard_push(struct shard *shard, struct job *job) {
+    if ( shard->count == shard->cap ) {
+        shard->cap = shard->cap ? shard->cap * 2 : 256;
+        shard->jobs = realloc(shard->jobs, shard->cap * sizeof(struct job));
+        shard->lens = realloc(shard->lens, 2 * shard->cap * sizeof(size_t));
+        if ( shard->jobs == NULL || shard->lens == NULL ) {
+            printf("Error while allocating parallel jobs. Program will now exit. \n");
+            exit(0);
+        }
+    }
+    shard->jobs[shard->count++] = *job;
+}
+
+/*
+ * Route the lines from line on into ep, until it holds PARALLEL_EPOCH_LINES
+ * lines, a line that must run alone ends it, or the input [line, end) runs
+ * out. An unterminated last line is copied to *last_line. Returns where the
+ * next epoch starts.
+ */
+static char *fill_epoch(struct epoch *ep, char *line, char *end, int threads, char **last_line) {
+    int w;
+
+    ep->start = line;
+    ep->count = 0;
+    ep->barrier.line = NULL;
+    for ( w = 0; w < threads; w++ ) {
+        ep->shards[w].count = 0;
+    }
+
+    while ( line < end && ep->count < PARALLEL_EPOCH_LINES ) {
+        char *eol = memchr(line, '\n', end - line);
+        struct job job;
+        char *next;
+        int route;
+
+        if ( eol ) {
+            job.line = line;
+            job.eol = eol;
+            job.echo_len = eol + 1 - line;
+            next = eol + 1;
+        } else {
+            /* the byte after the mapping may not exist, see run_mapped_batch */
+            *last_line = malloc(end - line + 1);
+            if ( *last_line == NULL ) {
+                printf("Error while copying the last line. Program will now exit. \n");
+                exit(0);
+            }
+            memcpy(*last_line, line, end - line);
+            job.line = *last_line;
+            job.eol = *last_line + (end - line);
+            job.echo_len = end - line;
+            next = end;
+        }
+
+        route = route_line(job.line, job.eol, threads);
+        if ( route == -1 ) {
+            ep->barrier = job;
+            return next;
+        }
+        shard_push(&ep->shards[route], &job);
+        ep->route[ep->count++] = route;
+        line = next;
+    }
+    return line;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *worker = arg;
+    struct parallel *par = worker->par;
+    unsigned long seen = 0;
+
+    for ( ;; ) {
+        pthread_mutex_lock(&par->lock);
+        while ( par->generation == seen && !par->stop ) {
+            pthread_cond_wait(&par->start, &par->lock);
+        }
+        if ( par->stop ) {
+            pthread_mutex_unlock(&par->lock);
+            return NULL;
+        }
+        seen = par->generation;
+        struct shard *shard = &par->current->shards[worker->id];
+        pthread_mutex_unlock(&par->lock);
+
+        size_t i;
+        capture_output(&shard->out, &shard->err);
+        for ( i = 0; i < shard->count; i++ ) {
+            size_t outLen = shard->out.len, errLen = shard->err.len;
+            run_job(&shard->jobs[i], par->groups, par->echo, par->prompt);
+            shard->lens[2 * i] = shard->out.len - outLen;
+            shard->lens[2 * i + 1] = shard->err.len - errLen;
+        }
+        capture_output(NULL, NULL);
+
+        pthread_mutex_lock(&par->lock);
+        if ( --par->busy == 0 ) {
+            pthread_cond_signal(&par->done);
+        }
+        pthread_mutex_unlock(&par->lock);
+    }
+}
+
+/*
+ * Hand ep to the workers.
+ */
+static void start_epoch(struct parallel *par, struct epoch *ep) {
+    if ( ep->count == 0 ) {
+        return;
+    }
+    pthread_mutex_lock(&par->lock);
+    par->current = ep;
+    par->busy = par->threads;
+    par->generation++;
+    pthread_cond_broadcast(&par->start);
+    pthread_mutex_unlock(&par->lock);
+}
+
+/*
+ * Wait for the workers to finish ep, then write its output in input order.
+ * Runs of lines from the same worker are written together, and each line's
+ * errors go out right after its output, as they would serially.
+ */
+static void finish_epoch(struct parallel *par, struct epoch *ep) {
+    size_t next[PARALLEL_MAX_THREADS], outAt[PARALLEL_MAX_THREADS], errAt[PARALLEL_MAX_THREADS];
+    struct shard *run = NULL;
+    size_t runStart = 0, runLen = 0, i;
+    int w;
+
+    if ( ep->count == 0 ) {
+        return;
+    }
+    pthread_mutex_lock(&par->lock);
+    while ( par->busy > 0 ) {
+        pthread_cond_wait(&par->done, &par->lock);
+    }
+    pthread_mutex_unlock(&par->lock);
+
+    for ( w = 0; w < par->threads; w++ ) {
+        next[w] = outAt[w] = errAt[w] = 0;
+    }
+    for ( i = 0; i < ep->count; i++ ) {
+        w = ep->route[i];
+        struct shard *shard = &ep->shards[w];
+        size_t outLen = shard->lens[2 * next[w]];
+        size_t errLen = shard->lens[2 * next[w] + 1];
+        next[w]++;
+
+        if ( run != shard ) {
+            if ( runLen ) {
+                out_write(run->out.buf + runStart, runLen);
+            }
+            run = shard;
+            runStart = outAt[w];
+            runLen = 0;
+        }
+        runLen += outLen;
+        outAt[w] += outLen;
+        if ( errLen ) {
+            if ( runLen ) {
+                out_write(run->out.buf + runStart, runLen);
+            }
+            runStart = outAt[w];
+            runLen = 0;
+            err_write(shard->err.buf + errAt[w], errLen);
+            errAt[w] += errLen;
+            out_end_command();
+        }
+    }
+    if ( runLen ) {
+        out_write(run->out.buf + runStart, runLen);
+    }
+    out_end_command();
+
+    for ( w = 0; w < par->threads; w++ ) {
+        ep->shards[w].out.len = 0;
+        ep->shards[w].err.len = 0;
+    }
+}
+
+/*
+ * Allocate the buffers of ep.
+ */
+static void init_epoch(struct epoch *ep, int threads) {
+    ep->route = malloc(PARALLEL_EPOCH_LINES * sizeof(unsigned short));
+    ep->shards = calloc(threads, sizeof(struct shard));
+    if ( ep->route == NULL || ep->shards == NULL ) {
+        printf("Error while allocating parallel epoch. Program will now exit. \n");
+        exit(0);
+    }
+    ep->count = 0;
+    ep->barrier.line = NULL;
+}
+
+/*
+ * Free the buffers of ep.
+ */
+static void release_epoch(struct epoch *ep, int threads) {
+    int w;
+
+    for ( w = 0; w < threads; w++ ) {
+        free(ep->shards[w].jobs);
+        free(ep->shards[w].lens);
+        capture_release(&ep->shards[w].out);
+        capture_release(&ep->shards[w].err);
+    }
+    free(ep->shards);
+    free(ep->route);
+}
+
+/* Run the batch file at path with threads workers, see parallel.h. Returns
+ * 0 when the file has been processed, or -1 if it can't be read.
+ */
+int run_parallel_batch(const char *path, GroupDir *groups, int echo, int prompt, int threads) {
+    struct worker workers[PARALLEL_MAX_THREADS];
+    struct parallel par;
+    struct epoch epochs[2];
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    int cur = 0, w;
+
+    if ( fd == -1 || fstat(fd, &st) == -1 ) {
+        return -1;
+    }
+    if ( st.st_size == 0 ) {
+        close(fd);
+        return 0;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    par.groups = groups;
+    par.echo = echo;
+    par.prompt = prompt;
+    par.threads = threads;
+    par.generation = 0;
+    par.current = NULL;
+    par.busy = 0;
+    par.stop = 0;
+    pthread_mutex_init(&par.lock, NULL);
+    pthread_cond_init(&par.start, NULL);
+    pthread_cond_init(&par.done, NULL);
+    init_epoch(&epochs[0], threads);
+    init_epoch(&epochs[1], threads);
+    for ( w = 0; w < threads; w++ ) {
+        workers[w].par = &par;
+        workers[w].id = w;
+        if ( pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]) != 0 ) {
+            printf("Error while starting worker threads. Program will now exit. \n");
+            exit(0);
+        }
+    }
+
+    char *end = map + st.st_size;
+    char *released = map;
+    char *last_line = NULL;
+    char *line = fill_epoch(&epochs[0], map, end, threads, &last_line);
+    start_epoch(&par, &epochs[0]);
+
+    for ( ;; ) {
+        struct epoch *ep = &epochs[cur], *next = &epochs[1 - cur];
+
+        /* route the next epoch while the workers run this one */
+        line = fill_epoch(next, line, end, threads, &last_line);
+        finish_epoch(&par, ep);
+        if ( command_failure() ) {
+            break;  /* a change could not be journaled or fed */
+        }
+        if ( ep->barrier.line && run_job(&ep->barrier, groups, echo, prompt) == -1 ) {
+            break;  /* quit command was entered */
+        }
+        out_end_command();
+        if ( next->count == 0 && next->barrier.line == NULL ) {
+            break;
+        }
+
+        if ( next->start - released >= MAPPED_RELEASE_BYTES ) {
+            size_t len = (next->start - released) & ~(size_t) (sysconf(_SC_PAGESIZE) - 1);
+            madvise(released, len, MADV_DONTNEED);
+            released += len;
+        }
+        start_epoch(&par, next);
+        cur = 1 - cur;
+    }
+
+    pthread_mutex_lock(&par.lock);
+    par.stop = 1;
+    pthread_cond_broadcast(&par.start);
+    pthread_mutex_unlock(&par.lock);
+    for ( w = 0; w < threads; w++ ) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    release_epoch(&epochs[0], threads);
+    release_epoch(&epochs[1], threads);
+    pthread_mutex_destroy(&par.lock);
+    pthread_cond_destroy(&par.start);
+    pthread_cond_destroy(&par.done);
+    free(last_line);
+    munmap(map, st.st_size);
+    return 0;
+}
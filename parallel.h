@@ -0,0 +1,26 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "lists.h"
+
+/* Parallel batch mode.
+ *
+ * Groups share no state, so commands for different groups can run at the
+ * same time. One reader thread routes each line of the batch file to a
+ * worker chosen by hashing its group name; a worker runs its lines in
+ * input order, so every group sees its commands in order. Commands that
+ * touch the group directory itself (add_group, list_groups, save, load,
+ * mem_stats, quit) wait for the workers to drain and run alone.
+ *
+ * The input is handled in epochs of up to PARALLEL_EPOCH_LINES lines.
+ * Workers capture the output of each line, and when an epoch is done the
+ * reader writes it out in input order, so the output is exactly that of
+ * the serial modes; meanwhile the reader routes the next epoch.
+ */
+
+#define PARALLEL_MAX_THREADS 256
+#define PARALLEL_EPOCH_LINES (1 << 16)
+
+int run_parallel_batch(const char *path, GroupDir *groups, int echo, int prompt, int threads);
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+/* Initialize an empty pool of objects of object_size bytes, each aligned
+ * to align, in slabs of at most max_slab objects.
+ */
+void pool_init(Pool *pool, size_t object_size, size_t align, size_t max_slab) {
+    if ( object_size < sizeof(void *) ) {   // room for the free list link
+        object_size = sizeof(void *);
+    }
+    pool->object_size = (object_size + align - 1) & ~(align - 1);
+    pool->align = align;
+    pool->slab_objects = max_slab < POOL_MIN_SLAB ? max_slab : POOL_MIN_SLAB;
+    pool->max_slab = max_slab;
+    pool->slabs = NULL;
+    pool->nslabs = 0;
+    pool->slab_capacity = 0;
+    pool->reserved = 0;
+    pool->next = NULL;
+    pool->end = NULL;
+    pool->free_list = NULL;
+    pool->in_use = 0;
+}
+
+/*
+ * Allocate the next slab, twice as large as the last one up to max_slab
+ * objects, and make it the bump region.
+ */
+static void grow(Pool *pool) {
+    size_t bytes = pool->slab_objects * pool->object_size;
+    char *slab;
+
+    if ( pool->nslabs == pool->slab_capacity ) {
+        size_t capacity = pool->slab_capacity ? pool->slab_capacity * 2 : 8;
+        void **slabs = realloc(pool->slabs, capacity * sizeof(void *));
+        if ( slabs == NULL ) {
+            printf("Error while growing memory pool. Program will now exit. \n");
+            exit(0);
+        }
+        pool->slabs = slabs;
+        pool->slab_capacity = capacity;
+    }
+
+    slab = pool->align > sizeof(void *) ? aligned_alloc(pool->align, bytes) : malloc(bytes);
+    if ( slab == NULL ) {
+        printf("Error while growing memory pool. Program will now exit. \n");
+        exit(0);
+    }
+    pool->slabs[pool->nslabs++] = slab;
+    pool->reserved += bytes;
+    pool->next = slab;
+    pool->end = slab + bytes;
+    if ( pool->slab_objects * 2 <= pool->max_slab ) {
+        pool->slab_objects *= 2;
+    }
+}
+
+/* Return an uninitialized object from pool, reusing a freed one if there
+ * is any.
+ */
+void *pool_alloc(Pool *pool) {
+    void *object = pool->free_list;
+
+    if ( object ) {
+        pool->free_list = *(void **) object;
+    } else {
+        if ( pool->next == pool->end ) {
+            grow(pool);
+        }
+        object = pool->next;
+        pool->next += pool->object_size;
+    }
+    pool->in_use++;
+    return object;
+}
+
+/* Give object back to pool for reuse by a later pool_alloc.
+ */
+void pool_free(Pool *pool, void *object) {
+    *(void **) object = pool->free_list;
+    pool->free_list = object;
+    pool->in_use--;
+}
+
+/* Free every slab of pool, and with them every object it handed out. The
+ * pool is left empty and can be used again.
+ */
+void pool_release(Pool *pool) {
+    size_t i;
+
+    for ( i = 0; i < pool->nslabs; i++ ) {
+        free(pool->slabs[i]);
+    }
+    free(pool->slabs);
+    pool_init(pool, pool->object_size, pool->align, pool->max_slab);
+}
+
+/* Arena blocks are chained newest first; the strings follow the header.
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+};
+
+#define BLOCK_HEADER ((sizeof(struct arena_block) + ARENA_GRAIN - 1) & ~(size_t) (ARENA_GRAIN - 1))
+
+/* Initialize an empty arena.
+ */
+void arena_init(Arena *arena) {
+    arena->blocks = NULL;
+    arena->block_size = ARENA_MIN_BLOCK;
+    arena->next = NULL;
+    arena->end = NULL;
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+    arena->reserved = 0;
+    arena->in_use = 0;
+}
+
+/*
+ * Bump-allocate size bytes (a multiple of ARENA_GRAIN) from arena, starting
+ * a new block if the current one is too small.
+ */
+static char *bump(Arena *arena, size_t size) {
+    char *str;
+
+    if ( (size_t) (arena->end - arena->next) < size ) {
+        size_t blockSize = arena->block_size;
+        struct arena_block *block;
+
+        while ( blockSize < BLOCK_HEADER + size + 1 ) {
+            blockSize *= 2;
+        }
+        block = malloc(blockSize);
+        if ( block == NULL ) {
+            printf("Error while creating name. Program will now exit. \n");
+            exit(0);
+        }
+        block->next = arena->blocks;
+        block->size = blockSize;
+        arena->blocks = block;
+        arena->reserved += blockSize;
+        arena->next = (char *) block + BLOCK_HEADER;
+        arena->end = (char *) block + blockSize - 1;
+        *arena->end = '\0';    // ends any string a reader finds half-rewritten
+        if ( arena->block_size < ARENA_MAX_BLOCK ) {
+            arena->block_size *= 2;
+        }
+    }
+    str = arena->next;
+    arena->next += size;
+    return str;
+}
+
+/* Return a copy of str allocated in arena.
+ */
+char *arena_strdup(Arena *arena, const char *str) {
+    size_t length = strlen(str) + 1;
+    size_t size = (length + ARENA_GRAIN - 1) & ~(size_t) (ARENA_GRAIN - 1);
+    char *copy = NULL;
+
+    if ( size <= ARENA_MAX_CLASS ) {
+        void **freeList = &arena->free_lists[size / ARENA_GRAIN - 1];
+        if ( *freeList ) {
+            copy = *freeList;
+            *freeList = *(void **) copy;
+        }
+    }
+    if ( copy == NULL ) {
+        copy = bump(arena, size);
+    }
+    arena->in_use += size;
+    memcpy(copy, str, length);
+    return copy;
+}
+
+/* Give a string returned by arena_strdup back to arena. Strings longer
+ * than ARENA_MAX_CLASS stay allocated until arena_release.
+ */
+void arena_free_str(Arena *arena, char *str) {
+    size_t size = (strlen(str) + 1 + ARENA_GRAIN - 1) & ~(size_t) (ARENA_GRAIN - 1);
+
+    arena->in_use -= size;
+    if ( size <= ARENA_MAX_CLASS ) {
+        void **freeList = &arena->free_lists[size / ARENA_GRAIN - 1];
+        *(void **) str = *freeList;
+        *freeList = str;
+    }
+}
+
+/* Free every block of arena, and with them every string in it. The arena
+ * is left empty and can be used again.
+ */
+void arena_release(Arena *arena) {
+    struct arena_block *block, *next;
+
+    for ( block = arena->blocks; block; block = next ) {
+        next = block->next;
+        free(block);
+    }
+    arena_init(arena);
+}
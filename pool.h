@@ -0,0 +1,79 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* Slab pool of fixed-size objects.
+ *
+ * Objects are carved out of slabs that double in size (from POOL_MIN_SLAB
+ * up to max_slab objects), and freed objects go on a free list that
+ * the next pool_alloc takes from first. Nothing is returned to the system
+ * until pool_release, which frees every slab at once regardless of how
+ * many objects were handed out.
+ *
+ * Every object is aligned to align, which must be a power of two; slabs
+ * are aligned the same way and object_size is rounded up to a multiple
+ * of it.
+ */
+
+#define POOL_MIN_SLAB 8
+#define POOL_MAX_SLAB 4096
+
+struct pool {
+	size_t object_size;
+	size_t align;
+	size_t slab_objects;	/* objects in the next slab */
+	size_t max_slab;
+	void **slabs;
+	size_t nslabs;
+	size_t slab_capacity;
+	size_t reserved;	/* bytes in all slabs */
+	char *next;	/* unused space in the newest slab */
+	char *end;
+	void *free_list;	/* freed objects, chained through their first word */
+	size_t in_use;	/* objects handed out and not freed */
+};
+
+typedef struct pool Pool;
+
+void pool_init(Pool *pool, size_t object_size, size_t align, size_t max_slab);
+void *pool_alloc(Pool *pool);
+void pool_free(Pool *pool, void *object);
+void pool_release(Pool *pool);
+
+/* Arena for name strings.
+ *
+ * Strings are bump-allocated from blocks that double in size up to
+ * ARENA_MAX_BLOCK bytes. A freed string's space goes on a free list for
+ * its size class (multiples of ARENA_GRAIN bytes up to ARENA_MAX_CLASS),
+ * so the names of removed users are reused by later ones; longer strings
+ * are only reclaimed by arena_release. The last byte of every block is a
+ * '\0' that is never handed out, so a string being reused under a reader
+ * (see share_group_dir) can't be read past its block.
+ */
+
+#define ARENA_MIN_BLOCK 256
+#define ARENA_MAX_BLOCK 65536
+#define ARENA_GRAIN 8
+#define ARENA_MAX_CLASS 128
+
+struct arena_block;
+
+struct arena {
+	struct arena_block *blocks;
+	size_t block_size;	/* size of the next block */
+	char *next;	/* unused space in the newest block */
+	char *end;
+	void *free_lists[ARENA_MAX_CLASS / ARENA_GRAIN];
+	size_t reserved;	/* bytes in all blocks */
+	size_t in_use;	/* bytes of live strings, rounded to their class */
+};
+
+typedef struct arena Arena;
+
+void arena_init(Arena *arena);
+char *arena_strdup(Arena *arena, const char *str);
+void arena_free_str(Arena *arena, char *str);
+void arena_release(Arena *arena);
+
+#endif
@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "server.h"
+#include "commands.h"
+#include "output.h"
+
+struct client {
+    int fd;
+    unsigned int events;        // what epoll is watching for
+    int closing;                // close once the reply is sent
+    char *in;                   // bytes read but not yet run
+    size_t in_len;
+    size_t in_cap;
+    struct capture reply;       // responses not yet sent
+    size_t reply_sent;
+    struct client *prev;
+    struct client *next;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+/* Open a socket for address, see server.h: listening on it if listening
+ * is set (non-blocking), or connected to it otherwise. Returns the socket,
+ * or -1 on error.
+ */
+int server_socket(const char *address, int listening) {
+    int fd;
+
+    if ( strncmp(address, "unix:", 5) == 0 ) {
+        struct sockaddr_un sun;
+        const char *path = address + 5;
+        struct stat st;
+
+        if ( strlen(path) >= sizeof(sun.sun_path) ) {
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, path);
+        if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ) {
+            return -1;
+        }
+        if ( listening ) {
+            if ( stat(path, &st) == 0 && S_ISSOCK(st.st_mode) ) {
+                unlink(path);   // left behind by a server that was killed
+            }
+            if ( bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1 || listen(fd, SOMAXCONN) == -1
+                    || fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ) {
+                close(fd);
+                return -1;
+            }
+        } else if ( connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1 ) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    char host[256] = "127.0.0.1";
+    const char *port = address, *colon = strrchr(address, ':');
+    struct addrinfo hints, *res, *ai;
+
+    if ( colon ) {
+        if ( (size_t) (colon - address) >= sizeof(host) ) {
+            return -1;
+        }
+        memcpy(host, address, colon - address);
+        host[colon - address] = '\0';
+        port = colon + 1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ( getaddrinfo(host, port, &hints, &res) != 0 ) {
+        return -1;
+    }
+
+    fd = -1;
+    for ( ai = res; ai; ai = ai->ai_next ) {
+        int one = 1;
+        if ( (fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1 ) {
+            continue;
+        }
+        if ( listening ) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if ( bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0
+                    && fcntl(fd, F_SETFL, O_NONBLOCK) == 0 ) {
+                break;
+            }
+        } else if ( connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*
+ * Watch client for events, if that is not what epoll watches already.
+ */
+static void watch(int epfd, struct client *client, unsigned int events) {
+    struct epoll_event ev;
+
+    if ( client->events == events ) {
+        return;
+    }
+    ev.events = events;
+    ev.data.ptr = client;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+    client->events = events;
+}
+
+static void close_client(int epfd, struct client **clients, struct client *client) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    if ( client->prev ) {
+        client->prev->next = client->next;
+    } else {
+        *clients = client->next;
+    }
+    if ( client->next ) {
+        client->next->prev = client->prev;
+    }
+    free(client->in);
+    capture_release(&client->reply);
+    free(client);
+}
+
+/*
+ * Queue the response made of what out and err collected.
+ */
+static void queue_response(struct client *client, struct capture *out, struct capture *err) {
+    char header[48];
+    int n = snprintf(header, sizeof(header), "%lu %lu\n", (unsigned long) out->len, (unsigned long) err->len);
+
+    capture_append(&client->reply, header, n);
+    capture_append(&client->reply, out->buf, out->len);
+    capture_append(&client->reply, err->buf, err->len);
+}
+
+/*
+ * Run the request [line, eol), where eol is writable, and queue its
+ * response. out and err collect what it prints.
+ */
+static void run_request(struct client *client, char *line, char *eol, GroupDir *groups,
+        struct capture *out, struct capture *err) {
+    char *cmd_argv[INPUT_ARG_MAX_NUM];
+    int cmd_argc;
+
+    out->len = err->len = 0;
+    capture_output(out, err);
+    cmd_argc = tokenize_in_place(line, eol, cmd_argv);
+    if ( cmd_argc > 0 && process_args(cmd_argc, cmd_argv, groups) == -1 ) {
+        client->closing = 1;    // quit
+    }
+    capture_output(NULL, NULL);
+    if ( command_failure() ) {
+        return;     // the change is not acknowledged; the server stops
+    }
+    queue_response(client, out, err);
+}
+
+/*
+ * Read what client sent and run every complete request in it. Returns -1
+ * if the client has gone.
+ */
+static int client_read(struct client *client, GroupDir *groups, struct capture *out, struct capture *err) {
+    ssize_t n;
+
+    if ( client->in_cap - client->in_len < SERVER_READ_BYTES ) {
+        client->in_cap = client->in_len + SERVER_READ_BYTES;
+        client->in = realloc(client->in, client->in_cap);
+        if ( client->in == NULL ) {
+            printf("Error while allocating client buffer. Program will now exit. \n");
+            exit(0);
+        }
+    }
+    n = read(client->fd, client->in + client->in_len, client->in_cap - client->in_len);
+    if ( n == 0 ) {
+        client->closing = 1;    // answer what was sent, then close
+        return 0;
+    }
+    if ( n == -1 ) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    client->in_len += n;
+
+    char *line = client->in, *end = client->in + client->in_len, *eol;
+    while ( !client->closing && (eol = memchr(line, '\n', end - line)) != NULL ) {
+        char *stop = eol;
+        if ( stop > line && stop[-1] == '\r' ) {
+            stop--;
+        }
+        run_request(client, line, stop, groups, out, err);
+        line = eol + 1;
+    }
+    client->in_len = end - line;
+    memmove(client->in, line, client->in_len);
+
+    if ( client->in_len > SERVER_MAX_LINE ) {
+        out->len = err->len = 0;
+        capture_output(out, err);
+        error("Line too long");
+        capture_output(NULL, NULL);
+        queue_response(client, out, err);
+        client->closing = 1;
+    }
+    return 0;
+}
+
+/*
+ * Send as much of client's queued responses as the socket takes. Returns
+ * -1 if the client has gone or is done.
+ */
+static int client_flush(int epfd, struct client *client) {
+    struct capture *reply = &client->reply;
+
+    while ( client->reply_sent < reply->len ) {
+        ssize_t n = send(client->fd, reply->buf + client->reply_sent, reply->len - client->reply_sent, MSG_NOSIGNAL);
+        if ( n == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN ) {
+                break;
+            }
+            return -1;
+        }
+        client->reply_sent += n;
+    }
+    if ( client->reply_sent == reply->len ) {
+        reply->len = client->reply_sent = 0;
+        if ( client->closing ) {
+            return -1;
+        }
+    } else if ( client->reply_sent > reply->len / 2 ) {
+        reply->len -= client->reply_sent;
+        memmove(reply->buf, reply->buf + client->reply_sent, reply->len);
+        client->reply_sent = 0;
+    }
+
+    unsigned int events = 0;
+    if ( !client->closing && reply->len - client->reply_sent < SERVER_MAX_REPLY ) {
+        events |= EPOLLIN;
+    }
+    if ( client->reply_sent < reply->len ) {
+        events |= EPOLLOUT;
+    }
+    watch(epfd, client, events);
+    return 0;
+}
+
+/*
+ * Accept every pending connection on listener.
+ */
+static void accept_clients(int epfd, int listener, struct client **clients) {
+    int fd, one = 1;
+
+    while ( (fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1 ) {
+        struct client *client = calloc(1, sizeof(struct client));
+        struct epoll_event ev;
+
+        if ( client == NULL ) {
+            printf("Error while allocating client. Program will now exit. \n");
+            exit(0);
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));    // fails harmlessly on Unix sockets
+        client->fd = fd;
+        client->events = EPOLLIN;
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        if ( epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1 ) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        client->next = *clients;
+        if ( *clients ) {
+            (*clients)->prev = client;
+        }
+        *clients = client;
+    }
+}
+
+/* One event loop: its own epoll set and clients, sharing the listener */
+struct server_loop {
+    GroupDir *groups;
+    int listener;
+    int epfd;
+    struct client *clients;
+    struct capture out;
+    struct capture err;
+    const sigset_t *sigmask;    // signals let through while waiting, or NULL
+    int wake;                   // eventfd that wakes every loop
+    pthread_t thread;
+};
+
+/* epoll tag of the eventfd that stops the loops */
+static char wake_tag;
+
+/*
+ * Run loop until the server is stopped, then close its clients.
+ */
+static void *serve(void *arg) {
+    struct server_loop *loop = arg;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int i, n;
+
+    while ( !stopping ) {
+        n = epoll_pwait(loop->epfd, events, SERVER_MAX_EVENTS, -1, loop->sigmask);
+        for ( i = 0; i < n; i++ ) {
+            struct client *client = events[i].data.ptr;
+
+            if ( client == NULL ) {
+                accept_clients(loop->epfd, loop->listener, &loop->clients);
+                continue;
+            }
+            if ( (char *) client == &wake_tag ) {
+                continue;
+            }
+            if ( (events[i].events & EPOLLIN) && client_read(client, loop->groups, &loop->out, &loop->err) == -1 ) {
+                close_client(loop->epfd, &loop->clients, client);
+                continue;
+            }
+            if ( (events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN) ) {
+                close_client(loop->epfd, &loop->clients, client);
+                continue;
+            }
+            if ( client_flush(loop->epfd, client) == -1 ) {
+                close_client(loop->epfd, &loop->clients, client);
+            }
+        }
+        if ( command_failure() && !stopping ) {
+            uint64_t one = 1;
+            stopping = 1;   // and wake the other loops to see it
+            if ( write(loop->wake, &one, sizeof(one)) == -1 ) {
+                perror("eventfd");
+            }
+        }
+    }
+
+    while ( loop->clients ) {
+        close_client(loop->epfd, &loop->clients, loop->clients);
+    }
+    return NULL;
+}
+
+/* Serve clients on address with threads event loops until SIGINT or
+ * SIGTERM, or until a change can't be journaled or fed, see server.h. With more than one loop the groups are shared
+ * (see share_group_dir): each connection stays on one loop, so its
+ * requests still run in order. Returns 0 when stopped, or -1 if the
+ * server can't listen on address.
+ */
+int run_server(const char *address, GroupDir *groups, int threads) {
+    struct server_loop *loops;
+    struct epoll_event ev;
+    struct sigaction sa;
+    sigset_t block, unblocked;
+    uint64_t one = 1;
+    int listener, wake, i;
+
+    if ( (listener = server_socket(address, 1)) == -1 ) {
+        return -1;
+    }
+    wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loops = calloc(threads, sizeof(struct server_loop));
+    if ( wake == -1 || loops == NULL ) {
+        printf("Error while creating server loops. Program will now exit. \n");
+        exit(0);
+    }
+    if ( threads > 1 ) {
+        share_group_dir(groups);
+    }
+
+    /* the signals are only let through while the first loop waits in
+     * epoll_pwait, so a stop can't slip in between checking stopping and
+     * waiting; the other loops inherit the blocked mask and are woken
+     * through wake */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block, &unblocked);
+    sigdelset(&unblocked, SIGINT);
+    sigdelset(&unblocked, SIGTERM);
+
+    for ( i = 0; i < threads; i++ ) {
+        struct server_loop *loop = &loops[i];
+        loop->groups = groups;
+        loop->listener = listener;
+        loop->sigmask = i == 0 ? &unblocked : NULL;
+        loop->wake = wake;
+        if ( (loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ) {
+            printf("Error while creating server loops. Program will now exit. \n");
+            exit(0);
+        }
+        ev.events = threads > 1 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;   // one loop takes each connection
+        ev.data.ptr = NULL;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listener, &ev);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wake_tag;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, wake, &ev);
+    }
+
+    printf("Listening on %s\n", address);
+    fflush(stdout);
+
+    for ( i = 1; i < threads; i++ ) {
+        if ( pthread_create(&loops[i].thread, NULL, serve, &loops[i]) != 0 ) {
+            printf("Error while starting server threads. Program will now exit. \n");
+            exit(0);
+        }
+    }
+    serve(&loops[0]);
+    if ( write(wake, &one, sizeof(one)) == -1 ) {
+        perror("eventfd");
+    }
+    for ( i = 1; i < threads; i++ ) {
+        pthread_join(loops[i].thread, NULL);
+    }
+
+    for ( i = 0; i < threads; i++ ) {
+        close(loops[i].epfd);
+        capture_release(&loops[i].out);
+        capture_release(&loops[i].err);
+    }
+    free(loops);
+    close(wake);
+    close(listener);
+    if ( strncmp(address, "unix:", 5) == 0 ) {
+        unlink(address + 5);
+    }
+    sigprocmask(SIG_UNBLOCK, &block, NULL);
+    return 0;
+}
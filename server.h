@@ -0,0 +1,34 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "lists.h"
+
+/* Server mode.
+ *
+ * A single-threaded epoll loop accepts clients on a Unix socket
+ * ("unix:PATH") or a TCP socket ("PORT" or "HOST:PORT", localhost by
+ * default) and runs the commands they send. A request is one line of the
+ * usual command grammar; every request gets one response,
+ *
+ *   "<out bytes> <err bytes>\n" output errors
+ *
+ * where errors are what error() reported for that command. Requests may
+ * be pipelined: all complete lines in a read are run together and their
+ * responses sent with one write. quit closes the connection; SIGINT or
+ * SIGTERM stops the server.
+ *
+ * With several threads, each runs its own loop over the connections it
+ * accepted, and the groups are shared between them (see lists.h): writes
+ * to a group are serialized, and reads take no lock, so a slow reader
+ * never holds up a writer.
+ */
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_BYTES 65536
+#define SERVER_MAX_LINE 65536
+#define SERVER_MAX_REPLY (1 << 20)	/* stop reading a client with this much unsent */
+
+int server_socket(const char *address, int listening);
+int run_server(const char *address, GroupDir *groups, int threads);
+
+#endif
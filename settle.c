@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "settle.h"
+#include "ostree.h"
+#include "output.h"
+
+/* What one user owes or is owed */
+struct heap_entry {
+    Money amount;
+    unsigned int id;
+};
+
+/* One side of the matching, debts or credits. The shares come in a run,
+ * largest first; what is left of one that was partly settled is smaller
+ * than it was, so it goes into a max-heap, kept in the part of the run
+ * already used up (heaped <= next). The largest share left is the larger
+ * of the run's next and the heap's top.
+ */
+struct side {
+    struct heap_entry *run;
+    unsigned long next;
+    unsigned long count;
+    unsigned long heaped;
+};
+
+/*
+ * Move heap[i] down until neither child is larger.
+ */
+static void sift_down(struct heap_entry *heap, unsigned long n, unsigned long i) {
+    struct heap_entry entry = heap[i];
+
+    for ( ;; ) {
+        unsigned long child = 2 * i + 1;
+        if ( child >= n ) {
+            break;
+        }
+        if ( child + 1 < n && heap[child + 1].amount > heap[child].amount ) {
+            child++;
+        }
+        if ( heap[child].amount <= entry.amount ) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = entry;
+}
+
+/*
+ * Add entry to the heap of n entries.
+ */
+static void push(struct heap_entry *heap, unsigned long n, struct heap_entry entry) {
+    unsigned long i = n;
+
+    while ( i > 0 && heap[(i - 1) / 2].amount < entry.amount ) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = entry;
+}
+
+static int side_empty(const struct side *side) {
+    return side->heaped == 0 && side->next == side->count;
+}
+
+/* The largest share left on side, which must not be empty */
+static struct heap_entry *side_top(struct side *side) {
+    if ( side->heaped && (side->next == side->count || side->run[0].amount >= side->run[side->next].amount) ) {
+        return &side->run[0];
+    }
+    return &side->run[side->next];
+}
+
+/*
+ * Settle amount of the largest share left on side.
+ */
+static void side_take(struct side *side, Money amount) {
+    struct heap_entry *top = side_top(side);
+
+    if ( top != &side->run[side->next] ) {     // the heap's
+        top->amount -= amount;
+        if ( top->amount == 0 ) {
+            *top = side->run[--side->heaped];
+        }
+        if ( side->heaped > 0 ) {
+            sift_down(side->run, side->heaped, 0);
+        }
+    } else {
+        struct heap_entry rest = side->run[side->next++];
+        rest.amount -= amount;
+        if ( rest.amount > 0 ) {
+            push(side->run, side->heaped++, rest);
+        }
+    }
+}
+
+/*
+ * Work out the group's transfers from its balances and keep them on the
+ * group for the current version.
+ */
+void settle_compute(Group *group) {
+    unsigned long n = group->user_count, i;
+    struct side debts = {NULL, 0, 0, 0}, credits = {NULL, 0, 0, 0};
+    Money total = group_total(group), share, net;
+    long extra;
+    User *user;
+
+    if ( group->transfer_capacity < n ) {
+        free(group->transfers);
+        group->transfers = malloc(n * sizeof(struct transfer));
+        group->transfer_capacity = n;
+    }
+    debts.run = malloc(n * sizeof(struct heap_entry));
+    credits.run = malloc(n * sizeof(struct heap_entry));
+    if ( group->transfers == NULL || debts.run == NULL || credits.run == NULL ) {
+        printf("Error while settling group. Program will now exit. \n");
+        exit(0);
+    }
+
+    // the floor of total / n, and how many of the lowest payers owe a cent more
+    share = total / (Money) n;
+    if ( share * (Money) n > total ) {
+        share--;
+    }
+    extra = total - share * (Money) n;
+
+    // net = balance - share only grows along the list, so the debts in list
+    // order and the credits in reverse list order are both largest first
+    for ( user = group->users, i = 0; user; user = user->next, i++ ) {
+        net = user->balance - share - ((long) i < extra);
+        if ( net >= 0 ) {
+            break;
+        }
+        debts.run[debts.count].amount = -net;
+        debts.run[debts.count++].id = user->id;
+    }
+    for ( user = ost_last(group->user_tree), i = n - 1; user; user = user->prev, i-- ) {
+        net = user->balance - share - ((long) i < extra);
+        if ( net <= 0 ) {
+            break;
+        }
+        credits.run[credits.count].amount = net;
+        credits.run[credits.count++].id = user->id;
+    }
+
+    // debts and credits add up to the same, so both run out together
+    group->transfer_count = 0;
+    while ( !side_empty(&debts) && !side_empty(&credits) ) {
+        struct heap_entry *debt = side_top(&debts), *credit = side_top(&credits);
+        Money amount = debt->amount < credit->amount ? debt->amount : credit->amount;
+        struct transfer *transfer = &group->transfers[group->transfer_count++];
+        transfer->from = debt->id;
+        transfer->to = credit->id;
+        transfer->amount = amount;
+        side_take(&debts, amount);
+        side_take(&credits, amount);
+    }
+    group->settled_version = group->version;
+
+    free(debts.run);
+    free(credits.run);
+}
+
+/*
+ * Print to standard output the transfers that even out group, one per line
+ * as "<from> pays <to> $<amount>" in the order they were matched, or a
+ * blank line if everyone is even. They are only worked out again if the
+ * group changed since the last settle. Returns 0 on success, and -1 if the
+ * list of users is empty.
+ */
+int settle(Group *group) {
+    unsigned long i;
+
+    if ( group->user_count == 0 ) {
+        return -1;
+    }
+    if ( group->settled_version != group->version ) {
+        settle_compute(group);
+    }
+    if ( group->transfer_count == 0 ) {
+        out_printf(" \n");
+    }
+    for ( i = 0; i < group->transfer_count; i++ ) {
+        struct transfer *transfer = &group->transfers[i];
+        out_printf("%s pays %s $" MONEY_FMT "\n", group->user_ids[transfer->from]->name,
+                group->user_ids[transfer->to]->name, MONEY_ARGS(transfer->amount));
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef SETTLE_H
+#define SETTLE_H
+
+#include "lists.h"
+
+/* Who should pay whom to even out a group.
+ *
+ * Each user's share is the group total over the number of users, to the
+ * cent; the cents that don't divide evenly are owed by the lowest payers.
+ * Users below their share pay and users above it are paid. Greedy
+ * matching takes the largest debt and the largest credit, settles the
+ * smaller of the two in one transfer and puts the rest back, so there are
+ * at most n - 1 transfers.
+ *
+ * The user list is already in balance order, kept so by every add_xct,
+ * and read from either end it gives the debts or the credits largest
+ * first: settle never sorts. What is left of a partly settled share goes
+ * into a max-heap next to that run, so each step is O(log n) at worst and
+ * the heaps stay small when a few shares dominate. The transfers are kept
+ * on the group and printed again as they are until the next change to
+ * its users or balances.
+ */
+
+int settle(Group *group);
+void settle_compute(Group *group);
+
+#endif
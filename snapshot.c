@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "xctlog.h"
+
+#define SNAPSHOT_BUFFER_SIZE (1 << 20)
+
+#define PAD8(n) (((n) + 7) & ~(size_t) 7)
+
+static const char zeros[8];
+
+/*
+ * Write a name with its terminating '\0', padded to a multiple of 8 bytes.
+ */
+static void write_name(FILE *out, const char *name, size_t name_len) {
+    fwrite(name, 1, name_len, out);
+    fwrite(zeros, 1, PAD8(name_len) - name_len, out);
+}
+
+/* Write every group in dir to a snapshot file at path. The snapshot is
+ * written to path.tmp first and renamed over path once it is complete and
+ * synced, so path always holds a whole snapshot. Transactions spilled to
+ * disk are read back and written with the rest. Returns 0 on success and
+ * -1 on failure.
+ */
+int save_snapshot(GroupDir *dir, const char *path) {
+    size_t pathLen = strlen(path);
+    char *tmpPath = malloc(pathLen + 5);
+    FILE *out;
+    Group *group;
+    struct xct_stream *stream = NULL;  // for transactions spilled to disk
+    int failed = 0;
+
+    if ( tmpPath == NULL ) {
+        return -1;
+    }
+    memcpy(tmpPath, path, pathLen);
+    memcpy(tmpPath + pathLen, ".tmp", 5);
+
+    out = fopen(tmpPath, "wb");
+    if ( out == NULL || (stream = malloc(sizeof(struct xct_stream))) == NULL ) {
+        if ( out ) {
+            fclose(out);
+            unlink(tmpPath);
+        }
+        free(tmpPath);
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, SNAPSHOT_BUFFER_SIZE);
+
+    struct snap_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.group_count = dir->count;
+    fwrite(&header, sizeof(header), 1, out);
+
+    for ( group = dir->head; group; group = group->next ) {
+        struct snap_group sg;
+        sg.name_len = strlen(group->name) + 1;
+        sg.id_count = group->id_count;
+        sg.user_count = group->user_count;
+        sg.xct_count = group->xcts.count;
+        fwrite(&sg, sizeof(sg), 1, out);
+        write_name(out, group->name, sg.name_len);
+
+        User *user;
+        for ( user = group->users; user; user = user->next ) {
+            struct snap_user su;
+            su.balance = user->balance;
+            su.id = user->id;
+            su.name_len = strlen(user->name) + 1;
+            fwrite(&su, sizeof(su), 1, out);
+            write_name(out, user->name, su.name_len);
+        }
+
+        // those spilled to disk first, they are the oldest
+        const Xct *xct;
+        unsigned long index;
+        xct_stream_init(stream, &group->xcts);
+        for ( index = 0; (xct = xct_stream_at(stream, index)) != NULL; index++ ) {
+            if ( xct_log_cold_live(&group->xcts, xct, index) ) {
+                struct snap_xct sx;
+                sx.user_id = xct->user_id;
+                sx.time = xct->time;
+                sx.amount = xct->amount;
+                fwrite(&sx, sizeof(sx), 1, out);
+            }
+        }
+        failed |= index != group->xcts.cold_count;  // the segment could not be read back
+        struct xct_chunk *chunk;
+        for ( chunk = group->xcts.head; chunk; chunk = chunk->next ) {
+            unsigned long i;
+            for ( i = 0; i < chunk->count; i++ ) {
+                if ( chunk->records[i].user_id == XCT_REMOVED ) {
+                    continue;
+                }
+                struct snap_xct sx;
+                sx.user_id = chunk->records[i].user_id;
+                sx.time = chunk->records[i].time;
+                sx.amount = chunk->records[i].amount;
+                fwrite(&sx, sizeof(sx), 1, out);
+            }
+        }
+    }
+
+    free(stream);
+    if ( failed || fflush(out) != 0 || ferror(out) || fsync(fileno(out)) == -1 ) {
+        fclose(out);
+        unlink(tmpPath);
+        free(tmpPath);
+        return -1;
+    }
+    fclose(out);
+    if ( rename(tmpPath, path) == -1 ) {
+        unlink(tmpPath);
+        free(tmpPath);
+        return -1;
+    }
+    free(tmpPath);
+    return 0;
+}
+
+/* Read position in a mapped snapshot.
+ */
+struct cursor {
+    const char *p;
+    const char *end;
+};
+
+/*
+ * Return a pointer to the next size bytes and step over them, or NULL if
+ * the snapshot is too short.
+ */
+static const void *take(struct cursor *cur, size_t size) {
+    const char *p = cur->p;
+
+    if ( (size_t) (cur->end - p) < size ) {
+        return NULL;
+    }
+    cur->p += size;
+    return p;
+}
+
+/*
+ * Return the next name of name_len bytes, or NULL if it is truncated or
+ * not terminated where the header says.
+ */
+static const char *take_name(struct cursor *cur, uint32_t name_len) {
+    const char *name;
+
+    if ( name_len == 0 || (name = take(cur, PAD8(name_len))) == NULL || name[name_len - 1] != '\0' ) {
+        return NULL;
+    }
+    if ( memchr(name, '\0', name_len - 1) ) {
+        return NULL;    // a name can't contain a '\0'
+    }
+    return name;
+}
+
+/*
+ * Load the groups of the mapped snapshot at cur into the empty directory
+ * dir. Returns 0 on success and -1 if the snapshot is malformed.
+ */
+static int read_groups(struct cursor *cur, GroupDir *dir) {
+    const struct snap_header *header = take(cur, sizeof(*header));
+    uint64_t g;
+
+    if ( header == NULL || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+            || header->version != SNAPSHOT_VERSION ) {
+        return -1;
+    }
+
+    for ( g = 0; g < header->group_count; g++ ) {
+        const struct snap_group *sg = take(cur, sizeof(*sg));
+        const char *groupName;
+        Group *group;
+        User *prev = NULL;
+        uint64_t i;
+
+        if ( sg == NULL || (groupName = take_name(cur, sg->name_len)) == NULL
+                || dir_add_group(dir, groupName) == -1 ) {
+            return -1;
+        }
+        group = dir->tail;
+
+        for ( i = 0; i < sg->user_count; i++ ) {
+            const struct snap_user *su = take(cur, sizeof(*su));
+            const char *userName;
+            Money balance;
+
+            if ( su == NULL || (userName = take_name(cur, su->name_len)) == NULL
+                    || su->id >= sg->id_count || su->id == XCT_REMOVED
+                    || (su->id < group->id_capacity && group->user_ids[su->id])
+                    || find_user(group, userName) ) {
+                return -1;
+            }
+            balance = su->balance;
+            if ( prev && balance < prev->balance ) {
+                return -1;
+            }
+            prev = restore_user(group, prev, userName, balance, su->id);
+        }
+        finish_restore(group, sg->id_count);
+
+        const struct snap_xct *xcts;
+        if ( sg->xct_count > (uint64_t) (cur->end - cur->p) / sizeof(struct snap_xct)
+                || (xcts = take(cur, sg->xct_count * sizeof(struct snap_xct))) == NULL ) {
+            return -1;
+        }
+        for ( i = 0; i < sg->xct_count; i++ ) {
+            if ( restore_xct(group, xcts[i].user_id, xcts[i].amount, xcts[i].time) == -1 ) {
+                return -1;
+            }
+        }
+    }
+    return cur->p == cur->end ? 0 : -1;
+}
+
+/* Replace every group in dir with the groups in the snapshot file at path.
+ * The file is mapped and its records are used where they lie. dir is left
+ * unchanged if the file can't be read or is not a valid snapshot. Returns
+ * 0 on success and -1 on failure.
+ */
+int load_snapshot(GroupDir *dir, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    GroupDir loaded;
+    struct cursor cur;
+    char *map;
+    int result;
+
+    if ( fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0 ) {
+        if ( fd != -1 ) {
+            close(fd);
+        }
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    cur.p = map;
+    cur.end = map + st.st_size;
+    init_group_dir(&loaded);
+    result = read_groups(&cur, &loaded);
+    munmap(map, st.st_size);
+
+    if ( result == -1 ) {
+        free_group_dir(&loaded);
+        return -1;
+    }
+    free_group_dir(dir);
+    *dir = loaded;
+    pthread_mutex_init(&dir->write_lock, NULL);    // a copied mutex can't be used
+    return 0;
+}
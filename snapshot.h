@@ -0,0 +1,57 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "lists.h"
+
+/* Binary snapshot of every group, user and transaction.
+ *
+ * The file is a header followed by one section per group, in list order:
+ *
+ *   snap_header
+ *   for each group:
+ *       snap_group, group name
+ *       user_count x (snap_user, user name)    users in balance order
+ *       xct_count x snap_xct                   transactions, oldest first
+ *
+ * Names are stored with their terminating '\0' and padded to a multiple
+ * of 8 bytes so that every struct is aligned in the mapped file. Integers
+ * are in host byte order, and amounts are int64 cents. Only snapshots of
+ * SNAPSHOT_VERSION are loaded. Loading maps
+ * the file and reads the structs in place; the users are already in balance order, so each
+ * group's tree is built in O(n) without sorting.
+ */
+
+#define SNAPSHOT_MAGIC "BUXFER\0S"
+#define SNAPSHOT_VERSION 3
+
+struct snap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t group_count;
+};
+
+struct snap_group {
+	uint32_t name_len;	/* including the '\0' */
+	uint32_t id_count;	/* user ids handed out, see group->id_count */
+	uint64_t user_count;
+	uint64_t xct_count;
+};
+
+struct snap_user {
+	int64_t balance;
+	uint32_t id;
+	uint32_t name_len;	/* including the '\0' */
+};
+
+struct snap_xct {
+	uint32_t user_id;
+	uint32_t time;	/* seconds since the epoch */
+	int64_t amount;
+};
+
+int save_snapshot(GroupDir *dir, const char *path);
+int load_snapshot(GroupDir *dir, const char *path);
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "stats.h"
+#include "output.h"
+#include "lists.h"
+
+#ifdef BUXFER_NO_STATS
+
+void stats_print(void) {
+    error("Statistics were compiled out");
+}
+
+void stats_reset(void) {
+}
+
+#else
+
+/* Commands with a histogram of their own; any other name counts as the last */
+static const char *const command_names[] = {
+    "add_group", "list_groups", "add_user", "remove_user", "list_users",
+    "user_balance", "under_paid", "group_total", "group_average",
+    "group_summary", "add_xct", "add_xct_batch", "recent_xct", "xct_range",
+    "user_spend", "top_payers", "user_rank", "balance_percentile", "settle",
+    "save", "load", "mem_stats", "stats", "quit", "(other)"
+};
+
+#define STATS_COMMANDS (sizeof(command_names) / sizeof(command_names[0]))
+
+static const char *const walk_names[STATS_WALKS] = {
+    "find_group", "find_user", "find_prev_user", "update_position",
+    "list_users", "under_paid", "recent_xct", "xct_range", "remove_xct"
+};
+
+static const char *const counter_names[STATS_COUNTERS] = {
+    "tree_nodes", "xct_chunks", "index_grows", "read_retries", "xct_spills", "segment_reads"
+};
+
+__thread struct stats_block *stats_local = NULL;
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_block *blocks = NULL;
+
+/* What the blocks summed to at the last stats reset; the walks' max is
+ * not reset */
+static struct stats_block baseline;
+static unsigned long baseline_histograms[STATS_COMMANDS][STATS_BUCKETS];
+
+/*
+ * Give the calling thread its block, the first time it counts anything.
+ */
+struct stats_block *stats_attach(void) {
+    struct stats_block *block = calloc(1, sizeof(struct stats_block));
+
+    if ( block == NULL || (block->histograms = calloc(STATS_COMMANDS, sizeof(*block->histograms))) == NULL ) {
+        printf("Error while allocating statistics. Program will now exit. \n");
+        exit(0);
+    }
+    pthread_mutex_lock(&blocks_lock);
+    block->next = blocks;
+    blocks = block;
+    pthread_mutex_unlock(&blocks_lock);
+    stats_local = block;
+    return block;
+}
+
+/*
+ * The histogram bucket of a latency: exact below STATS_SUB_BUCKETS ns,
+ * then STATS_SUB_BUCKETS buckets per power of two.
+ */
+static unsigned int bucket_of(unsigned long ns) {
+    if ( ns < STATS_SUB_BUCKETS ) {
+        return ns;
+    }
+    unsigned int exponent = 63 - __builtin_clzl(ns);
+    unsigned int sub = (ns >> (exponent - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (exponent - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+/* The middle of the latencies that go into bucket, in nanoseconds */
+static double bucket_value(unsigned int bucket) {
+    if ( bucket < STATS_SUB_BUCKETS ) {
+        return bucket;
+    }
+    unsigned int shift = bucket / STATS_SUB_BUCKETS - 1;
+    unsigned long low = (unsigned long) (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << shift;
+    return low + ((1UL << shift) - 1) / 2.0;
+}
+
+/*
+ * Record that the command called name took nanoseconds.
+ */
+void stats_command(const char *name, unsigned long nanoseconds) {
+    struct stats_block *block = stats_here();
+    unsigned int i;
+
+    for ( i = 0; i < STATS_COMMANDS - 1; i++ ) {
+        if ( strcmp(name, command_names[i]) == 0 ) {
+            break;
+        }
+    }
+    stats_add(&block->histograms[i][bucket_of(nanoseconds)], 1);
+}
+
+/*
+ * Sum every thread's block into total. Call with blocks_lock held.
+ */
+static void _sum_blocks(struct stats_block *total, unsigned long (*histograms)[STATS_BUCKETS]) {
+    struct stats_block *block;
+    unsigned int i, j;
+
+    memset(total, 0, sizeof(*total));
+    memset(histograms, 0, STATS_COMMANDS * sizeof(*histograms));
+    for ( block = blocks; block; block = block->next ) {
+        for ( i = 0; i < STATS_COUNTERS; i++ ) {
+            total->counters[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+        }
+        for ( i = 0; i < STATS_WALKS; i++ ) {
+            struct stats_walk_count *w = &block->walks[i];
+            unsigned long max = __atomic_load_n(&w->max, __ATOMIC_RELAXED);
+            total->walks[i].calls += __atomic_load_n(&w->calls, __ATOMIC_RELAXED);
+            total->walks[i].nodes += __atomic_load_n(&w->nodes, __ATOMIC_RELAXED);
+            if ( max > total->walks[i].max ) {
+                total->walks[i].max = max;
+            }
+        }
+        for ( i = 0; i < STATS_COMMANDS; i++ ) {
+            for ( j = 0; j < STATS_BUCKETS; j++ ) {
+                histograms[i][j] += __atomic_load_n(&block->histograms[i][j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/*
+ * Print, since the last reset, every command's count and latency
+ * percentiles, every walk's length, and the counters.
+ */
+void stats_print(void) {
+    static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    unsigned long (*histograms)[STATS_BUCKETS] = malloc(STATS_COMMANDS * sizeof(*histograms));
+    struct stats_block total;
+    unsigned int i, j, p;
+
+    if ( histograms == NULL ) {
+        printf("Error while allocating statistics. Program will now exit. \n");
+        exit(0);
+    }
+    pthread_mutex_lock(&blocks_lock);
+    _sum_blocks(&total, histograms);
+    for ( i = 0; i < STATS_COMMANDS; i++ ) {
+        for ( j = 0; j < STATS_BUCKETS; j++ ) {
+            histograms[i][j] -= baseline_histograms[i][j];
+        }
+    }
+    for ( i = 0; i < STATS_COUNTERS; i++ ) {
+        total.counters[i] -= baseline.counters[i];
+    }
+    for ( i = 0; i < STATS_WALKS; i++ ) {
+        total.walks[i].calls -= baseline.walks[i].calls;
+        total.walks[i].nodes -= baseline.walks[i].nodes;
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    out_printf("%-20s %10s %10s %10s %10s %10s %10s\n", "command", "count", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for ( i = 0; i < STATS_COMMANDS; i++ ) {
+        unsigned long count = 0, seen = 0;
+        unsigned int last = 0;
+
+        for ( j = 0; j < STATS_BUCKETS; j++ ) {
+            if ( histograms[i][j] ) {
+                count += histograms[i][j];
+                last = j;
+            }
+        }
+        if ( count == 0 ) {
+            continue;
+        }
+        out_printf("%-20s %10lu", command_names[i], count);
+        for ( j = 0, p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++ ) {
+            unsigned long rank = (unsigned long) (percentiles[p] * count + 0.999999);   // nearest rank
+            while ( seen + histograms[i][j] < rank ) {
+                seen += histograms[i][j++];
+            }
+            out_printf(" %10.2f", bucket_value(j) / 1000);
+        }
+        out_printf(" %10.2f\n", bucket_value(last) / 1000);
+    }
+
+    out_printf("%-20s %10s %12s %10s %10s\n", "walk", "calls", "nodes", "per call", "max");
+    for ( i = 0; i < STATS_WALKS; i++ ) {
+        struct stats_walk_count *w = &total.walks[i];
+        if ( w->calls ) {
+            out_printf("%-20s %10lu %12lu %10.2f %10lu\n", walk_names[i], w->calls, w->nodes, (double) w->nodes / w->calls, w->max);
+        }
+    }
+
+    out_printf("%-20s %10s\n", "counter", "value");
+    for ( i = 0; i < STATS_COUNTERS; i++ ) {
+        out_printf("%-20s %10lu\n", counter_names[i], total.counters[i]);
+    }
+    free(histograms);
+}
+
+/*
+ * Start the statistics over from zero.
+ */
+void stats_reset(void) {
+    pthread_mutex_lock(&blocks_lock);
+    _sum_blocks(&baseline, baseline_histograms);
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+#endif
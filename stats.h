@@ -0,0 +1,113 @@
+#ifndef STATS_H
+#define STATS_H
+
+/* Hot-path instrumentation, reported by the stats command.
+ *
+ * Every command run through process_args is timed with the monotonic
+ * clock into a per-command latency histogram. Buckets are log-linear
+ * (HDR-style): each power of two of nanoseconds is split into
+ * STATS_SUB_BUCKETS equal parts, so a percentile is read back to within
+ * 1/STATS_SUB_BUCKETS of its value. The walks in lists.c record how many
+ * nodes they visit, and a few rarer events are plain counters.
+ *
+ * Each thread counts into its own block, which is allocated on first use
+ * and kept for the life of the process, so updates never contend; stats
+ * sums the blocks of every thread that ever ran a command.
+ *
+ * Building with -DBUXFER_NO_STATS (make STATS=0) compiles all of it out.
+ */
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+/* Walks: calls, nodes visited in all of them, and the longest one */
+enum stats_walk {
+	WALK_FIND_GROUP,	/* directory bucket chain */
+	WALK_FIND_USER,	/* user index bucket chain */
+	WALK_FIND_PREV_USER,	/* find_user, plus the step back */
+	WALK_UPDATE_POSITION,	/* balance tree nodes to move a user */
+	WALK_LIST_USERS,	/* user list */
+	WALK_UNDER_PAID,
+	WALK_RECENT_XCT,	/* log records, removed ones included */
+	WALK_XCT_RANGE,	/* log records, removed ones included */
+	WALK_REMOVE_XCT,	/* one user's transaction chain */
+	STATS_WALKS
+};
+
+enum stats_counter {
+	COUNT_TREE_NODES,	/* balance tree nodes visited by insert, remove, next and select */
+	COUNT_XCT_CHUNKS,	/* transaction log chunks allocated */
+	COUNT_INDEX_GROWS,	/* user index and group directory doublings */
+	COUNT_READ_RETRIES,	/* lock-free reads started over */
+	COUNT_XCT_SPILLS,	/* transaction log chunks spilled to disk */
+	COUNT_SEGMENT_READS,	/* reads of spilled transactions */
+	STATS_COUNTERS
+};
+
+#ifdef BUXFER_NO_STATS
+
+#define STAT_COUNT(counter, n) ((void) (n))
+#define STAT_WALK(walk, nodes) ((void) (nodes))
+#define STAT_VALUE(counter) 0UL
+
+#else
+
+#include <time.h>
+
+struct stats_walk_count {
+	unsigned long calls;
+	unsigned long nodes;
+	unsigned long max;
+};
+
+struct stats_block {
+	struct stats_block *next;	/* every thread's block */
+	unsigned long counters[STATS_COUNTERS];
+	struct stats_walk_count walks[STATS_WALKS];
+	unsigned long (*histograms)[STATS_BUCKETS];	/* one per command name, see stats.c */
+};
+
+extern __thread struct stats_block *stats_local;
+
+struct stats_block *stats_attach(void);
+
+/* Add n to a counter of this thread's block. Only the owning thread
+ * writes it, so a relaxed store is enough for stats to read it. */
+static inline void stats_add(unsigned long *counter, unsigned long n) {
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline struct stats_block *stats_here(void) {
+	return stats_local ? stats_local : stats_attach();
+}
+
+static inline void stats_walk(enum stats_walk walk, unsigned long nodes) {
+	struct stats_walk_count *w = &stats_here()->walks[walk];
+
+	stats_add(&w->calls, 1);
+	stats_add(&w->nodes, nodes);
+	if ( nodes > w->max ) {
+		__atomic_store_n(&w->max, nodes, __ATOMIC_RELAXED);
+	}
+}
+
+static inline unsigned long stats_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#define STAT_COUNT(counter, n) stats_add(&stats_here()->counters[counter], (n))
+#define STAT_WALK(walk, nodes) stats_walk((walk), (nodes))
+#define STAT_VALUE(counter) (stats_here()->counters[counter])
+
+void stats_command(const char *name, unsigned long nanoseconds);
+
+#endif
+
+void stats_print(void);
+void stats_reset(void);
+
+#endif
@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "xctlog.h"
+#include "stats.h"
+
+#define XCT_INDEX_INITIAL 16
+
+/* Records kept in memory per log, 0 for all, and where the rest go; NULL
+ * for $TMPDIR or /tmp. Read when a log is initialized. */
+unsigned long xct_hot_records = 0;
+const char *xct_spill_dir = NULL;
+
+/* Chunk ids past this would give refs that don't fit in an XctRef */
+#define XCT_MAX_CHUNKS ((unsigned int) (UINT32_MAX / XCT_CHUNK_RECORDS))
+
+/* Initialize an empty transaction log.
+ */
+void xct_log_init(XctLog *log) {
+    log->head = NULL;
+    log->tail = NULL;
+    log->count = 0;
+    log->last_time = 0;
+    log->index = NULL;
+    log->nchunks = 0;
+    log->index_capacity = 0;
+    log->table = NULL;
+    log->table_count = 0;
+    log->table_capacity = 0;
+    log->free_chunk_ids = NULL;
+    log->free_chunk_count = 0;
+    log->retired = NULL;
+    pool_init(&log->chunks, XCT_CHUNK_BYTES, XCT_CHUNK_BYTES, 1);
+    // whole chunks, enough for xct_hot_records, and the tail being filled
+    log->hot_chunks = xct_hot_records ? (xct_hot_records + XCT_CHUNK_RECORDS - 1) / XCT_CHUNK_RECORDS + 1 : 0;
+    log->cold_fd = -1;
+    log->cold_count = 0;
+    log->cold_live = 0;
+    log->cold_last_time = 0;
+    log->cold_cut = NULL;
+    log->cold_cut_capacity = 0;
+}
+
+/*
+ * Add chunk, the new tail, to the end of the log's chunk index. An index
+ * that is outgrown is kept until the log is released, since a reader of a
+ * shared group may still be searching it; the old ones add up to less
+ * than the current one.
+ */
+static void index_push(XctLog *log, struct xct_chunk *chunk) {
+    if ( log->nchunks == log->index_capacity ) {
+        unsigned long capacity = log->index_capacity ? log->index_capacity * 2 : XCT_INDEX_INITIAL;
+        struct xct_chunk **index = malloc(capacity * sizeof(struct xct_chunk *));
+        struct retired *old = malloc(sizeof(struct retired));
+        unsigned long i;
+
+        if ( index == NULL || old == NULL ) {
+            printf("Error while growing transaction index. Program will now exit. \n");
+            exit(0);
+        }
+        for ( i = 0; i < log->nchunks; i++ ) {
+            index[i] = log->index[i];
+        }
+        old->ptr = log->index;
+        old->next = log->retired;
+        log->retired = old;
+        log->index = index;
+        log->index_capacity = capacity;
+    }
+    log->index[log->nchunks] = chunk;
+    __atomic_store_n(&log->nchunks, log->nchunks + 1, __ATOMIC_RELEASE);  // readers load nchunks, then index
+}
+
+/*
+ * Give chunk an id in the log's chunk table, reusing those of freed chunks
+ * first. An outgrown table is kept until the log is released, as the
+ * index is.
+ */
+static void table_add(XctLog *log, struct xct_chunk *chunk) {
+    if ( log->free_chunk_count > 0 ) {
+        chunk->id = log->free_chunk_ids[--log->free_chunk_count];
+        __atomic_store_n(&log->table[chunk->id], chunk, __ATOMIC_RELAXED);
+        return;
+    }
+    if ( log->table_count == log->table_capacity ) {
+        unsigned int capacity = log->table_capacity ? log->table_capacity * 2 : XCT_INDEX_INITIAL;
+        struct xct_chunk **table = malloc(capacity * sizeof(struct xct_chunk *));
+        unsigned int *freeIds = realloc(log->free_chunk_ids, capacity * sizeof(unsigned int));
+        struct retired *old = malloc(sizeof(struct retired));
+
+        if ( log->table_count == XCT_MAX_CHUNKS || table == NULL || freeIds == NULL || old == NULL ) {
+            printf("Error while growing transaction table. Program will now exit. \n");
+            exit(0);
+        }
+        if ( log->table_count ) {
+            memcpy(table, log->table, log->table_count * sizeof(struct xct_chunk *));
+        }
+        old->ptr = log->table;
+        old->next = log->retired;
+        log->retired = old;
+        log->free_chunk_ids = freeIds;
+        log->table_capacity = capacity;
+        __atomic_store_n(&log->table, table, __ATOMIC_RELEASE);    // filled in before readers see it
+    }
+    chunk->id = log->table_count++;
+    log->table[chunk->id] = chunk;
+}
+
+/*
+ * Take chunk out of the log's chunk index, keeping the rest in order.
+ */
+static void index_remove(XctLog *log, struct xct_chunk *chunk) {
+    unsigned long i = 0;
+
+    while ( log->index[i] != chunk ) {
+        i++;
+    }
+    for ( ; i + 1 < log->nchunks; i++ ) {
+        // a whole pointer at a time, so a concurrent reader never sees half of one
+        __atomic_store_n(&log->index[i], log->index[i + 1], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&log->nchunks, log->nchunks - 1, __ATOMIC_RELEASE);
+}
+
+/* Return a pointer to a new record at the end of log, with its time set,
+ * for the caller to fill in the rest. time must not be before the time of
+ * the last record appended. A new chunk is allocated only when the tail
+ * chunk is full and still holds records that have not been removed.
+ */
+Xct *xct_log_append(XctLog *log, uint32_t time) {
+    struct xct_chunk *chunk = log->tail;
+
+    if ( chunk && chunk->count == XCT_CHUNK_RECORDS && chunk->live == 0 ) {
+        chunk->count = 0;   // everything in the tail was removed, start it over
+    } else if ( chunk == NULL || chunk->count == XCT_CHUNK_RECORDS ) {
+        chunk = pool_alloc(&log->chunks);    // exits if out of memory
+        STAT_COUNT(COUNT_XCT_CHUNKS, 1);
+        chunk->count = 0;
+        chunk->live = 0;
+        chunk->next = NULL;
+        chunk->prev = log->tail;
+        if ( log->tail ) {
+            log->tail->next = chunk;
+        } else {
+            log->head = chunk;
+        }
+        log->tail = chunk;
+        index_push(log, chunk);
+        table_add(log, chunk);
+    }
+
+    log->count++;
+    log->last_time = time;
+    chunk->live++;
+    chunk->records[chunk->count].time = time;
+    return &chunk->records[chunk->count++];
+}
+
+/* Mark xct as removed. Returns its chunk to the pool if that was the
+ * chunk's last remaining record, unless it is the tail, which append
+ * reuses instead.
+ */
+void xct_log_remove(XctLog *log, Xct *xct) {
+    struct xct_chunk *chunk = XCT_CHUNK_OF(xct);
+
+    xct->user_id = XCT_REMOVED;
+    log->count--;
+    if ( --chunk->live > 0 || chunk == log->tail ) {
+        return;
+    }
+
+    if ( chunk->prev ) {
+        chunk->prev->next = chunk->next;
+    } else {
+        log->head = chunk->next;
+    }
+    chunk->next->prev = chunk->prev;    // not the tail, so there is a next
+    index_remove(log, chunk);
+    log->free_chunk_ids[log->free_chunk_count++] = chunk->id;  // the table keeps pointing at it
+    pool_free(&log->chunks, chunk);
+}
+
+/* Return the first record of log (removed or not) whose time is at or
+ * after time, or NULL if there is none. A binary search over the chunk
+ * index, then over the records of one chunk.
+ */
+Xct *xct_log_seek(XctLog *log, uint32_t time) {
+    unsigned long nchunks = __atomic_load_n(&log->nchunks, __ATOMIC_ACQUIRE);
+    struct xct_chunk **index = log->index;
+    unsigned long lo = 0, hi = nchunks, count;
+    struct xct_chunk *chunk;
+
+    // the first chunk whose last record is at or after time
+    while ( lo < hi ) {
+        unsigned long mid = lo + (hi - lo) / 2;
+        chunk = index[mid];
+        count = chunk->count < XCT_CHUNK_RECORDS ? chunk->count : XCT_CHUNK_RECORDS;
+        if ( count == 0 || chunk->records[count - 1].time < time ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ( lo == nchunks ) {
+        return NULL;
+    }
+
+    chunk = index[lo];
+    count = chunk->count < XCT_CHUNK_RECORDS ? chunk->count : XCT_CHUNK_RECORDS;
+    for ( lo = 0, hi = count; lo < hi; ) {
+        unsigned long mid = lo + (hi - lo) / 2;
+        if ( chunk->records[mid].time < time ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < count ? &chunk->records[lo] : NULL;
+}
+
+/* Return the record after xct in log order (removed or not), or NULL if
+ * xct is the last.
+ */
+Xct *xct_log_next(Xct *xct) {
+    struct xct_chunk *chunk = XCT_CHUNK_OF(xct);
+
+    if ( (unsigned long) (xct + 1 - chunk->records) < chunk->count ) {
+        return xct + 1;
+    }
+    for ( chunk = chunk->next; chunk; chunk = chunk->next ) {
+        if ( chunk->count ) {
+            return chunk->records;
+        }
+    }
+    return NULL;
+}
+
+/* Return the ref of xct, a record of the log.
+ */
+XctRef xct_log_ref(const Xct *xct) {
+    struct xct_chunk *chunk = XCT_CHUNK_OF(xct);
+
+    return chunk->id * (XctRef) XCT_CHUNK_RECORDS + (XctRef) (xct - chunk->records);
+}
+
+/* Return the record of log that ref, from xct_log_ref, refers to. A reader
+ * of a shared group holding a ref to a record that has since been removed
+ * gets some record, never a wild pointer: ids stay in the table and freed
+ * chunks stay in the pool.
+ */
+Xct *xct_log_at(XctLog *log, XctRef ref) {
+    struct xct_chunk **table = __atomic_load_n(&log->table, __ATOMIC_ACQUIRE);
+
+    return &table[ref / XCT_CHUNK_RECORDS]->records[ref % XCT_CHUNK_RECORDS];
+}
+
+/* Free every chunk of log at once, and close its cold segment. The log is
+ * left empty.
+ */
+void xct_log_release(XctLog *log) {
+    struct retired *old, *next;
+
+    pool_release(&log->chunks);
+    if ( log->cold_fd != -1 ) {
+        close(log->cold_fd);
+    }
+    free(log->cold_cut);
+    log->cold_fd = -1;
+    log->cold_count = 0;
+    log->cold_live = 0;
+    log->cold_last_time = 0;
+    log->cold_cut = NULL;
+    log->cold_cut_capacity = 0;
+    for ( old = log->retired; old; old = next ) {
+        next = old->next;
+        free(old->ptr);
+        free(old);
+    }
+    free(log->index);
+    free(log->table);
+    free(log->free_chunk_ids);
+    log->head = NULL;
+    log->tail = NULL;
+    log->count = 0;
+    log->index = NULL;
+    log->nchunks = 0;
+    log->index_capacity = 0;
+    log->table = NULL;
+    log->table_count = 0;
+    log->table_capacity = 0;
+    log->free_chunk_ids = NULL;
+    log->free_chunk_count = 0;
+    log->retired = NULL;
+}
+
+/*
+ * Create the log's cold segment in the spill directory. The file is
+ * unlinked at once, so it goes away with the process.
+ */
+static void open_segment(XctLog *log) {
+    const char *dir = xct_spill_dir ? xct_spill_dir : getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    size_t dirLen = strlen(dir);
+    char *path = malloc(dirLen + sizeof("/buxfer-XXXXXX"));
+    int fd = -1;
+
+    if ( path ) {
+        memcpy(path, dir, dirLen);
+        memcpy(path + dirLen, "/buxfer-XXXXXX", sizeof("/buxfer-XXXXXX"));
+        fd = mkstemp(path);
+    }
+    if ( fd == -1 ) {
+        printf("Error while creating transaction segment. Program will now exit. \n");
+        exit(0);
+    }
+    unlink(path);
+    free(path);
+    log->cold_fd = fd;
+}
+
+/*
+ * Read up to n records of the log's cold segment, starting at index, into
+ * buf. Returns the number of records read.
+ */
+static unsigned long cold_read(const XctLog *log, unsigned long index, Xct *buf, unsigned long n) {
+    size_t done = 0, want = n * sizeof(Xct);
+
+    STAT_COUNT(COUNT_SEGMENT_READS, 1);
+    while ( done < want ) {
+        ssize_t got = pread(log->cold_fd, (char *) buf + done, want - done, (off_t) (index * sizeof(Xct) + done));
+        if ( got <= 0 ) {
+            break;
+        }
+        done += got;
+    }
+    return done / sizeof(Xct);
+}
+
+/* Append the live records of the log's oldest chunk to its cold segment
+ * and free the chunk. The head must not be the tail, and the caller must
+ * be done with its records. Exits if the segment can't be written.
+ */
+void xct_log_spill_head(XctLog *log) {
+    struct xct_chunk *chunk = log->head;
+    unsigned long i, live = 0;
+    size_t done = 0, want;
+
+    if ( log->cold_fd == -1 ) {
+        open_segment(log);
+    }
+    // gather the live records at the front of the chunk, which is on its way out
+    for ( i = 0; i < chunk->count; i++ ) {
+        if ( chunk->records[i].user_id != XCT_REMOVED ) {
+            chunk->records[live++] = chunk->records[i];
+        }
+    }
+    want = live * sizeof(Xct);
+    while ( done < want ) {
+        ssize_t put = pwrite(log->cold_fd, (char *) chunk->records + done, want - done,
+                (off_t) (log->cold_count * sizeof(Xct) + done));
+        if ( put <= 0 ) {
+            printf("Error while spilling transactions. Program will now exit. \n");
+            exit(0);
+        }
+        done += put;
+    }
+    if ( live ) {
+        log->cold_last_time = chunk->records[live - 1].time;
+    }
+    log->cold_live += live;
+    __atomic_store_n(&log->cold_count, log->cold_count + live, __ATOMIC_RELEASE);    // written before readers see it
+    STAT_COUNT(COUNT_XCT_SPILLS, 1);
+
+    log->head = chunk->next;
+    chunk->next->prev = NULL;
+    index_remove(log, chunk);
+    log->free_chunk_ids[log->free_chunk_count++] = chunk->id;
+    pool_free(&log->chunks, chunk);
+}
+
+/* Mark the records of user_id now in the log's cold segment as removed,
+ * for when the user is removed; the id's later records are not affected.
+ * An outgrown cut table is kept until the log is released.
+ */
+void xct_log_cut(XctLog *log, unsigned int user_id) {
+    if ( user_id >= log->cold_cut_capacity ) {
+        unsigned int capacity = log->cold_cut_capacity ? log->cold_cut_capacity : XCT_INDEX_INITIAL;
+        while ( capacity <= user_id ) {
+            capacity *= 2;
+        }
+        unsigned long *cut = calloc(capacity, sizeof(unsigned long));
+        struct retired *old = malloc(sizeof(struct retired));
+
+        if ( cut == NULL || old == NULL ) {
+            printf("Error while growing transaction cuts. Program will now exit. \n");
+            exit(0);
+        }
+        if ( log->cold_cut_capacity ) {
+            memcpy(cut, log->cold_cut, log->cold_cut_capacity * sizeof(unsigned long));
+        }
+        old->ptr = log->cold_cut;
+        old->next = log->retired;
+        log->retired = old;
+        __atomic_store_n(&log->cold_cut, cut, __ATOMIC_RELEASE);
+        __atomic_store_n(&log->cold_cut_capacity, capacity, __ATOMIC_RELEASE);  // readers load it, then cold_cut
+    }
+    log->cold_cut[user_id] = log->cold_count;
+}
+
+/* Return 1 if xct, the record at index of the log's cold segment, has not
+ * been removed, and 0 if it has.
+ */
+int xct_log_cold_live(const XctLog *log, const Xct *xct, unsigned long index) {
+    unsigned int capacity = __atomic_load_n(&log->cold_cut_capacity, __ATOMIC_ACQUIRE);
+    const unsigned long *cut = __atomic_load_n(&log->cold_cut, __ATOMIC_ACQUIRE);
+
+    return xct->user_id != XCT_REMOVED && (xct->user_id >= capacity || index >= cut[xct->user_id]);
+}
+
+/* Return the index of the first record of the log's cold segment whose
+ * time is at or after time, or the number of records in it if there is
+ * none. A binary search that reads one record per step.
+ */
+unsigned long xct_log_cold_seek(const XctLog *log, uint32_t time) {
+    unsigned long lo = 0, hi = __atomic_load_n(&log->cold_count, __ATOMIC_ACQUIRE);
+    Xct xct;
+
+    while ( lo < hi ) {
+        unsigned long mid = lo + (hi - lo) / 2;
+        if ( cold_read(log, mid, &xct, 1) != 1 || xct.time < time ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Start stream on the cold segment of log, with nothing buffered.
+ */
+void xct_stream_init(struct xct_stream *stream, const XctLog *log) {
+    stream->log = log;
+    stream->pos = 0;
+    stream->len = 0;
+}
+
+/* Return the record at index of the stream's segment, or NULL if there is
+ * none. An index outside the buffer refills it with one read: starting at
+ * index if it is after the buffer, ending at index if it is before, so a
+ * walk in either direction reads XCT_STREAM_RECORDS at a time.
+ */
+const Xct *xct_stream_at(struct xct_stream *stream, unsigned long index) {
+    unsigned long count = __atomic_load_n(&stream->log->cold_count, __ATOMIC_ACQUIRE);
+
+    if ( index - stream->pos < stream->len ) {
+        return &stream->buf[index - stream->pos];
+    }
+    if ( index >= count ) {
+        return NULL;
+    }
+    if ( index < stream->pos ) {
+        stream->pos = index + 1 > XCT_STREAM_RECORDS ? index + 1 - XCT_STREAM_RECORDS : 0;
+    } else {
+        stream->pos = index;
+    }
+    stream->len = cold_read(stream->log, stream->pos, stream->buf,
+            count - stream->pos < XCT_STREAM_RECORDS ? count - stream->pos : XCT_STREAM_RECORDS);
+    return index - stream->pos < stream->len ? &stream->buf[index - stream->pos] : NULL;
+}
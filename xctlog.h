@@ -0,0 +1,87 @@
+#ifndef XCTLOG_H
+#define XCTLOG_H
+
+#include <stdint.h>
+#include "lists.h"
+
+/* A group's transactions are fixed-size Xct records appended to a log of
+ * XCT_CHUNK_BYTES chunks, so posting a transaction is a slot bump and only
+ * every XCT_CHUNK_RECORDS-th one allocates. Reading the log backwards
+ * (most recent first) walks each chunk's records contiguously.
+ *
+ * Records never move. Removing one marks it XCT_REMOVED in place; a chunk
+ * whose records have all been removed goes back to the log's chunk pool
+ * (or, for the tail, is reused). Chunks are aligned to their size, so a
+ * record's chunk is found by masking its address.
+ *
+ * Each chunk also has a small id, its slot in the log's chunk table, and
+ * a record is named elsewhere by a 32-bit XctRef, id * XCT_CHUNK_RECORDS
+ * plus its place in the chunk, half the size of a pointer. The ids of
+ * freed chunks are reused, so the refs of a log never run out while it
+ * holds fewer than 2^32 records.
+ *
+ * Records are appended in time order, and the log keeps an array of its
+ * chunks, oldest first, so the first record at or after a given time is
+ * found by binary search (xct_log_seek) and a time range is then read
+ * contiguously with xct_log_next.
+ *
+ * With xct_hot_records set, a log keeps only its newest chunks in memory,
+ * enough for that many records plus the one being filled. Once it has
+ * more, the oldest chunk's live records are appended to the log's cold
+ * segment, an unlinked file in xct_spill_dir, and the chunk is freed; the
+ * caller first folds the records into its own per-user checkpoints. The
+ * segment holds Xct records in time order, named by their index in it,
+ * and is read with pread through an xct_stream, which buffers
+ * XCT_STREAM_RECORDS at a time in whichever direction it is walked. A
+ * record on disk is never rewritten: removing a user instead cuts their id
+ * at the current end of the segment (xct_log_cut), and xct_log_cold_live
+ * skips the id's records before the cut.
+ */
+
+#define XCT_CHUNK_BYTES 65536
+
+struct xct_chunk {
+	struct xct_chunk *prev;
+	struct xct_chunk *next;
+	unsigned long count;	/* records in use, including removed ones */
+	unsigned long live;	/* records not removed */
+	unsigned int id;	/* the chunk's slot in the log's chunk table */
+	Xct records[];
+};
+
+#define XCT_CHUNK_RECORDS \
+	((XCT_CHUNK_BYTES - sizeof(struct xct_chunk)) / sizeof(Xct))
+
+#define XCT_CHUNK_OF(xct) \
+	((struct xct_chunk *) ((uintptr_t) (xct) & ~(uintptr_t) (XCT_CHUNK_BYTES - 1)))
+
+#define XCT_STREAM_RECORDS 4096
+
+/* A buffered reader of a log's cold segment, see xct_stream_at */
+struct xct_stream {
+	const XctLog *log;
+	unsigned long pos;	/* segment index of buf[0] */
+	unsigned long len;	/* records in buf */
+	Xct buf[XCT_STREAM_RECORDS];
+};
+
+extern unsigned long xct_hot_records;
+extern const char *xct_spill_dir;
+
+void xct_log_init(XctLog *log);
+Xct *xct_log_append(XctLog *log, uint32_t time);
+void xct_log_remove(XctLog *log, Xct *xct);
+Xct *xct_log_seek(XctLog *log, uint32_t time);
+Xct *xct_log_next(Xct *xct);
+XctRef xct_log_ref(const Xct *xct);
+Xct *xct_log_at(XctLog *log, XctRef ref);
+void xct_log_release(XctLog *log);
+
+void xct_log_spill_head(XctLog *log);
+void xct_log_cut(XctLog *log, unsigned int user_id);
+int xct_log_cold_live(const XctLog *log, const Xct *xct, unsigned long index);
+unsigned long xct_log_cold_seek(const XctLog *log, uint32_t time);
+void xct_stream_init(struct xct_stream *stream, const XctLog *log);
+const Xct *xct_stream_at(struct xct_stream *stream, unsigned long index);
+
+#endif